@@ -0,0 +1,955 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include "packet-struct.h"
+#include "event-struct.h"
+#include "state.h"
+#include "tapfilter.h"
+
+/* Benchmarks, for telling whether a change made things faster.
+ *
+ * Micro benchmarks time the inner loops the tools share on data made up
+ * here: reading packets, unscrambling NAND bytes, the joiner's window
+ * match, taking and putting back the grouper's open events, and sorting
+ * keys.  Macro benchmarks generate captures with the generator and run
+ * the joiner, grouper and sorter over them, one after the other, as
+ * separate processes, and then the same pipeline in one process through
+ * libtapfilter.
+ *
+ * Every result is one line, as text or as JSON (-f json), giving the time
+ * taken, rates, peak RSS and system calls made (syscr + syscw from
+ * /proc/<pid>/io).  -c compares two files of JSON results, benchmark by
+ * benchmark.
+ */
+
+#define MICRO_CAPTURE "4M"
+#define UNSCRAMBLE_BYTES (1024 * 1024)
+#define TAKE_PUT_ROUNDS (1024 * 1024)
+#define SORT_KEYS (1024 * 1024)
+
+// As in joiner.c
+#define SKIP_AMOUNT 80
+#define REQUIRED_MATCHES (SKIP_AMOUNT*30/100)
+
+struct result {
+    const char *kind;
+    const char *name;
+    const char *corpus;
+
+    double seconds;
+    uint64_t ops;
+    const char *unit;
+
+    uint64_t bytes, packets, events;
+    long max_rss_kb;
+    int64_t syscalls;
+    double user, sys;
+};
+
+// Standard corpora, all generated from the same seed
+static const struct corpus {
+    const char *name;
+    const char *weights;
+} corpora[] = {
+    { "mixed",  "80,15,5" },
+    { "nand",   "100,0,0" },
+    { "sd",     "20,75,5" },
+};
+
+static int json;
+static double min_time = 0.5;
+static int repeats = 3;
+static uint64_t corpus_size = 64ULL * 1024 * 1024;
+static unsigned long long seed = 1;
+static const char *bin_dir = ".";
+static char work_dir[1024];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_size(const char *str, uint64_t *size) {
+    char *end;
+
+    errno = 0;
+    *size = strtoull(str, &end, 0);
+    if (errno || end == str)
+        return -1;
+    switch (*end) {
+    case 'T': *size <<= 10;     /* fall through */
+    case 'G': *size <<= 10;     /* fall through */
+    case 'M': *size <<= 10;     /* fall through */
+    case 'k': *size <<= 10;
+        end++;
+        break;
+    }
+    return *end ? -1 : 0;
+}
+
+// System calls made so far by pid (0 for this process), or -1 if unknown
+static int64_t syscalls(pid_t pid) {
+    char path[64], line[128];
+    int64_t total = 0;
+    long long n;
+    int found = 0;
+    FILE *f;
+
+    if (pid)
+        snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    else
+        snprintf(path, sizeof(path), "/proc/self/io");
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "syscr: %lld", &n) == 1
+         || sscanf(line, "syscw: %lld", &n) == 1) {
+            total += n;
+            found++;
+        }
+    }
+    fclose(f);
+    return found == 2 ? total : -1;
+}
+
+static void print_result(const struct result *r) {
+    double s = r->seconds > 0 ? r->seconds : 1e-9;
+
+    if (json) {
+        printf("{\"kind\":\"%s\",\"name\":\"%s\",\"corpus\":\"%s\","
+               "\"seconds\":%.6f,\"ops\":%llu,\"unit\":\"%s\",\"ops_s\":%.1f,"
+               "\"bytes\":%llu,\"mb_s\":%.2f,\"packets\":%llu,\"packets_s\":%.1f,"
+               "\"events\":%llu,\"events_s\":%.1f,\"max_rss_kb\":%ld,"
+               "\"syscalls\":%lld,\"user_s\":%.3f,\"sys_s\":%.3f}\n",
+               r->kind, r->name, r->corpus, r->seconds,
+               (unsigned long long)r->ops, r->unit, r->ops / s,
+               (unsigned long long)r->bytes, r->bytes / s / 1e6,
+               (unsigned long long)r->packets, r->packets / s,
+               (unsigned long long)r->events, r->events / s,
+               r->max_rss_kb, (long long)r->syscalls, r->user, r->sys);
+    }
+    else {
+        printf("%-5s %-20s %-8s %9.3f s %14.0f %s/s", r->kind, r->name,
+               r->corpus, r->seconds, r->ops / s, r->unit);
+        if (r->bytes)
+            printf(", %.1f MB/s", r->bytes / s / 1e6);
+        if (r->packets && strcmp(r->unit, "packets"))
+            printf(", %.0f packets/s", r->packets / s);
+        if (r->events && strcmp(r->unit, "events"))
+            printf(", %.0f events/s", r->events / s);
+        printf(", rss %ld kB, %lld syscalls\n",
+               r->max_rss_kb, (long long)r->syscalls);
+    }
+    fflush(stdout);
+}
+
+
+/* Micro benchmarks.  Each round sets itself up, times its own work and
+ * adds what it did to the result; rounds are repeated until they've taken
+ * at least min_time (-t) between them.  Each benchmark runs in a child of
+ * its own, so the CPU time and system calls are its alone, and its peak
+ * RSS is this process's at the fork, with the data set up for it, plus
+ * whatever the benchmark grows it by.
+ */
+static int micro(const char *name, const char *corpus, const char *unit,
+                 double (*round)(struct result *r, void *arg), void *arg) {
+    struct result *r;
+    struct rusage ru;
+    siginfo_t info;
+    int64_t calls;
+    int status;
+    int ret = -1;
+    pid_t pid;
+
+    // The child's counts come back through a shared page
+    r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED) {
+        perror("Couldn't map result");
+        return -1;
+    }
+    r->kind = "micro";
+    r->name = name;
+    r->corpus = corpus;
+    r->unit = unit;
+
+    pid = fork();
+    if (pid == -1) {
+        perror("Couldn't fork");
+        goto out;
+    }
+    if (!pid) {
+        while (r->seconds < min_time) {
+            double t = round(r, arg);
+            if (t < 0)
+                _exit(1);
+            r->seconds += t;
+        }
+        _exit(0);
+    }
+
+    // Its I/O counts go away once it's reaped
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1) {
+        perror("Couldn't wait for benchmark");
+        goto out;
+    }
+    calls = syscalls(pid);
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        perror("Couldn't wait for benchmark");
+        goto out;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "%s failed (status %d)\n", name,
+                WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+        goto out;
+    }
+
+    r->max_rss_kb = ru.ru_maxrss;
+    r->syscalls = calls;
+    r->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    r->sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    print_result(r);
+    ret = 0;
+out:
+    munmap(r, sizeof(*r));
+    return ret;
+}
+
+// Read every packet of a capture, as the joiner does
+static double round_packet_get_next_raw(struct result *r, void *arg) {
+    struct state st;
+    struct pkt pkt;
+    double start;
+
+    memset(&st, 0, sizeof(st));
+    st.fd = open(arg, O_RDONLY);
+    if (st.fd == -1) {
+        perror("Unable to open capture");
+        return -1;
+    }
+
+    start = now();
+    while (packet_get_next_raw(&st, &pkt) == 0) {
+        r->packets++;
+        r->bytes += pkt.header.size;
+    }
+    start = now() - start;
+
+    r->ops = r->packets;
+    close(st.fd);
+    return start;
+}
+
+static double round_unscramble(struct result *r, void *arg) {
+    const uint8_t *bytes = arg;
+    volatile uint8_t sink;
+    uint8_t acc = 0;
+    double start = now();
+    size_t i;
+
+    for (i=0; i<UNSCRAMBLE_BYTES; i++)
+        acc ^= nand_unscramble_byte(bytes[i]);
+    sink = acc;
+    (void)sink;
+
+    r->ops += UNSCRAMBLE_BYTES;
+    r->bytes += UNSCRAMBLE_BYTES;
+    return now() - start;
+}
+
+/* One of the joiner's searches at its worst: nothing matches, so every
+ * run of new cycles is tried at every place in the old ones.
+ */
+static double round_window_match(struct result *r, void *arg) {
+    struct pkt *pkts = arg;
+    struct pkt *old_pkts = pkts + SKIP_AMOUNT;
+    volatile int sink;
+    int found = 0;
+    int i, j;
+    double start = now();
+
+    for (i=0; i + REQUIRED_MATCHES < SKIP_AMOUNT; i++)
+        for (j=0; j + REQUIRED_MATCHES < SKIP_AMOUNT; j++)
+            if (nand_cycles_match(pkts + i, old_pkts + j, REQUIRED_MATCHES)
+                    >= REQUIRED_MATCHES - 1)
+                found++;
+    sink = found;
+    (void)sink;
+
+    r->ops++;
+    r->packets += (uint64_t)(SKIP_AMOUNT - REQUIRED_MATCHES)
+                * (SKIP_AMOUNT - REQUIRED_MATCHES) * REQUIRED_MATCHES;
+    return now() - start;
+}
+
+/* The grouper keeps a handful of events open, and takes one out and puts
+ * it back for nearly every packet.
+ */
+static const int open_types[] = {
+    EVT_NET_CMD, EVT_BUFFER_DRAIN, EVT_SD_MULTI, EVT_SD_CMD,
+};
+
+static double round_take_put(struct result *r, void *arg) {
+    struct state *st = arg;
+    int n = sizeof(open_types) / sizeof(open_types[0]);
+    double start = now();
+    int i;
+
+    for (i=0; i<TAKE_PUT_ROUNDS; i++) {
+        void *evt = evt_take(st, open_types[i % n]);
+        if (!evt || evt_put(st, evt)) {
+            fprintf(stderr, "Lost an open event\n");
+            return -1;
+        }
+    }
+
+    r->ops += TAKE_PUT_ROUNDS;
+    return now() - start;
+}
+
+struct sort_bench {
+    struct sort_key *keys, *work;
+    size_t count;
+};
+
+static double round_sort(struct result *r, void *arg) {
+    struct sort_bench *b = arg;
+    double start;
+
+    memcpy(b->work, b->keys, b->count * sizeof(*b->keys));
+    start = now();
+    if (sort_keys(b->work, b->count))
+        return -1;
+    start = now() - start;
+
+    r->ops += b->count;
+    return start;
+}
+
+// Keys as the grouper would leave them, with one in `late` out of place
+static void make_keys(struct sort_key *keys, size_t count, int late) {
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    uint64_t t = 1000000000ULL;
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        t += 100 + rng % 10000;
+        keys[i].time = ((t / 1000000000ULL) << 32) | (t % 1000000000ULL);
+        keys[i].offset = i * 64;
+        keys[i].size = 64;
+        if (late && rng % late == 0 && i > 64)
+            keys[i].time = keys[i - 1 - (rng >> 32) % 64].time - 1;
+    }
+    if (late == 1) {
+        for (i=count - 1; i > 0; i--) {
+            struct sort_key k = keys[i];
+            size_t j;
+
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            j = rng % (i + 1);
+            keys[i] = keys[j];
+            keys[j] = k;
+        }
+    }
+}
+
+
+/* The whole pipeline through libtapfilter, in one process */
+#define LIBRARY "library"
+
+static int run_library(const char *capture, const char *sorted) {
+    int in_fd, out_fd;
+
+    in_fd = open(capture, O_RDONLY);
+    if (in_fd == -1) {
+        perror("Unable to open capture");
+        return -1;
+    }
+    out_fd = open(sorted, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        perror("Unable to open output file");
+        return -1;
+    }
+    return tf_pipeline(in_fd, out_fd, NULL, NULL);
+}
+
+/* Run one of the tools (or LIBRARY, with input and output), to
+ * completion, and fill in what it cost
+ */
+static int run_tool(struct result *r, char *const argv[]) {
+    struct rusage ru;
+    siginfo_t info;
+    double start = now();
+    int64_t calls;
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == -1) {
+        perror("Couldn't fork");
+        return -1;
+    }
+    if (!pid) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null != -1) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        if (!strcmp(argv[0], LIBRARY))
+            _exit(run_library(argv[1], argv[2]) ? 1 : 0);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    // Its I/O counts go away once it's reaped
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1) {
+        perror("Couldn't wait for tool");
+        return -1;
+    }
+    calls = syscalls(pid);
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        perror("Couldn't wait for tool");
+        return -1;
+    }
+    r->seconds += now() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "%s failed (status %d)\n", argv[0],
+                WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+        return -1;
+    }
+
+    if (ru.ru_maxrss > r->max_rss_kb)
+        r->max_rss_kb = ru.ru_maxrss;
+    if (calls < 0 || r->syscalls < 0)
+        r->syscalls = -1;
+    else
+        r->syscalls += calls;
+    r->user += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    r->sys += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    return 0;
+}
+
+/* Run a stage -r times, and keep the fastest: anything slower was held up
+ * by something else.
+ */
+static int run_stage(struct result *r, char *const argv[]) {
+    struct result best;
+    int i;
+
+    for (i=0; i<repeats; i++) {
+        struct result run = *r;
+
+        if (run_tool(&run, argv))
+            return -1;
+        if (!i || run.seconds < best.seconds)
+            best = run;
+    }
+    *r = best;
+    return 0;
+}
+
+static uint8_t *map_file(const char *path, uint64_t *size) {
+    struct stat stat_buf;
+    uint8_t *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Unable to open file");
+        return NULL;
+    }
+    if (fstat(fd, &stat_buf) == -1) {
+        perror("Couldn't stat file");
+        close(fd);
+        return NULL;
+    }
+    *size = stat_buf.st_size;
+    map = mmap(NULL, *size ? *size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Couldn't map file");
+        return NULL;
+    }
+    madvise(map, *size, MADV_SEQUENTIAL);
+    return map;
+}
+
+static int count_packets(const char *path, uint64_t *bytes, uint64_t *count) {
+    uint64_t offset = 0;
+    uint8_t *map;
+
+    map = map_file(path, bytes);
+    if (!map)
+        return -1;
+    *count = 0;
+    while (offset + sizeof(struct pkt_header) <= *bytes) {
+        struct pkt_header hdr;
+
+        memcpy(&hdr, map + offset, sizeof(hdr));
+        if (ntohs(hdr.size) < sizeof(hdr))
+            break;
+        offset += ntohs(hdr.size);
+        (*count)++;
+    }
+    munmap(map, *bytes ? *bytes : 1);
+    return 0;
+}
+
+static int count_events(const char *path, uint64_t *bytes, uint64_t *count) {
+    uint64_t offset = 0;
+    uint8_t *map;
+
+    map = map_file(path, bytes);
+    if (!map)
+        return -1;
+    *count = 0;
+    while (offset + sizeof(struct evt_header) <= *bytes) {
+        struct evt_header hdr;
+
+        memcpy(&hdr, map + offset, sizeof(hdr));
+        if (ntohl(hdr.size) < sizeof(hdr))
+            break;
+        offset += ntohl(hdr.size);
+        (*count)++;
+    }
+    munmap(map, *bytes ? *bytes : 1);
+    return 0;
+}
+
+static void tool_path(char *buf, size_t len, const char *tool) {
+    snprintf(buf, len, "%s/%s", bin_dir, tool);
+}
+
+static int generate(const char *path, const char *weights, const char *size) {
+    struct result r;
+    char tool[4096], seed_str[32];
+    char *argv[] = { tool, "-s", seed_str, "-n", (char *)size,
+                     "-w", (char *)weights, (char *)path, NULL };
+
+    memset(&r, 0, sizeof(r));
+    tool_path(tool, sizeof(tool), "generator");
+    snprintf(seed_str, sizeof(seed_str), "%llu", seed);
+    return run_tool(&r, argv);
+}
+
+static int macro_corpus(const struct corpus *c) {
+    struct result stages[3], total;
+    char capture[4096], joined[4096], events[4096], sorted[4096];
+    char tool[4096], size[32];
+    uint64_t bytes, packets, count;
+    int i;
+
+    snprintf(size, sizeof(size), "%llu", (unsigned long long)corpus_size);
+    snprintf(capture, sizeof(capture), "%s/%s-%s-%llu.bin",
+             work_dir, c->name, size, seed);
+    snprintf(joined, sizeof(joined), "%s/%s.join", work_dir, c->name);
+    snprintf(events, sizeof(events), "%s/%s.evt", work_dir, c->name);
+    snprintf(sorted, sizeof(sorted), "%s/%s.sorted", work_dir, c->name);
+
+    // Captures are kept in the work directory (-d), and made only once
+    if (access(capture, R_OK) && generate(capture, c->weights, size))
+        return -1;
+
+    memset(stages, 0, sizeof(stages));
+    for (i=0; i<3; i++) {
+        stages[i].kind = "macro";
+        stages[i].corpus = c->name;
+    }
+
+    stages[0].name = "joiner";
+    stages[0].unit = "packets";
+    if (count_packets(capture, &bytes, &packets))
+        return -1;
+    stages[0].bytes = bytes;
+    stages[0].packets = stages[0].ops = packets;
+    tool_path(tool, sizeof(tool), "joiner");
+    if (run_stage(&stages[0], (char *[]){ tool, capture, joined, NULL }))
+        return -1;
+
+    stages[1].name = "grouper";
+    stages[1].unit = "packets";
+    if (count_packets(joined, &bytes, &count))
+        return -1;
+    stages[1].bytes = bytes;
+    stages[1].packets = stages[1].ops = count;
+    tool_path(tool, sizeof(tool), "grouper");
+    if (run_stage(&stages[1], (char *[]){ tool, joined, events, NULL }))
+        return -1;
+
+    stages[2].name = "sorter";
+    stages[2].unit = "events";
+    if (count_events(events, &bytes, &count))
+        return -1;
+    stages[1].events = count;
+    stages[2].bytes = bytes;
+    stages[2].events = stages[2].ops = count;
+    tool_path(tool, sizeof(tool), "sorter");
+    if (run_stage(&stages[2], (char *[]){ tool, events, sorted, NULL }))
+        return -1;
+
+    memset(&total, 0, sizeof(total));
+    total.kind = "macro";
+    total.name = "pipeline";
+    total.corpus = c->name;
+    total.unit = "packets";
+    total.bytes = stages[0].bytes;
+    total.packets = total.ops = packets;
+    total.events = count;
+    for (i=0; i<3; i++) {
+        print_result(&stages[i]);
+        total.seconds += stages[i].seconds;
+        total.user += stages[i].user;
+        total.sys += stages[i].sys;
+        if (stages[i].max_rss_kb > total.max_rss_kb)
+            total.max_rss_kb = stages[i].max_rss_kb;
+        if (stages[i].syscalls < 0 || total.syscalls < 0)
+            total.syscalls = -1;
+        else
+            total.syscalls += stages[i].syscalls;
+    }
+    print_result(&total);
+
+    memset(&total, 0, sizeof(total));
+    total.kind = "macro";
+    total.name = "pipeline-lib";
+    total.corpus = c->name;
+    total.unit = "packets";
+    total.bytes = stages[0].bytes;
+    total.packets = total.ops = packets;
+    total.events = count;
+    if (run_stage(&total, (char *[]){ LIBRARY, capture, sorted, NULL }))
+        return -1;
+    print_result(&total);
+
+    unlink(joined);
+    unlink(events);
+    unlink(sorted);
+    return 0;
+}
+
+
+static int run_micro(void) {
+    char capture[4096];
+    struct sort_bench sb;
+    struct state *st;
+    struct pkt *pkts;
+    uint8_t *bytes;
+    size_t i;
+
+    snprintf(capture, sizeof(capture), "%s/micro-%llu.bin", work_dir, seed);
+    if (access(capture, R_OK) && generate(capture, "80,15,5", MICRO_CAPTURE))
+        return -1;
+    if (micro("packet_get_next_raw", "micro", "packets",
+              round_packet_get_next_raw, capture))
+        return -1;
+
+    bytes = malloc(UNSCRAMBLE_BYTES);
+    pkts = calloc(SKIP_AMOUNT * 2, sizeof(*pkts));
+    st = calloc(1, sizeof(*st));
+    sb.count = SORT_KEYS;
+    sb.keys = malloc(sb.count * sizeof(*sb.keys));
+    sb.work = malloc(sb.count * sizeof(*sb.work));
+    if (!bytes || !pkts || !st || !sb.keys || !sb.work) {
+        perror("Couldn't allocate benchmark data");
+        return -1;
+    }
+
+    for (i=0; i<UNSCRAMBLE_BYTES; i++)
+        bytes[i] = i * 0x9d + (i >> 8);
+    if (micro("nand_unscramble_byte", "-", "bytes", round_unscramble, bytes))
+        return -1;
+
+    // Old and new cycles that never line up
+    for (i=0; i<SKIP_AMOUNT * 2; i++) {
+        pkts[i].header.type = PACKET_NAND_CYCLE;
+        pkts[i].data.nand_cycle.data = (i < SKIP_AMOUNT) ? i : 0xff - i;
+        pkts[i].data.nand_cycle.control = 4;
+    }
+    if (micro("window_match", "-", "searches", round_window_match, pkts))
+        return -1;
+
+    // The types being looked for sit behind some others, as they would
+    for (i=0; i<sizeof(open_types)/sizeof(open_types[0]); i++) {
+        struct evt_header *evt = calloc(1, sizeof(union evt));
+        if (!evt) {
+            perror("Couldn't allocate event");
+            return -1;
+        }
+        evt->type = open_types[i];
+        st->events[i * 3 + 2] = evt;
+    }
+    if (micro("evt_take_put", "-", "pairs", round_take_put, st))
+        return -1;
+
+    make_keys(sb.keys, sb.count, 0);
+    if (micro("sort_keys", "ordered", "keys", round_sort, &sb))
+        return -1;
+    make_keys(sb.keys, sb.count, 100);
+    if (micro("sort_keys", "late", "keys", round_sort, &sb))
+        return -1;
+    make_keys(sb.keys, sb.count, 1);
+    if (micro("sort_keys", "shuffled", "keys", round_sort, &sb))
+        return -1;
+
+    for (i=0; i<sizeof(open_types)/sizeof(open_types[0]); i++)
+        free(st->events[i * 3 + 2]);
+    free(st);
+    free(pkts);
+    free(bytes);
+    free(sb.keys);
+    free(sb.work);
+    return 0;
+}
+
+
+/* Comparing results.  Only what bench itself writes needs reading. */
+struct saved {
+    char key[160];
+    double rate;
+    char unit[32];
+};
+
+static int json_string(const char *line, const char *field,
+                       char *buf, size_t len) {
+    char pat[64];
+    const char *p, *end;
+
+    snprintf(pat, sizeof(pat), "\"%s\":\"", field);
+    p = strstr(line, pat);
+    if (!p)
+        return -1;
+    p += strlen(pat);
+    end = strchr(p, '"');
+    if (!end || end - p >= len)
+        return -1;
+    memcpy(buf, p, end - p);
+    buf[end - p] = '\0';
+    return 0;
+}
+
+static int json_number(const char *line, const char *field, double *val) {
+    char pat[64];
+    const char *p;
+
+    snprintf(pat, sizeof(pat), "\"%s\":", field);
+    p = strstr(line, pat);
+    if (!p)
+        return -1;
+    return sscanf(p + strlen(pat), "%lf", val) == 1 ? 0 : -1;
+}
+
+static struct saved *load_results(const char *path, int *count) {
+    struct saved *saved = NULL;
+    char line[1024];
+    int cap = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        perror("Unable to open results");
+        return NULL;
+    }
+    *count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char kind[16], name[64], corpus[64];
+        struct saved *s;
+
+        if (json_string(line, "kind", kind, sizeof(kind))
+         || json_string(line, "name", name, sizeof(name))
+         || json_string(line, "corpus", corpus, sizeof(corpus)))
+            continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 32;
+            saved = realloc(saved, cap * sizeof(*saved));
+            if (!saved) {
+                perror("Couldn't allocate results");
+                fclose(f);
+                return NULL;
+            }
+        }
+        s = &saved[(*count)++];
+        snprintf(s->key, sizeof(s->key), "%s %s %s", kind, name, corpus);
+        if (json_number(line, "ops_s", &s->rate)
+         || json_string(line, "unit", s->unit, sizeof(s->unit)))
+            (*count)--;
+    }
+    fclose(f);
+    return saved;
+}
+
+static int compare(const char *old_path, const char *new_path) {
+    struct saved *old, *new;
+    int old_count, new_count;
+    int i, j;
+
+    old = load_results(old_path, &old_count);
+    if (!old)
+        return -1;
+    new = load_results(new_path, &new_count);
+    if (!new)
+        return -1;
+
+    for (i=0; i<new_count; i++) {
+        for (j=0; j<old_count; j++)
+            if (!strcmp(old[j].key, new[i].key))
+                break;
+        if (j == old_count) {
+            printf("%-36s %14s %14.0f %s/s   (new)\n",
+                   new[i].key, "-", new[i].rate, new[i].unit);
+            continue;
+        }
+        printf("%-36s %14.0f %14.0f %s/s %+7.1f%%\n",
+               new[i].key, old[j].rate, new[i].rate, new[i].unit,
+               old[j].rate > 0 ? (new[i].rate / old[j].rate - 1) * 100 : 0);
+    }
+    free(old);
+    free(new);
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    int do_micro = 1, do_macro = 1;
+    int keep = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "f:t:r:n:s:d:b:mMc")) != -1) {
+        switch(opt) {
+        case 'f':
+            if (!strcmp(optarg, "json"))
+                json = 1;
+            else if (strcmp(optarg, "text")) {
+                fprintf(stderr, "Formats are text and json\n");
+                argc = 0;
+            }
+            break;
+        case 't':
+            min_time = strtod(optarg, NULL);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            if (repeats < 1) {
+                fprintf(stderr, "Need at least one run\n");
+                argc = 0;
+            }
+            break;
+        case 'n':
+            if (parse_size(optarg, &corpus_size) || !corpus_size) {
+                fprintf(stderr, "Bad size %s\n", optarg);
+                argc = 0;
+            }
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            snprintf(work_dir, sizeof(work_dir), "%s", optarg);
+            keep = 1;
+            break;
+        case 'b':
+            bin_dir = optarg;
+            break;
+        case 'm':
+            do_macro = 0;
+            break;
+        case 'M':
+            do_micro = 0;
+            break;
+        case 'c':
+            if (argc - optind != 2)
+                argc = 0;
+            else
+                return compare(argv[optind], argv[optind + 1]) ? 1 : 0;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+
+    if (argc == 0 || argc != optind || (!do_micro && !do_macro)) {
+        fprintf(stderr, "Usage: %s [-f text|json] [-t min_seconds] [-r runs]\n"
+                        "       [-n corpus_size] [-s seed] [-d work_dir] [-b tool_dir]\n"
+                        "       [-m | -M]\n"
+                        "       %s -c old_results new_results\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    if (keep) {
+        struct stat stat_buf;
+
+        // Made if need be, and checked now rather than by the first capture
+        if (mkdir(work_dir, 0777) && errno != EEXIST) {
+            perror("Couldn't make work directory");
+            return 2;
+        }
+        if (stat(work_dir, &stat_buf) || !S_ISDIR(stat_buf.st_mode)
+         || access(work_dir, W_OK | X_OK)) {
+            fprintf(stderr, "%s isn't a directory that can be written to\n",
+                    work_dir);
+            return 2;
+        }
+    }
+    else {
+        const char *tmp = getenv("TMPDIR");
+        snprintf(work_dir, sizeof(work_dir), "%s/bench.XXXXXX",
+                 tmp ? tmp : "/tmp");
+        if (!mkdtemp(work_dir)) {
+            perror("Couldn't make work directory");
+            return 2;
+        }
+    }
+
+    /* A child's peak RSS starts out at what this process had when it
+     * forked, so the tools are run before the micro benchmarks grow it.
+     */
+    if (do_macro)
+        for (i=0; i<sizeof(corpora)/sizeof(corpora[0]); i++)
+            if (macro_corpus(&corpora[i]))
+                return 4;
+    if (do_micro && run_micro())
+        return 3;
+
+    // Generated captures are only kept in a work directory given with -d
+    if (!keep) {
+        char path[4096];
+
+        snprintf(path, sizeof(path), "%s/micro-%llu.bin", work_dir, seed);
+        unlink(path);
+        strcat(path, ".truth");
+        unlink(path);
+        for (i=0; i<sizeof(corpora)/sizeof(corpora[0]); i++) {
+            snprintf(path, sizeof(path), "%s/%s-%llu-%llu.bin", work_dir,
+                     corpora[i].name, (unsigned long long)corpus_size, seed);
+            unlink(path);
+            strcat(path, ".truth");
+            unlink(path);
+        }
+        rmdir(work_dir);
+    }
+    return 0;
+}
@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include "state.h"
+#include "event-struct.h"
+
+/* Content-addressed payload store (grouper -d).
+ * The same NAND pages and SD sectors get read over and over.  With a
+ * store, each distinct payload is written once to a blob file next to the
+ * event file (<events>.blob), and events carry a struct evt_payload_ref in
+ * place of the data, with EVT_FLAG_REF set in their type.  When a store is
+ * open, event_get_next() puts the data back.
+ */
+
+#define BLOB_MAGIC "TBBl"
+#define BLOB_SUFFIX ".blob"
+
+// Payloads shorter than this aren't worth a reference
+#define BLOB_MIN_PAYLOAD 64
+
+struct blob_entry {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t size;
+};
+
+struct blob_store {
+    int fd;
+    off_t end;
+
+    /* Open-addressed table of everything written so far */
+    struct blob_entry *table;
+    size_t table_size, used;
+
+    /* Stage that deduplicated events are passed on to */
+    int next;
+
+    uint8_t scratch[sizeof(((struct evt_sd_multi *)0)->data)];
+
+    /* The record passed on, with its payload swapped for a reference.
+     * The event it came from may be one the grouper still has to free,
+     * so that's left as it is.
+     */
+    uint8_t rec[sizeof(union evt)];
+};
+
+static uint64_t blob_hash(const uint8_t *data, uint32_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    uint64_t word;
+
+    while (len >= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        h = (h ^ word) * 0x100000001b3ULL;
+        h ^= h >> 29;
+        data += sizeof(word);
+        len -= sizeof(word);
+    }
+    while (len--)
+        h = (h ^ *data++) * 0x100000001b3ULL;
+    return h;
+}
+
+static char *blob_path(const char *events_path) {
+    char *path = malloc(strlen(events_path) + sizeof(BLOB_SUFFIX));
+    if (path)
+        sprintf(path, "%s" BLOB_SUFFIX, events_path);
+    return path;
+}
+
+/* Find the payload within a compact record: its offset, and its length
+ * as given by the record's count field.  For a reference record the
+ * struct evt_payload_ref sits at that offset instead.
+ */
+static int payload_span(void *arg, uint32_t size,
+                        uint32_t *start, uint32_t *len) {
+    union evt *evt = arg;
+    uint32_t count;
+
+    switch (evt->header.type & ~EVT_FLAG_REF) {
+    case EVT_SD_CMD: {
+        uint32_t num_args = ntohl(evt->sd_cmd.num_args);
+
+        if (num_args > sizeof(evt->sd_cmd.args))
+            return -1;
+        *start = offsetof(struct evt_sd_cmd, args) + num_args;
+        if (*start + sizeof(count) > size)
+            return -1;
+        memcpy(&count, (uint8_t *)arg + *start, sizeof(count));
+        *start += sizeof(count);
+        *len = ntohl(count);
+        if (*len > sizeof(evt->sd_cmd.result))
+            return -1;
+        return 0;
+    }
+
+    case EVT_SD_MULTI: {
+        uint32_t num_blocks = ntohl(evt->sd_multi.num_blocks);
+
+        if (num_blocks > sizeof(evt->sd_multi.blocks)
+                       / sizeof(evt->sd_multi.blocks[0]))
+            return -1;
+        *start = offsetof(struct evt_sd_multi, blocks)
+               + num_blocks * sizeof(evt->sd_multi.blocks[0]);
+        *len = num_blocks * SD_BLOCK_SIZE;
+        return 0;
+    }
+
+    case EVT_NAND_READ:
+    case EVT_NAND_CHANGE_READ_COLUMN:
+        *start = offsetof(struct evt_nand_read, data);
+        *len = ntohl(evt->nand_read.count);
+        if (*len > sizeof(evt->nand_read.data))
+            return -1;
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+static int blob_table_grow(struct blob_store *b) {
+    struct blob_entry *old = b->table;
+    size_t old_size = b->table_size;
+    size_t i;
+
+    b->table_size = old_size ? old_size * 2 : 65536;
+    b->table = calloc(b->table_size, sizeof(*b->table));
+    if (!b->table) {
+        perror("Couldn't grow blob table");
+        return -1;
+    }
+
+    for (i=0; i<old_size; i++) {
+        size_t slot;
+        if (!old[i].size)
+            continue;
+        slot = old[i].hash & (b->table_size - 1);
+        while (b->table[slot].size)
+            slot = (slot + 1) & (b->table_size - 1);
+        b->table[slot] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// Return where the payload lives in the blob file, writing it if it's new
+static int blob_put(struct blob_store *b, const uint8_t *data, uint32_t len,
+                    struct evt_payload_ref *ref) {
+    uint64_t hash = blob_hash(data, len);
+    size_t slot;
+
+    if (b->used * 2 >= b->table_size && blob_table_grow(b))
+        return -1;
+
+    for (slot = hash & (b->table_size - 1);
+         b->table[slot].size;
+         slot = (slot + 1) & (b->table_size - 1)) {
+        struct blob_entry *e = &b->table[slot];
+
+        // Confirm the match byte-for-byte, in case of a hash collision
+        if (e->hash == hash && e->size == len
+         && pread(b->fd, b->scratch, len, e->offset) == len
+         && !memcmp(b->scratch, data, len)) {
+            ref->hash = htobe64(hash);
+            ref->offset = htobe64(e->offset);
+            return 0;
+        }
+    }
+
+    if (pwrite(b->fd, data, len, b->end) != len) {
+        perror("Couldn't write blob");
+        return -1;
+    }
+    b->table[slot].hash = hash;
+    b->table[slot].offset = b->end;
+    b->table[slot].size = len;
+    b->used++;
+
+    ref->hash = htobe64(hash);
+    ref->offset = htobe64(b->end);
+    b->end += len;
+    return 0;
+}
+
+// Swap a record's payload for a reference into the blob file
+static int blob_stage(struct state *st, int stage, void *arg, uint32_t size) {
+    struct blob_store *b = st->blobs;
+    struct evt_header *hdr = (struct evt_header *)b->rec;
+    struct evt_payload_ref ref;
+    uint32_t start, len;
+    const uint8_t *in = arg;
+
+    if (payload_span(arg, size, &start, &len)
+     || len < BLOB_MIN_PAYLOAD
+     || start + len > size
+     || size > sizeof(b->rec))
+        return evt_pass(st, b->next, arg, size);
+
+    if (blob_put(b, in + start, len, &ref))
+        return -1;
+
+    memcpy(b->rec, in, start);
+    memcpy(b->rec + start, &ref, sizeof(ref));
+    memcpy(b->rec + start + sizeof(ref), in + start + len,
+           size - (start + len));
+    size = size - len + sizeof(ref);
+    hdr->type |= EVT_FLAG_REF;
+    hdr->size = htonl(size);
+    return evt_pass(st, b->next, b->rec, size);
+}
+
+// Create <events_path>.blob and start deduplicating payloads into it
+int blob_store_create(struct state *st, const char *events_path) {
+    struct blob_store *b;
+    char *path;
+
+    b = calloc(1, sizeof(*b));
+    path = blob_path(events_path);
+    if (!b || !path) {
+        perror("Couldn't allocate blob store");
+        return -1;
+    }
+
+    /* Sorted files, slices and conversions may share the old store through
+     * a hard link (see blob_store_copy()), so it's replaced, not emptied.
+     */
+    if (unlink(path) && errno != ENOENT) {
+        perror("Unable to replace blob file");
+        return -1;
+    }
+    b->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (b->fd == -1) {
+        perror("Unable to open blob file");
+        return -1;
+    }
+    free(path);
+
+    if (write(b->fd, BLOB_MAGIC, 4) != 4) {
+        perror("Couldn't write blob file");
+        return -1;
+    }
+    b->end = 4;
+
+    st->blobs = b;
+    b->next = evt_add_stage(st, blob_stage, NULL) + 1;
+    return 0;
+}
+
+/* Open the payload store belonging to an event file, so references can be
+ * resolved.  It's not an error for there to be none.
+ */
+int blob_store_open(struct state *st, const char *events_path) {
+    struct blob_store *b;
+    char magic[4];
+    char *path;
+    int fd;
+
+    path = blob_path(events_path);
+    if (!path)
+        return -1;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1)
+        return (errno == ENOENT) ? 0 : -1;
+
+    if (read(fd, magic, sizeof(magic)) != sizeof(magic)
+     || memcmp(magic, BLOB_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "Not a blob file\n");
+        close(fd);
+        return -1;
+    }
+
+    b = calloc(1, sizeof(*b));
+    if (!b) {
+        close(fd);
+        return -1;
+    }
+    b->fd = fd;
+    st->blobs = b;
+    return 0;
+}
+
+// Close a store opened or created by either of the above
+void blob_store_close(struct state *st) {
+    struct blob_store *b = st->blobs;
+
+    if (!b)
+        return;
+    close(b->fd);
+    free(b->table);
+    free(b);
+    st->blobs = NULL;
+}
+
+// Put the payload back into a record read by event_get_next()
+int blob_resolve(struct state *st, union evt *evt) {
+    struct evt_payload_ref ref;
+    uint8_t tail[sizeof(struct evt_sd_cmd)];
+    uint32_t start, len, tail_len;
+    uint8_t *rec = (uint8_t *)evt;
+    uint32_t size = evt->header.size;
+
+    if (payload_span(evt, size, &start, &len)
+     || start + sizeof(ref) > size) {
+        fprintf(stderr, "Corrupt payload reference\n");
+        return -1;
+    }
+
+    memcpy(&ref, rec + start, sizeof(ref));
+    tail_len = size - (start + sizeof(ref));
+    if (tail_len > sizeof(tail) || start + len + tail_len > sizeof(*evt))
+        return -1;
+    memcpy(tail, rec + start + sizeof(ref), tail_len);
+
+    if (pread(st->blobs->fd, rec + start, len, be64toh(ref.offset)) != len) {
+        perror("Couldn't read blob");
+        return -1;
+    }
+    memcpy(rec + start + len, tail, tail_len);
+
+    evt->header.size = start + len + tail_len;
+    evt->header.type &= ~EVT_FLAG_REF;
+    return 0;
+}
+
+// Give a copy of an event file its payload store, if it has one
+int blob_store_copy(const char *from_events, const char *to_events) {
+    char *from = blob_path(from_events);
+    char *to = blob_path(to_events);
+    uint8_t buf[65536];
+    int in_fd, out_fd;
+    int ret = -1;
+    ssize_t len;
+
+    if (!from || !to)
+        goto out;
+
+    unlink(to);
+    if (!link(from, to)) {
+        ret = 0;
+        goto out;
+    }
+    if (errno == ENOENT) {
+        ret = 0;
+        goto out;
+    }
+
+    // Different filesystems; copy it instead
+    in_fd = open(from, O_RDONLY);
+    if (in_fd == -1)
+        goto out;
+    out_fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        close(in_fd);
+        goto out;
+    }
+    while ((len = read(in_fd, buf, sizeof(buf))) > 0)
+        if (write(out_fd, buf, len) != len)
+            break;
+    ret = len ? -1 : 0;
+    close(in_fd);
+    close(out_fd);
+
+out:
+    if (ret)
+        perror("Couldn't copy blob file");
+    free(from);
+    free(to);
+    return ret;
+}
+
+// Replace a linked blob file with a copy, and reopen it for appending
+static int blob_unshare(const char *path, int *fd) {
+    char *tmp = malloc(strlen(path) + sizeof(".new"));
+    uint8_t buf[65536];
+    int in_fd, out_fd;
+    ssize_t len;
+
+    if (!tmp)
+        return -1;
+    sprintf(tmp, "%s.new", path);
+    in_fd = open(path, O_RDONLY);
+    out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (in_fd == -1 || out_fd == -1) {
+        free(tmp);
+        return -1;
+    }
+    while ((len = read(in_fd, buf, sizeof(buf))) > 0)
+        if (write(out_fd, buf, len) != len)
+            break;
+    close(in_fd);
+    if (len || rename(tmp, path)) {
+        close(out_fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    close(*fd);
+    *fd = out_fd;
+    return 0;
+}
+
+/* Add the payloads in from_events' blob file to the end of to_events',
+ * for appending one event file to another.  References in the appended
+ * events need `shift` adding to their offsets (see blob_rebase()).
+ */
+int blob_store_append(const char *from_events, const char *to_events,
+                      uint64_t *shift) {
+    char *from = blob_path(from_events);
+    char *to = blob_path(to_events);
+    struct stat stat_buf;
+    uint8_t buf[65536];
+    int in_fd = -1, out_fd = -1;
+    int ret = -1;
+    off_t end;
+    ssize_t len;
+
+    *shift = 0;
+    if (!from || !to)
+        goto out;
+
+    in_fd = open(from, O_RDONLY);
+    if (in_fd == -1) {
+        // Nothing to add
+        if (errno == ENOENT)
+            ret = 0;
+        goto out;
+    }
+
+    out_fd = open(to, O_WRONLY | O_APPEND);
+    if (out_fd == -1) {
+        if (errno != ENOENT)
+            goto out;
+        // All the references are new, so nothing moves
+        ret = blob_store_copy(from_events, to_events);
+        goto out;
+    }
+
+    // The store may be a link to the one it was copied from, which mustn't
+    // change too, so give this file a store of its own first
+    if (fstat(out_fd, &stat_buf) || (stat_buf.st_nlink > 1 && blob_unshare(to, &out_fd)))
+        goto out;
+
+    // Everything after the magic number moves to the end
+    end = lseek(out_fd, 0, SEEK_END);
+    if (end < 4 || lseek(in_fd, 4, SEEK_SET) != 4)
+        goto out;
+    *shift = end - 4;
+    while ((len = read(in_fd, buf, sizeof(buf))) > 0)
+        if (write(out_fd, buf, len) != len)
+            break;
+    ret = len ? -1 : 0;
+
+out:
+    if (ret)
+        perror("Couldn't append blob file");
+    if (in_fd != -1)
+        close(in_fd);
+    if (out_fd != -1)
+        close(out_fd);
+    free(from);
+    free(to);
+    return ret;
+}
+
+// Move a compact record's payload reference, if it has one, by `shift`
+int blob_rebase(void *arg, uint32_t size, uint64_t shift) {
+    struct evt_header *hdr = arg;
+    struct evt_payload_ref ref;
+    uint32_t start, len;
+
+    if (!(hdr->type & EVT_FLAG_REF) || !shift)
+        return 0;
+    if (payload_span(arg, size, &start, &len)
+     || start + sizeof(ref) > size)
+        return -1;
+    memcpy(&ref, (uint8_t *)arg + start, sizeof(ref));
+    ref.offset = htobe64(be64toh(ref.offset) + shift);
+    memcpy((uint8_t *)arg + start, &ref, sizeof(ref));
+    return 0;
+}
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "state.h"
+#include "event-struct.h"
+
+/* Collapsing of repetitive NAND traffic (grouper -c).
+ * Back-to-back status polls become one EVT_NAND_STATUS_RUN, and runs of
+ * SanDisk vendor commands become one EVT_NAND_SANDISK_MACRO.  SD, network
+ * and buffer-drain events come from other buses, so they pass straight
+ * through without ending a run.  Anything else on the NAND bus ends it.
+ *
+ * Events arrive as finished records, with headers in network order.
+ */
+
+#define MAX_CHANGES (sizeof(((struct evt_nand_status_run *)0)->changes) \
+                     / sizeof(struct evt_nand_status_change))
+#define MAX_STEPS (sizeof(((struct evt_nand_sandisk_macro *)0)->steps) \
+                   / sizeof(struct evt_nand_macro_step))
+
+struct collapse {
+    /* Stage that collapsed events are passed on to */
+    int next;
+
+    /* Status run being built, and its first poll for runs of one */
+    struct evt_nand_status_run run;
+    uint32_t run_count;
+    uint8_t run_last_status;
+    struct evt_nand_status run_first;
+
+    /* Vendor pass being built */
+    struct evt_nand_macro_step pass[MAX_STEPS];
+    int pass_steps;
+    struct evt_header pass_hdr;
+    uint8_t pass_first[32];
+    uint32_t pass_first_size;
+
+    /* Macro waiting to see if the next pass repeats it */
+    struct evt_nand_sandisk_macro macro;
+    uint32_t macro_repeats;
+    uint8_t macro_first[32];
+    uint32_t macro_first_size;
+};
+
+static int is_vendor(uint8_t type) {
+    return type >= EVT_NAND_SANDISK_VENDOR_START
+        && type <= EVT_NAND_SANDISK_CHARGE2;
+}
+
+static int is_other_bus(uint8_t type) {
+    return type == EVT_SD_CMD
+        || type == EVT_SD_MULTI
+        || type == EVT_NET_CMD
+        || type == EVT_BUFFER_DRAIN;
+}
+
+static int flush_run(struct state *st) {
+    struct collapse *c = st->collapse;
+    struct evt_nand_status_run *run = &c->run;
+    uint32_t size;
+
+    if (!c->run_count)
+        return 0;
+
+    if (c->run_count == 1) {
+        c->run_count = 0;
+        return evt_pass(st, c->next, &c->run_first, sizeof(c->run_first));
+    }
+
+    size = offsetof(struct evt_nand_status_run, changes)
+         + ntohs(run->num_changes) * sizeof(run->changes[0]);
+    run->hdr.type = EVT_NAND_STATUS_RUN;
+    run->hdr.size = htonl(size);
+    run->count = htonl(c->run_count);
+    c->run_count = 0;
+    return evt_pass(st, c->next, run, size);
+}
+
+static int add_status(struct state *st, struct evt_nand_status *evt) {
+    struct collapse *c = st->collapse;
+    struct evt_nand_status_run *run = &c->run;
+    uint16_t num_changes;
+
+    if (c->run_count && evt->status != c->run_last_status) {
+        num_changes = ntohs(run->num_changes);
+        if (num_changes == MAX_CHANGES) {
+            if (flush_run(st) < 0)
+                return -1;
+        }
+        else {
+            struct evt_nand_status_change *change = &run->changes[num_changes];
+            change->index = htonl(c->run_count);
+            change->sec = evt->hdr.sec_start;
+            change->nsec = evt->hdr.nsec_start;
+            change->status = evt->status;
+            run->num_changes = htons(num_changes + 1);
+        }
+    }
+
+    if (!c->run_count) {
+        memcpy(&run->hdr, &evt->hdr, sizeof(run->hdr));
+        run->status = evt->status;
+        run->num_changes = 0;
+        memcpy(&c->run_first, evt, sizeof(c->run_first));
+    }
+
+    run->hdr.sec_end = evt->hdr.sec_end;
+    run->hdr.nsec_end = evt->hdr.nsec_end;
+    c->run_last_status = evt->status;
+    c->run_count++;
+    return 0;
+}
+
+static int flush_macro(struct state *st) {
+    struct collapse *c = st->collapse;
+    struct evt_nand_sandisk_macro *macro = &c->macro;
+    uint32_t size;
+
+    if (!c->macro_repeats)
+        return 0;
+
+    // A lone command is left as it was
+    if (c->macro_repeats == 1 && macro->num_steps == 1) {
+        c->macro_repeats = 0;
+        return evt_pass(st, c->next, c->macro_first, c->macro_first_size);
+    }
+
+    size = offsetof(struct evt_nand_sandisk_macro, steps)
+         + macro->num_steps * sizeof(macro->steps[0]);
+    macro->hdr.type = EVT_NAND_SANDISK_MACRO;
+    macro->hdr.size = htonl(size);
+    macro->repeats = htonl(c->macro_repeats);
+    c->macro_repeats = 0;
+    return evt_pass(st, c->next, macro, size);
+}
+
+// The pass is complete: either it repeats the pending macro, or it
+// replaces it.
+static int finish_pass(struct state *st) {
+    struct collapse *c = st->collapse;
+    struct evt_nand_sandisk_macro *macro = &c->macro;
+    int ret = 0;
+
+    if (!c->pass_steps)
+        return 0;
+
+    if (c->macro_repeats
+     && macro->num_steps == c->pass_steps
+     && !memcmp(macro->steps, c->pass, c->pass_steps * sizeof(c->pass[0]))) {
+        macro->hdr.sec_end = c->pass_hdr.sec_end;
+        macro->hdr.nsec_end = c->pass_hdr.nsec_end;
+        c->macro_repeats++;
+    }
+    else {
+        ret = flush_macro(st);
+        memcpy(&macro->hdr, &c->pass_hdr, sizeof(macro->hdr));
+        memcpy(macro->steps, c->pass, c->pass_steps * sizeof(c->pass[0]));
+        macro->num_steps = c->pass_steps;
+        memcpy(c->macro_first, c->pass_first, c->pass_first_size);
+        c->macro_first_size = c->pass_first_size;
+        c->macro_repeats = 1;
+    }
+
+    c->pass_steps = 0;
+    return ret;
+}
+
+static int add_vendor(struct state *st, struct evt_header *hdr, uint32_t size) {
+    struct collapse *c = st->collapse;
+    struct evt_nand_macro_step *step;
+    uint32_t args = size - sizeof(*hdr);
+
+    if (c->pass_steps
+     && (hdr->type == EVT_NAND_SANDISK_VENDOR_START
+      || c->pass_steps == MAX_STEPS))
+        if (finish_pass(st) < 0)
+            return -1;
+
+    if (!c->pass_steps) {
+        memcpy(&c->pass_hdr, hdr, sizeof(c->pass_hdr));
+        if (size > sizeof(c->pass_first))
+            size = sizeof(c->pass_first);
+        memcpy(c->pass_first, hdr, size);
+        c->pass_first_size = size;
+    }
+
+    step = &c->pass[c->pass_steps++];
+    memset(step, 0, sizeof(*step));
+    step->type = hdr->type;
+    if (args > sizeof(step->args))
+        args = sizeof(step->args);
+    memcpy(step->args, hdr + 1, args);
+
+    c->pass_hdr.sec_end = hdr->sec_end;
+    c->pass_hdr.nsec_end = hdr->nsec_end;
+    return 0;
+}
+
+static int collapse_event(struct state *st, int stage,
+                          void *arg, uint32_t size) {
+    struct collapse *c = st->collapse;
+    struct evt_header *hdr = arg;
+
+    if (is_other_bus(hdr->type))
+        return evt_pass(st, c->next, arg, size);
+
+    if (hdr->type == EVT_NAND_STATUS) {
+        if (finish_pass(st) < 0 || flush_macro(st) < 0)
+            return -1;
+        return add_status(st, arg);
+    }
+
+    if (flush_run(st) < 0)
+        return -1;
+
+    if (is_vendor(hdr->type))
+        return add_vendor(st, hdr, size);
+
+    if (finish_pass(st) < 0 || flush_macro(st) < 0)
+        return -1;
+    return evt_pass(st, c->next, arg, size);
+}
+
+static int collapse_flush(struct state *st, int stage) {
+    if (flush_run(st) < 0 || finish_pass(st) < 0 || flush_macro(st) < 0)
+        return -1;
+    return 0;
+}
+
+// Find the earliest start time of the events being held back, if any
+int collapse_held(struct state *st, uint32_t *sec, uint32_t *nsec) {
+    struct collapse *c = st->collapse;
+    struct evt_header *hdr;
+
+    if (c->macro_repeats)
+        hdr = &c->macro.hdr;
+    else if (c->pass_steps)
+        hdr = &c->pass_hdr;
+    else if (c->run_count)
+        hdr = &c->run.hdr;
+    else
+        return 0;
+
+    *sec = ntohl(hdr->sec_start);
+    *nsec = ntohl(hdr->nsec_start);
+    return 1;
+}
+
+int collapse_init(struct state *st) {
+    st->collapse = calloc(1, sizeof(*st->collapse));
+    if (!st->collapse) {
+        perror("Couldn't allocate collapse state");
+        return -1;
+    }
+    st->collapse->next = evt_add_stage(st, collapse_event, collapse_flush) + 1;
+    return 0;
+}
+
+void collapse_free(struct state *st) {
+    free(st->collapse);
+    st->collapse = NULL;
+}
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "event-struct.h"
+
+/* Converts event files between versions.  Version 1 files, sorted (TBEv,
+ * TBE8) or straight from the grouper, become version 2 (TBE2) files;
+ * version 2 files become sorted version 1 files, or plain event files if
+ * their events aren't in order.
+ */
+
+#define OUT_BUFFER (1024 * 1024)
+#define TABLE_ENTRIES 65536
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            perror("Couldn't write output");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// A sorted version 1 file, in jump table order
+static int sorted_to_v2(const char *infile, struct tbe2_writer *w) {
+    struct sorted_file sf;
+    uint64_t i;
+    int ret = -1;
+
+    if (sorted_open(&sf, infile))
+        return -1;
+    for (i=0; i<sf.count; i++) {
+        struct evt_header *hdr = sorted_event(&sf, i);
+        if (!hdr) {
+            fprintf(stderr, "%s has a damaged jump table\n", infile);
+            goto out;
+        }
+        if (tbe2_write(w, hdr, ntohl(hdr->size)))
+            goto out;
+    }
+    ret = 0;
+
+out:
+    sorted_close(&sf);
+    return ret;
+}
+
+// A plain version 1 event file, such as the grouper writes
+static int events_to_v2(uint8_t *map, uint64_t size, struct tbe2_writer *w) {
+    uint64_t offset = 0;
+
+    while (offset + sizeof(struct evt_header) <= size) {
+        struct evt_header hdr;
+
+        memcpy(&hdr, map + offset, sizeof(hdr));
+        if (ntohl(hdr.size) < sizeof(hdr)
+         || ntohl(hdr.size) > sizeof(union evt)
+         || ntohl(hdr.size) > size - offset) {
+            fprintf(stderr, "Bad event size %u at offset %llu\n",
+                    ntohl(hdr.size), (unsigned long long)offset);
+            return -1;
+        }
+        if (tbe2_write(w, map + offset, ntohl(hdr.size)))
+            return -1;
+        offset += ntohl(hdr.size);
+    }
+    return 0;
+}
+
+static int to_v2(const char *infile, int out_fd) {
+    struct tbe2_writer w;
+    struct stat stat_buf;
+    uint8_t *map = NULL;
+    int writing = 0;
+    int fd;
+    int ret = -1;
+
+    fd = open(infile, O_RDONLY);
+    if (fd == -1) {
+        perror("Unable to open input file");
+        return -1;
+    }
+    if (fstat(fd, &stat_buf) == -1) {
+        perror("Couldn't stat input");
+        goto out;
+    }
+    if (stat_buf.st_size) {
+        map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("Couldn't map input");
+            map = NULL;
+            goto out;
+        }
+        madvise(map, stat_buf.st_size, MADV_SEQUENTIAL);
+    }
+
+    if (tbe2_writer_open(&w, out_fd))
+        goto out;
+    writing = 1;
+    if (stat_buf.st_size >= sizeof(EVENT_HDR_1)
+     && (!memcmp(map, EVENT_HDR_1, sizeof(EVENT_HDR_1))
+      || !memcmp(map, EVENT_HDR_1_WIDE, sizeof(EVENT_HDR_1_WIDE)))) {
+        if (sorted_to_v2(infile, &w))
+            goto out;
+    }
+    else if (events_to_v2(map, stat_buf.st_size, &w))
+        goto out;
+
+    // tbe2_writer_close() lets go of the writer either way
+    writing = 0;
+    if (tbe2_writer_close(&w))
+        goto out;
+
+    fprintf(stderr, "Wrote %llu events (%s)\n", (unsigned long long)w.count,
+            (w.flags & TBE2_SORTED) ? "in order" : "not in order");
+    ret = 0;
+
+out:
+    // A file that failed part way isn't given a footer, so it can't pass
+    // for a finished one
+    if (writing)
+        tbe2_writer_discard(&w);
+    if (map)
+        munmap(map, stat_buf.st_size);
+    close(fd);
+    return ret;
+}
+
+
+// Turn record i into a version 1 event at out, returning its size
+static int v1_record(struct tbe2_file *f, uint64_t i, void *out) {
+    const struct tbe2_header *hdr = tbe2_event(f, i);
+    int size;
+
+    if (!hdr) {
+        fprintf(stderr, "Input has a damaged index\n");
+        return -1;
+    }
+    size = tbe2_to_v1(hdr, out);
+    if (size < 0)
+        fprintf(stderr, "Event %llu is damaged\n", (unsigned long long)i);
+    return size;
+}
+
+// Write out record i as a version 1 event
+static int write_v1_event(struct tbe2_file *f, uint64_t i,
+                          uint8_t *buf, size_t *buf_len, int out_fd) {
+    int size;
+
+    if (*buf_len + sizeof(union evt) > OUT_BUFFER) {
+        if (write_all(out_fd, buf, *buf_len))
+            return -1;
+        *buf_len = 0;
+    }
+    size = v1_record(f, i, buf + *buf_len);
+    if (size < 0)
+        return -1;
+    *buf_len += size;
+    return 0;
+}
+
+static int to_v1(const char *infile, int out_fd) {
+    struct tbe2_file f;
+    uint8_t *buf, *table;
+    union evt *rec;
+    size_t buf_len = 0, table_len = 0;
+    uint64_t bytes = 0, offset, width;
+    uint64_t i;
+    int wide;
+    int ret = -1;
+
+    if (tbe2_open(&f, infile))
+        return -1;
+    buf = malloc(OUT_BUFFER);
+    table = malloc(TABLE_ENTRIES * sizeof(uint64_t));
+    rec = malloc(sizeof(*rec));
+    if (!buf || !table || !rec) {
+        perror("Couldn't allocate output buffers");
+        goto out;
+    }
+
+    // Events out of order can only go back to being a plain event file
+    if (!(f.flags & TBE2_SORTED)) {
+        for (i=0; i<f.count; i++)
+            if (write_v1_event(&f, i, buf, &buf_len, out_fd))
+                goto out;
+        if (write_all(out_fd, buf, buf_len))
+            goto out;
+        fprintf(stderr, "Wrote %llu events, not in order\n",
+                (unsigned long long)f.count);
+        ret = 0;
+        goto out;
+    }
+
+    // Bodies change size going back, so the jump table needs a pass of
+    // its own
+    for (i=0; i<f.count; i++) {
+        int size = v1_record(&f, i, rec);
+        if (size < 0)
+            goto out;
+        bytes += size;
+    }
+
+    // Same rule as the sorter: 64-bit entries only if 32 won't do
+    wide = f.count > UINT32_MAX
+        || sizeof(EVENT_HDR_1) + (f.count + 1) * sizeof(uint32_t)
+           + sizeof(EVENT_HDR_2) + bytes > UINT32_MAX;
+    width = wide ? sizeof(uint64_t) : sizeof(uint32_t);
+
+    if (wide) {
+        uint64_t n = htobe64(f.count);
+        memcpy(table, &n, sizeof(n));
+    }
+    else {
+        uint32_t n = htonl(f.count);
+        memcpy(table, &n, sizeof(n));
+    }
+    if (write_all(out_fd, wide ? EVENT_HDR_1_WIDE : EVENT_HDR_1,
+                  sizeof(EVENT_HDR_1))
+     || write_all(out_fd, table, width))
+        goto out;
+
+    offset = sizeof(EVENT_HDR_1) + width + f.count * width + sizeof(EVENT_HDR_2);
+    for (i=0; i<f.count; i++) {
+        int size = v1_record(&f, i, rec);
+        if (size < 0)
+            goto out;
+        if (wide) {
+            uint64_t entry = htobe64(offset - EVENT_JUMP_SKEW);
+            memcpy(table + table_len * width, &entry, sizeof(entry));
+        }
+        else {
+            uint32_t entry = htonl(offset - EVENT_JUMP_SKEW);
+            memcpy(table + table_len * width, &entry, sizeof(entry));
+        }
+        offset += size;
+        if (++table_len == TABLE_ENTRIES) {
+            if (write_all(out_fd, table, table_len * width))
+                goto out;
+            table_len = 0;
+        }
+    }
+    if (write_all(out_fd, table, table_len * width)
+     || write_all(out_fd, EVENT_HDR_2, sizeof(EVENT_HDR_2)))
+        goto out;
+
+    for (i=0; i<f.count; i++)
+        if (write_v1_event(&f, i, buf, &buf_len, out_fd))
+            goto out;
+    if (write_all(out_fd, buf, buf_len))
+        goto out;
+
+    fprintf(stderr, "Wrote %llu sorted events\n", (unsigned long long)f.count);
+    ret = 0;
+
+out:
+    free(buf);
+    free(table);
+    free(rec);
+    tbe2_close(&f);
+    return ret;
+}
+
+
+int main(int argc, char **argv) {
+    char magic[4];
+    int out_fd = STDOUT_FILENO;
+    int fd;
+    int ret;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s [in_filename] [out_filename, or - for stdout]\n",
+                argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror("Unable to open input file");
+        return 2;
+    }
+    memset(magic, 0, sizeof(magic));
+    if (read(fd, magic, sizeof(magic)) < 0) {
+        perror("Couldn't read input");
+        return 2;
+    }
+    close(fd);
+
+    if (strcmp(argv[2], "-")) {
+        out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd == -1) {
+            perror("Unable to open output file");
+            return 3;
+        }
+        // Payload references are carried over as they are
+        if (blob_store_copy(argv[1], argv[2]))
+            return 4;
+    }
+
+    if (!memcmp(magic, TBE2_MAGIC, sizeof(magic)))
+        ret = to_v1(argv[1], out_fd);
+    else
+        ret = to_v2(argv[1], out_fd);
+    return ret ? 5 : 0;
+}
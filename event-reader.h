@@ -0,0 +1,602 @@
+#ifndef __EVENT_READER_H_
+#define __EVENT_READER_H_
+
+/* Header-only reader for sorted event files: version 1 (TBEv, TBE8) and
+ * version 2 (TBE2).  The file is mapped, events are found by index
+ * through the jump table (or the version 2 index), and each one is
+ * looked at in place through a struct evr_event.  Nothing is copied or
+ * byte-swapped until a field is asked for.
+ *
+ *     struct evr_file f;
+ *     struct evr_iter it;
+ *     struct evr_event e;
+ *     struct evr_nand_read rd;
+ *
+ *     if (evr_open(&f, "capture.tbev"))
+ *         return -1;
+ *     evr_iter_init(&it, &f, 0, f.count);
+ *     while (evr_next(&it, &e) > 0)
+ *         if (!evr_as_nand_read(&e, &rd))
+ *             printf("row %06x\n", evr_nand_read_row(&rd));
+ *     evr_close(&f);
+ *
+ * Version 1 bodies are decoded in either the compact layout or the older
+ * fixed one (see evt_compact()); version 2 bodies are the tbe2_* structs.
+ * Events with EVT_FLAG_REF set have their payload in the blob file; their
+ * views give a NULL data pointer, and for NAND reads the reference is
+ * available from evr_nand_read_ref().
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "event-struct.h"
+
+struct evr_file {
+    int fd;
+    const uint8_t *map;
+    uint64_t size;
+
+    int version;        // 1 or 2
+    int wide;           // Version 1 with 64-bit jump table entries
+    uint64_t count;
+    const uint8_t *table;
+};
+
+// One event, in the map
+struct evr_event {
+    const uint8_t *hdr;
+    const uint8_t *body;
+    uint32_t body_size;
+    int version;
+};
+
+struct evr_iter {
+    struct evr_file *f;
+    uint64_t pos, end;
+};
+
+
+static inline uint32_t evr_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+         | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint16_t evr_be16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint64_t evr_be64(const uint8_t *p) {
+    return ((uint64_t)evr_be32(p) << 32) | evr_be32(p + 4);
+}
+
+static inline uint32_t evr_le32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+static inline uint64_t evr_le64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+
+static inline int evr_open(struct evr_file *f, const char *filename) {
+    struct stat stat_buf;
+    uint64_t width, events;
+
+    memset(f, 0, sizeof(*f));
+    f->fd = open(filename, O_RDONLY);
+    if (f->fd == -1) {
+        perror("Unable to open event file");
+        return -1;
+    }
+    if (fstat(f->fd, &stat_buf) == -1) {
+        perror("Couldn't stat event file");
+        goto err;
+    }
+    f->size = stat_buf.st_size;
+    if (f->size < sizeof(EVENT_HDR_1) + sizeof(uint32_t) + sizeof(EVENT_HDR_2)) {
+        fprintf(stderr, "%s is too short to be a sorted event file\n", filename);
+        goto err;
+    }
+    f->map = mmap(NULL, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (f->map == MAP_FAILED) {
+        perror("Couldn't map event file");
+        goto err;
+    }
+
+    if (!memcmp(f->map, TBE2_MAGIC, 4)) {
+        const uint8_t *footer;
+        uint64_t index_offset, index_end;
+
+        f->version = 2;
+        if (f->size < sizeof(struct tbe2_file_header) + sizeof(struct tbe2_footer)) {
+            fprintf(stderr, "%s is too short to be a version 2 event file\n", filename);
+            goto err_unmap;
+        }
+        index_end = f->size - sizeof(struct tbe2_footer);
+        footer = f->map + index_end;
+        f->count = evr_le64(footer + offsetof(struct tbe2_footer, count));
+        index_offset = evr_le64(footer + offsetof(struct tbe2_footer, index_offset));
+        if (memcmp(footer + offsetof(struct tbe2_footer, magic), TBE2_MAGIC, 4)
+         || evr_le32(f->map + offsetof(struct tbe2_file_header, version)) != TBE2_VERSION
+         || (index_offset & 7)
+         || index_offset > index_end
+         || f->count != (index_end - index_offset) / sizeof(uint64_t)) {
+            fprintf(stderr, "%s isn't a finished version 2 event file\n", filename);
+            goto err_unmap;
+        }
+        f->table = f->map + index_offset;
+        return 0;
+    }
+
+    f->version = 1;
+    if (!memcmp(f->map, EVENT_HDR_1_WIDE, sizeof(EVENT_HDR_1_WIDE))) {
+        f->wide = 1;
+        f->count = evr_be64(f->map + sizeof(EVENT_HDR_1));
+    }
+    else if (!memcmp(f->map, EVENT_HDR_1, sizeof(EVENT_HDR_1))) {
+        f->count = evr_be32(f->map + sizeof(EVENT_HDR_1));
+    }
+    else {
+        fprintf(stderr, "%s isn't a sorted event file\n", filename);
+        goto err_unmap;
+    }
+    width = f->wide ? sizeof(uint64_t) : sizeof(uint32_t);
+    f->table = f->map + sizeof(EVENT_HDR_1) + width;
+    events = sizeof(EVENT_HDR_1) + width + f->count * width;
+    if (f->count > f->size / width
+     || events + sizeof(EVENT_HDR_2) > f->size
+     || memcmp(f->map + events, EVENT_HDR_2, sizeof(EVENT_HDR_2))) {
+        fprintf(stderr, "%s has a damaged jump table\n", filename);
+        goto err_unmap;
+    }
+    return 0;
+
+err_unmap:
+    munmap((void *)f->map, f->size);
+err:
+    close(f->fd);
+    return -1;
+}
+
+static inline void evr_close(struct evr_file *f) {
+    munmap((void *)f->map, f->size);
+    close(f->fd);
+}
+
+// Find event i, returning 0, or -1 if the file doesn't lead to one
+static inline int evr_event(struct evr_file *f, uint64_t i,
+                            struct evr_event *e) {
+    uint64_t offset;
+    uint32_t hdr_size, size;
+
+    if (i >= f->count)
+        return -1;
+    if (f->version == 2) {
+        offset = evr_le64(f->table + i * sizeof(uint64_t));
+        hdr_size = sizeof(struct tbe2_header);
+        if ((offset & 7) || f->size < hdr_size || offset > f->size - hdr_size)
+            return -1;
+        size = evr_le32(f->map + offset + offsetof(struct tbe2_header, size));
+    }
+    else {
+        offset = (f->wide ? evr_be64(f->table + i * sizeof(uint64_t))
+                          : evr_be32(f->table + i * sizeof(uint32_t)))
+               + EVENT_JUMP_SKEW;
+        hdr_size = sizeof(struct evt_header);
+        if (f->size < hdr_size || offset > f->size - hdr_size)
+            return -1;
+        size = evr_be32(f->map + offset + offsetof(struct evt_header, size));
+    }
+    if (size < hdr_size || size > f->size - offset)
+        return -1;
+
+    e->hdr = f->map + offset;
+    e->body = e->hdr + hdr_size;
+    e->body_size = size - hdr_size;
+    e->version = f->version;
+    return 0;
+}
+
+static inline uint8_t evr_type(const struct evr_event *e) {
+    uint8_t type = e->version == 2
+                 ? e->hdr[offsetof(struct tbe2_header, type)]
+                 : e->hdr[offsetof(struct evt_header, type)];
+    return type & ~EVT_FLAG_REF;
+}
+
+// Whether the event's payload is in the blob file
+static inline int evr_is_ref(const struct evr_event *e) {
+    uint8_t type = e->version == 2
+                 ? e->hdr[offsetof(struct tbe2_header, type)]
+                 : e->hdr[offsetof(struct evt_header, type)];
+    return !!(type & EVT_FLAG_REF);
+}
+
+// Header times, by which of sec_start, nsec_start, sec_end, nsec_end
+#define EVR_FIELD(e, field) \
+    ((e)->version == 2 \
+     ? evr_le32((e)->hdr + offsetof(struct tbe2_header, field)) \
+     : evr_be32((e)->hdr + offsetof(struct evt_header, field)))
+
+static inline uint32_t evr_sec_start(const struct evr_event *e) {
+    return EVR_FIELD(e, sec_start);
+}
+
+static inline uint32_t evr_nsec_start(const struct evr_event *e) {
+    return EVR_FIELD(e, nsec_start);
+}
+
+static inline uint32_t evr_sec_end(const struct evr_event *e) {
+    return EVR_FIELD(e, sec_end);
+}
+
+static inline uint32_t evr_nsec_end(const struct evr_event *e) {
+    return EVR_FIELD(e, nsec_end);
+}
+
+// Start time, seconds in the top half and nanoseconds in the bottom
+static inline uint64_t evr_time(const struct evr_event *e) {
+    return ((uint64_t)evr_sec_start(e) << 32) | evr_nsec_start(e);
+}
+
+// Index of the first event starting at or after `time`
+static inline uint64_t evr_lower_bound(struct evr_file *f, uint64_t time) {
+    uint64_t lo = 0, hi = f->count;
+    struct evr_event e;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (!evr_event(f, mid, &e) && evr_time(&e) < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Walk events [first, last) in order
+static inline void evr_iter_init(struct evr_iter *it, struct evr_file *f,
+                                 uint64_t first, uint64_t last) {
+    it->f = f;
+    it->pos = first;
+    it->end = last < f->count ? last : f->count;
+}
+
+// Take the next event, returning 1, 0 at the end, or -1 if it's damaged
+static inline int evr_next(struct evr_iter *it, struct evr_event *e) {
+    if (it->pos >= it->end)
+        return 0;
+    if (evr_event(it->f, it->pos, e))
+        return -1;
+    it->pos++;
+    return 1;
+}
+
+
+/* Typed views.  evr_as_*() check the event's type and that its body is
+ * long enough, returning 0 and filling in the view if so.  Version 1
+ * bodies are read in either layout; version 2 ones are laid out as the
+ * tbe2_* body structs say.
+ */
+
+// Body offset of a field of one of the evt_* structs
+#define EVR_OFF(type, field) (offsetof(type, field) - sizeof(struct evt_header))
+
+// Whether a body is the full, fixed-size struct rather than compacted
+#define EVR_FIXED(e, type) ((e)->body_size == sizeof(type) - sizeof(struct evt_header))
+
+// Field of a version 2 body struct
+#define EVR_LE32(e, type, field) evr_le32((e)->body + offsetof(type, field))
+
+static inline uint16_t evr_le16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return le16toh(v);
+}
+
+// The blob file reference at `at` in an event's body
+static inline int evr_payload_ref(const struct evr_event *e, const uint8_t *at,
+                                  struct evt_payload_ref *ref) {
+    if (at + sizeof(*ref) > e->body + e->body_size)
+        return -1;
+    if (e->version == 2) {
+        ref->hash = evr_le64(at + offsetof(struct tbe2_payload_ref, hash));
+        ref->offset = evr_le64(at + offsetof(struct tbe2_payload_ref, offset));
+    }
+    else {
+        ref->hash = evr_be64(at);
+        ref->offset = evr_be64(at + sizeof(uint64_t));
+    }
+    return 0;
+}
+
+
+// EVT_NAND_READ and EVT_NAND_CHANGE_READ_COLUMN
+struct evr_nand_read {
+    const struct evr_event *e;
+    uint32_t count;
+    const uint8_t *addr;
+    const uint8_t *payload;
+    const uint8_t *data;        // NULL if it's in the blob file
+};
+
+static inline int evr_as_nand_read(const struct evr_event *e,
+                                   struct evr_nand_read *v) {
+    uint32_t need;
+
+    if (evr_type(e) != EVT_NAND_READ
+     && evr_type(e) != EVT_NAND_CHANGE_READ_COLUMN)
+        return -1;
+    v->e = e;
+    if (e->version == 2) {
+        if (e->body_size < sizeof(struct tbe2_nand_read))
+            return -1;
+        v->count = EVR_LE32(e, struct tbe2_nand_read, count);
+        v->addr = e->body + offsetof(struct tbe2_nand_read, addr);
+        v->payload = e->body + sizeof(struct tbe2_nand_read);
+    }
+    else {
+        if (e->body_size < EVR_OFF(struct evt_nand_read, data))
+            return -1;
+        v->count = evr_be32(e->body + EVR_OFF(struct evt_nand_read, count));
+        v->addr = e->body + EVR_OFF(struct evt_nand_read, addr);
+        v->payload = e->body + EVR_OFF(struct evt_nand_read, data);
+    }
+    need = evr_is_ref(e) ? sizeof(struct evt_payload_ref) : v->count;
+    if (v->count > sizeof(((struct evt_nand_read *)0)->data)
+     || v->payload + need > e->body + e->body_size)
+        return -1;
+    v->data = evr_is_ref(e) ? NULL : v->payload;
+    return 0;
+}
+
+static inline const uint8_t *evr_nand_read_addr(const struct evr_nand_read *v) {
+    return v->addr;
+}
+
+// The row address: the last three address cycles, low byte first
+static inline uint32_t evr_nand_read_row(const struct evr_nand_read *v) {
+    const uint8_t *addr = evr_nand_read_addr(v);
+    return addr[2] | (addr[3] << 8) | (addr[4] << 16);
+}
+
+static inline int evr_nand_read_ref(const struct evr_nand_read *v,
+                                    struct evt_payload_ref *ref) {
+    if (!evr_is_ref(v->e))
+        return -1;
+    return evr_payload_ref(v->e, v->payload, ref);
+}
+
+
+// EVT_SD_CMD
+struct evr_sd_cmd {
+    const struct evr_event *e;
+    uint8_t cmd;                // High bit set if it's ACMD
+    uint32_t num_args;
+    const uint8_t *args;
+    uint32_t num_results;
+    const uint8_t *result;      // NULL if it's in the blob file
+};
+
+static inline int evr_as_sd_cmd(const struct evr_event *e,
+                                struct evr_sd_cmd *v) {
+    const uint8_t *end = e->body + e->body_size;
+    const uint8_t *p;
+
+    if (evr_type(e) != EVT_SD_CMD)
+        return -1;
+    v->e = e;
+    if (e->version == 2) {
+        if (e->body_size < sizeof(struct tbe2_sd_cmd))
+            return -1;
+        v->cmd = e->body[offsetof(struct tbe2_sd_cmd, cmd)];
+        v->num_args = EVR_LE32(e, struct tbe2_sd_cmd, num_args);
+        v->num_results = EVR_LE32(e, struct tbe2_sd_cmd, num_results);
+        v->args = e->body + sizeof(struct tbe2_sd_cmd);
+        if (v->num_args > sizeof(((struct evt_sd_cmd *)0)->args))
+            return -1;
+        // The results start on the next 8-byte boundary
+        p = v->args + ((v->num_args + 7) & ~7);
+    }
+    else {
+        if (e->body_size < EVR_OFF(struct evt_sd_cmd, args))
+            return -1;
+        v->cmd = e->body[EVR_OFF(struct evt_sd_cmd, cmd)];
+        v->num_args = evr_be32(e->body + EVR_OFF(struct evt_sd_cmd, num_args));
+        v->args = e->body + EVR_OFF(struct evt_sd_cmd, args);
+        if (v->num_args > sizeof(((struct evt_sd_cmd *)0)->args))
+            return -1;
+
+        // Compacted, num_results follows the arguments used
+        p = EVR_FIXED(e, struct evt_sd_cmd)
+          ? e->body + EVR_OFF(struct evt_sd_cmd, num_results)
+          : v->args + v->num_args;
+        if (p + sizeof(uint32_t) > end)
+            return -1;
+        v->num_results = evr_be32(p);
+        p += sizeof(uint32_t);
+    }
+    if (v->num_results > sizeof(((struct evt_sd_cmd *)0)->result)
+     || p + (evr_is_ref(e) ? sizeof(struct evt_payload_ref) : v->num_results) > end)
+        return -1;
+    v->result = evr_is_ref(e) ? NULL : p;
+    return 0;
+}
+
+// The command's 32-bit argument (the sector, for reads and writes)
+static inline uint32_t evr_sd_cmd_arg(const struct evr_sd_cmd *v) {
+    return v->num_args < 4 ? 0 : evr_be32(v->args);
+}
+
+
+// EVT_SD_MULTI
+struct evr_sd_multi {
+    const struct evr_event *e;
+    uint8_t cmd;
+    uint8_t flags;
+    uint32_t sector;
+    uint32_t num_blocks;
+    uint8_t num_results;
+    const uint8_t *result;
+    const uint8_t *blocks;
+    const uint8_t *data;        // num_blocks * SD_BLOCK_SIZE, or NULL
+};
+
+static inline int evr_as_sd_multi(const struct evr_event *e,
+                                  struct evr_sd_multi *v) {
+    uint64_t data;
+
+    if (evr_type(e) != EVT_SD_MULTI)
+        return -1;
+    v->e = e;
+    if (e->version == 2) {
+        if (e->body_size < sizeof(struct tbe2_sd_multi))
+            return -1;
+        v->cmd = e->body[offsetof(struct tbe2_sd_multi, cmd)];
+        v->flags = e->body[offsetof(struct tbe2_sd_multi, flags)];
+        v->sector = EVR_LE32(e, struct tbe2_sd_multi, sector);
+        v->num_blocks = EVR_LE32(e, struct tbe2_sd_multi, num_blocks);
+        v->num_results = e->body[offsetof(struct tbe2_sd_multi, num_results)];
+        v->result = e->body + offsetof(struct tbe2_sd_multi, result);
+        v->blocks = e->body + sizeof(struct tbe2_sd_multi);
+        data = sizeof(struct tbe2_sd_multi)
+             + (uint64_t)v->num_blocks * sizeof(struct tbe2_sd_block);
+    }
+    else {
+        if (e->body_size < EVR_OFF(struct evt_sd_multi, blocks))
+            return -1;
+        v->cmd = e->body[EVR_OFF(struct evt_sd_multi, cmd)];
+        v->flags = e->body[EVR_OFF(struct evt_sd_multi, flags)];
+        v->sector = evr_be32(e->body + EVR_OFF(struct evt_sd_multi, sector));
+        v->num_blocks = evr_be32(e->body + EVR_OFF(struct evt_sd_multi, num_blocks));
+        v->num_results = e->body[EVR_OFF(struct evt_sd_multi, num_results)];
+        v->result = e->body + EVR_OFF(struct evt_sd_multi, result);
+        v->blocks = e->body + EVR_OFF(struct evt_sd_multi, blocks);
+        data = EVR_FIXED(e, struct evt_sd_multi)
+             ? EVR_OFF(struct evt_sd_multi, data)
+             : EVR_OFF(struct evt_sd_multi, blocks)
+               + (uint64_t)v->num_blocks * sizeof(struct evt_sd_block);
+    }
+    if (v->num_blocks > sizeof(((struct evt_sd_multi *)0)->blocks)
+                      / sizeof(struct evt_sd_block))
+        return -1;
+    if (data + (evr_is_ref(e) ? sizeof(struct evt_payload_ref)
+                              : v->num_blocks * SD_BLOCK_SIZE) > e->body_size)
+        return -1;
+    v->data = evr_is_ref(e) ? NULL : e->body + data;
+    return 0;
+}
+
+static inline uint8_t evr_sd_multi_num_results(const struct evr_sd_multi *v) {
+    return v->num_results;
+}
+
+static inline const uint8_t *evr_sd_multi_result(const struct evr_sd_multi *v) {
+    return v->result;
+}
+
+// When block i went by
+static inline void evr_sd_multi_block(const struct evr_sd_multi *v, uint32_t i,
+                                      uint32_t *sec, uint32_t *nsec) {
+    if (v->e->version == 2) {
+        const uint8_t *p = v->blocks + i * sizeof(struct tbe2_sd_block);
+        *sec = evr_le32(p + offsetof(struct tbe2_sd_block, sec));
+        *nsec = evr_le32(p + offsetof(struct tbe2_sd_block, nsec));
+    }
+    else {
+        const uint8_t *p = v->blocks + i * sizeof(struct evt_sd_block);
+        *sec = evr_be32(p);
+        *nsec = evr_be32(p + sizeof(uint32_t));
+    }
+}
+
+
+// EVT_NAND_STATUS_RUN
+struct evr_status_run {
+    const struct evr_event *e;
+    uint32_t count;
+    uint8_t status;
+    uint16_t num_changes;
+    const uint8_t *changes;
+};
+
+static inline int evr_as_status_run(const struct evr_event *e,
+                                    struct evr_status_run *v) {
+    uint64_t need;
+
+    if (evr_type(e) != EVT_NAND_STATUS_RUN)
+        return -1;
+    v->e = e;
+    if (e->version == 2) {
+        if (e->body_size < sizeof(struct tbe2_nand_status_run))
+            return -1;
+        v->count = EVR_LE32(e, struct tbe2_nand_status_run, count);
+        v->status = e->body[offsetof(struct tbe2_nand_status_run, status)];
+        v->num_changes = evr_le16(e->body + offsetof(struct tbe2_nand_status_run, num_changes));
+        v->changes = e->body + sizeof(struct tbe2_nand_status_run);
+        need = sizeof(struct tbe2_nand_status_run)
+             + v->num_changes * sizeof(struct tbe2_nand_status_change);
+    }
+    else {
+        if (e->body_size < EVR_OFF(struct evt_nand_status_run, changes))
+            return -1;
+        v->count = evr_be32(e->body + EVR_OFF(struct evt_nand_status_run, count));
+        v->status = e->body[EVR_OFF(struct evt_nand_status_run, status)];
+        v->num_changes = evr_be16(e->body + EVR_OFF(struct evt_nand_status_run, num_changes));
+        v->changes = e->body + EVR_OFF(struct evt_nand_status_run, changes);
+        need = EVR_OFF(struct evt_nand_status_run, changes)
+             + v->num_changes * sizeof(struct evt_nand_status_change);
+    }
+    if (need > e->body_size)
+        return -1;
+    return 0;
+}
+
+static inline void evr_status_run_change(const struct evr_status_run *v,
+                                         uint16_t i,
+                                         struct evt_nand_status_change *change) {
+    if (v->e->version == 2) {
+        const uint8_t *p = v->changes + i * sizeof(struct tbe2_nand_status_change);
+        change->index = evr_le32(p + offsetof(struct tbe2_nand_status_change, index));
+        change->sec = evr_le32(p + offsetof(struct tbe2_nand_status_change, sec));
+        change->nsec = evr_le32(p + offsetof(struct tbe2_nand_status_change, nsec));
+        change->status = p[offsetof(struct tbe2_nand_status_change, status)];
+    }
+    else {
+        const uint8_t *p = v->changes + i * sizeof(*change);
+        change->index = evr_be32(p + offsetof(struct evt_nand_status_change, index));
+        change->sec = evr_be32(p + offsetof(struct evt_nand_status_change, sec));
+        change->nsec = evr_be32(p + offsetof(struct evt_nand_status_change, nsec));
+        change->status = p[offsetof(struct evt_nand_status_change, status)];
+    }
+}
+
+
+// EVT_NAND_ID, whose body is the same in both versions
+static inline const uint8_t *evr_nand_id(const struct evr_event *e) {
+    if (evr_type(e) != EVT_NAND_ID
+     || e->body_size < sizeof(struct evt_nand_id) - sizeof(struct evt_header))
+        return NULL;
+    return e->body + EVR_OFF(struct evt_nand_id, id);
+}
+
+// EVT_NAND_STATUS, returning the status byte, or -1
+static inline int evr_nand_status(const struct evr_event *e) {
+    if (evr_type(e) != EVT_NAND_STATUS || e->body_size < 1)
+        return -1;
+    return e->body[EVR_OFF(struct evt_nand_status, status)];
+}
+
+#endif /* __EVENT_READER_H_ */
@@ -5,11 +5,20 @@
 #define EVENT_MAGIC_2 0x74931723
 
 static const char EVENT_HDR_1[4] = "TBEv";
+static const char EVENT_HDR_1_WIDE[4] = "TBE8";
 static const char EVENT_HDR_2[4] = "MaDa";
 
+/* Jump table entries in sorted files are each event's offset less the
+ * size of EVENT_HDR_2, as the first sorter counted them.
+ */
+#define EVENT_JUMP_SKEW sizeof(EVENT_HDR_2)
+
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
 struct state;
 struct pkt;
+struct evt_buffer;
 
 enum evt_type {
     EVT_HELLO,
@@ -25,6 +34,7 @@ enum evt_type {
     EVT_NAND_UNKNOWN,
     EVT_NAND_RESET,
     EVT_UNKNOWN,
+    EVT_SD_MULTI,
     EVT_NAND_CACHE1 = 0x30,
     EVT_NAND_CACHE2 = 0x31,
     EVT_NAND_CACHE3 = 0x32,
@@ -33,8 +43,13 @@ enum evt_type {
     EVT_NAND_SANDISK_VENDOR_PARAM   = 0x61,
     EVT_NAND_SANDISK_CHARGE1        = 0x62,
     EVT_NAND_SANDISK_CHARGE2        = 0x63,
+    EVT_NAND_SANDISK_MACRO          = 0x64,
+    EVT_NAND_STATUS_RUN             = 0x70,
 };
 
+// Set in evt_header.type when the payload is in the blob file
+#define EVT_FLAG_REF 0x80
+
 struct evt_header {
     uint8_t type;
     uint32_t sec_start, nsec_start;
@@ -44,6 +59,14 @@ struct evt_header {
 
 
 
+// Stands in for a payload that was moved to the blob file, in events
+// flagged with EVT_FLAG_REF.  The payload's length is the event's count.
+struct evt_payload_ref {
+    uint64_t hash;
+    uint64_t offset;
+} __attribute__((__packed__));
+
+
 // A full SD command (including response)
 struct evt_sd_cmd {
     struct evt_header hdr;
@@ -56,6 +79,34 @@ struct evt_sd_cmd {
 } __attribute__((__packed__));
 
 
+#define SD_BLOCK_SIZE 512
+
+// When one block of a multi-block transfer went by
+struct evt_sd_block {
+    uint32_t sec, nsec;
+} __attribute__((__packed__));
+
+// Set in evt_sd_multi.flags when the event carries on from the one before
+#define SD_MULTI_CONTINUED 0x01
+
+/* A multi-block read (CMD18) or write (CMD25).  Transfers longer than
+ * blocks[] are split over several events, each continuing the last.
+ * sector is the command's argument plus however many blocks went before,
+ * so it's the first sector covered on block-addressed (SDHC) cards.
+ */
+struct evt_sd_multi {
+    struct evt_header hdr;
+    uint8_t  cmd;
+    uint8_t  flags;
+    uint32_t sector;
+    uint8_t  num_results;
+    uint8_t  result[16];
+    uint32_t num_blocks;
+    struct evt_sd_block blocks[128];
+    uint8_t  data[128 * SD_BLOCK_SIZE];
+} __attribute__((__packed__));
+
+
 // When the FPGA buffer is drained
 struct evt_buffer_drain {
     struct evt_header hdr;
@@ -194,10 +245,45 @@ struct evt_nand_cache4 {
 } __attribute__((__packed__));
 
 
+// A point in a status run where the status byte changed
+struct evt_nand_status_change {
+    uint32_t index;     // Which poll of the run
+    uint32_t sec, nsec;
+    uint8_t status;
+} __attribute__((__packed__));
+
+// Back-to-back status polls, collapsed into one event (grouper -c).  The
+// header spans the first poll to the last.
+struct evt_nand_status_run {
+    struct evt_header hdr;
+    uint32_t count;     // Number of polls
+    uint8_t status;     // Status returned by the first poll
+    uint16_t num_changes;
+    struct evt_nand_status_change changes[64];
+} __attribute__((__packed__));
+
+// One vendor command within a macro
+struct evt_nand_macro_step {
+    uint8_t type;       // EVT_NAND_SANDISK_* type of the command
+    uint8_t args[3];    // Its address/data bytes
+} __attribute__((__packed__));
+
+// A run of SanDisk vendor commands, collapsed into one event (grouper -c).
+// A pass starts with the 0x5c 0xc5 vendor code; repeats counts identical
+// passes seen back-to-back.
+struct evt_nand_sandisk_macro {
+    struct evt_header hdr;
+    uint32_t repeats;
+    uint8_t num_steps;
+    struct evt_nand_macro_step steps[64];
+} __attribute__((__packed__));
+
+
 
 union evt {
     struct evt_header header;
     struct evt_sd_cmd sd_cmd;
+    struct evt_sd_multi sd_multi;
     struct evt_buffer_drain buffer_drain;
     struct evt_reset reset;
     struct evt_net_cmd net_cmd;
@@ -218,6 +304,8 @@ union evt {
     struct evt_nand_cache2 nand_cache2;
     struct evt_nand_cache3 nand_cache3;
     struct evt_nand_cache4 nand_cache4;
+    struct evt_nand_status_run nand_status_run;
+    struct evt_nand_sandisk_macro nand_sandisk_macro;
 } __attribute__((__packed__));
 
 int evt_fill_header(void *arg, uint32_t sec_start, uint32_t nsec_start,
@@ -227,6 +315,270 @@ int evt_fill_end(void *arg,
 int evt_write_hello(struct state *st, struct pkt *pkt);
 int evt_write_reset(struct state *st, struct pkt *pkt);
 int evt_write_nand_unk(struct state *st, struct pkt *pkt);
+void *evt_take(struct state *st, int type);
+int evt_put(struct state *st, void *v);
+
+uint32_t evt_fixed_size(uint8_t type);
+int evt_compact(void *arg, uint32_t size);
+int evt_expand(void *arg, uint32_t size);
+int evt_emit(struct state *st, void *arg);
+int evt_buffer_append(struct evt_buffer *buf, void *arg, uint32_t size);
+int evt_add_stage(struct state *st,
+                  int (*event)(struct state *st, int stage,
+                               void *evt, uint32_t size),
+                  int (*flush)(struct state *st, int stage));
+int evt_pass(struct state *st, int stage, void *arg, uint32_t size);
+int evt_sink(struct state *st, void *arg, uint32_t size);
+int evt_sink_records(struct state *st, uint8_t *data, size_t len);
+int evt_sink_flush(struct state *st);
+int evt_output(struct state *st, void *arg, uint32_t size);
+
+int collapse_init(struct state *st);
+int collapse_held(struct state *st, uint32_t *sec, uint32_t *nsec);
+void collapse_free(struct state *st);
+
+int reorder_init(struct state *st);
+int reorder_release(struct state *st);
+void reorder_free(struct state *st);
+
+int blob_store_create(struct state *st, const char *events_path);
+int blob_store_open(struct state *st, const char *events_path);
+void blob_store_close(struct state *st);
+int blob_store_copy(const char *from_events, const char *to_events);
+int blob_store_append(const char *from_events, const char *to_events,
+                      uint64_t *shift);
+int blob_rebase(void *arg, uint32_t size, uint64_t shift);
+int blob_resolve(struct state *st, union evt *evt);
+
+/* A sorted file (the sorter's output), mapped.  The jump table is wide
+ * (64-bit entries) in files starting with EVENT_HDR_1_WIDE.
+ */
+struct sorted_file {
+    int fd;
+    uint8_t *map;
+    uint64_t size;
+
+    int wide;
+    uint64_t count;
+    uint8_t *table;
+};
+
+int sorted_open(struct sorted_file *sf, const char *filename);
+void sorted_close(struct sorted_file *sf);
+uint64_t sorted_offset(struct sorted_file *sf, uint64_t i);
+struct evt_header *sorted_event(struct sorted_file *sf, uint64_t i);
+uint64_t sorted_time(struct sorted_file *sf, uint64_t i);
+uint64_t sorted_lower_bound(struct sorted_file *sf, uint64_t time);
+
+/* Version 2 event files (tbe2.c).  Everything is little-endian and
+ * aligned to its size, so records can be used in place.  See the tbe2_*
+ * body structs below for how each event type's body is laid out.
+ */
+#define TBE2_MAGIC "TBE2"
+#define TBE2_VERSION 2
+
+// Set in tbe2_footer.flags when records are in order of start time
+#define TBE2_SORTED 0x01
+
+struct tbe2_file_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t reserved;
+};
+
+// Starts each record, on an 8-byte boundary.  size doesn't count padding.
+struct tbe2_header {
+    uint32_t sec_start, nsec_start;
+    uint32_t sec_end, nsec_end;
+    uint32_t size;
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+/* Version 2 event bodies, which follow struct tbe2_header.  Any
+ * variable-length parts follow the fixed one, in the order given; a
+ * payload moved to the blob file (EVT_FLAG_REF) is a struct
+ * tbe2_payload_ref in its place, which always falls on an 8-byte
+ * boundary.  Types not listed here have bodies made only of bytes, which
+ * are the same as in version 1.
+ */
+struct tbe2_payload_ref {
+    uint64_t hash;
+    uint64_t offset;
+};
+
+// EVT_SD_CMD, then args[num_args] padded to 8 bytes, then result[num_results]
+struct tbe2_sd_cmd {
+    uint32_t num_args;
+    uint32_t num_results;
+    uint8_t cmd;
+    uint8_t reserved;
+    uint8_t pad[6];
+};
+
+// EVT_SD_MULTI, then blocks[num_blocks], then their data
+struct tbe2_sd_multi {
+    uint32_t sector;
+    uint32_t num_blocks;
+    uint8_t cmd;
+    uint8_t flags;
+    uint8_t num_results;
+    uint8_t result[16];
+    uint8_t pad[5];
+};
+
+struct tbe2_sd_block {
+    uint32_t sec, nsec;
+};
+
+// EVT_NAND_READ and EVT_NAND_CHANGE_READ_COLUMN, then data[count]
+struct tbe2_nand_read {
+    uint32_t count;
+    uint8_t addr[5];
+    uint8_t unknown[2];
+    uint8_t pad[5];
+};
+
+// EVT_NAND_PARAMETER_READ, then data[count]
+struct tbe2_nand_parameter_read {
+    uint16_t count;
+    uint8_t addr;
+    uint8_t pad[5];
+};
+
+// EVT_NAND_STATUS_RUN, then changes[num_changes]
+struct tbe2_nand_status_run {
+    uint32_t count;
+    uint16_t num_changes;
+    uint8_t status;
+    uint8_t pad;
+};
+
+struct tbe2_nand_status_change {
+    uint32_t index;
+    uint32_t sec, nsec;
+    uint8_t status;
+    uint8_t pad[3];
+};
+
+// EVT_NAND_SANDISK_MACRO, then steps[num_steps] (struct evt_nand_macro_step)
+struct tbe2_nand_sandisk_macro {
+    uint32_t repeats;
+    uint8_t num_steps;
+    uint8_t pad[3];
+};
+
+// EVT_HELLO
+struct tbe2_hello {
+    uint32_t magic1;
+    uint32_t magic2;
+    uint8_t version;
+    uint8_t pad[3];
+};
+
+// EVT_NET_CMD
+struct tbe2_net_cmd {
+    uint32_t arg;
+    uint8_t cmd[2];
+    uint8_t pad[2];
+};
+
+// EVT_NAND_UNKNOWN
+struct tbe2_nand_unk {
+    uint16_t unknown;
+    uint8_t data;
+    uint8_t ctrl;
+};
+
+struct tbe2_footer {
+    uint64_t count;
+    uint64_t index_offset;
+    uint32_t flags;
+    uint32_t version;
+    uint32_t reserved;
+    char magic[4];
+};
+
+struct tbe2_writer {
+    int fd;
+    uint64_t offset;
+    uint64_t count;
+    uint32_t flags;
+    uint64_t last_time;
+
+    uint8_t *buf;
+    size_t buf_len;
+
+    // A version 1 record put into its compact layout before converting
+    union evt *rec;
+
+    int index_fd;
+    uint64_t *index;
+    size_t index_len;
+    uint64_t index_bytes;
+};
+
+// A version 2 file, mapped
+struct tbe2_file {
+    int fd;
+    uint8_t *map;
+    uint64_t size;
+    uint64_t count;
+    uint32_t flags;
+    const uint64_t *index;
+};
+
+int tbe2_writer_open(struct tbe2_writer *w, int fd);
+int tbe2_write(struct tbe2_writer *w, const void *arg, uint32_t size);
+int tbe2_writer_close(struct tbe2_writer *w);
+void tbe2_writer_discard(struct tbe2_writer *w);
+int tbe2_open(struct tbe2_file *f, const char *filename);
+void tbe2_close(struct tbe2_file *f);
+const struct tbe2_header *tbe2_event(struct tbe2_file *f, uint64_t i);
+int tbe2_to_v1(const struct tbe2_header *hdr, void *out);
+
+/* What the sorter needs to know about each event, gathered in one pass
+ * over the input: its start time (seconds in the top half, nanoseconds in
+ * the bottom, so it compares as one number), and where it is.
+ */
+struct sort_key {
+    uint64_t time;
+    off_t offset;
+    uint32_t size;
+};
+
+// Stable, in order of time (keysort.c)
+int sort_keys(struct sort_key *keys, size_t count);
+
+enum index_kind {
+    INDEX_TYPE,         // Event type, without EVT_FLAG_REF
+    INDEX_NAND_ROW,     // Row address of an EVT_NAND_READ
+    INDEX_SD_SECTOR,    // Argument of an SD command, or multi-block sector
+    INDEX_KINDS,
+};
+
+struct index_builder;
+
+// A sorted file's secondary indexes (<events>.idx), mapped
+struct index_file {
+    uint8_t *map;
+    uint64_t size;
+    uint64_t keys[INDEX_KINDS];
+    const uint8_t *dirs[INDEX_KINDS];
+};
+
+struct index_builder *index_builder_new(void);
+void index_builder_free(struct index_builder *b);
+int index_builder_add(struct index_builder *b, uint64_t pos,
+                      const void *arg, uint32_t size);
+int index_write(struct index_builder **builders, int count,
+                const char *events_path);
+int index_remove(const char *events_path);
+int index_open(struct index_file *ix, const char *events_path);
+void index_close(struct index_file *ix);
+int index_lookup(struct index_file *ix, int kind, uint64_t lo, uint64_t hi,
+                 int (*found)(void *arg, uint64_t key, uint64_t pos),
+                 void *arg);
 
 int event_get_next(struct state *st, union evt *evt);
 int event_unget(struct state *st, union evt *evt);
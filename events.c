@@ -1,5 +1,9 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include "state.h"
 #include "packet-struct.h"
 #include "event-struct.h"
@@ -24,6 +28,12 @@ int event_get_next(struct state *st, union evt *evt) {
     evt->header.nsec_end = ntohl(evt->header.nsec_end);
     evt->header.size = ntohl(evt->header.size);
 
+    if (evt->header.size < sizeof(evt->header)
+     || evt->header.size > sizeof(*evt)) {
+        fprintf(stderr, "Bad event size %d\n", evt->header.size);
+        return -1;
+    }
+
     bytes_to_read = evt->header.size - sizeof(evt->header);
     ret = read(st->fd,
                ((char *)&(evt->header)) + sizeof(evt->header),
@@ -39,6 +49,15 @@ int event_get_next(struct state *st, union evt *evt) {
         return -2;
     }
 
+    if ((evt->header.type & EVT_FLAG_REF) && st->blobs
+     && blob_resolve(st, evt) < 0)
+        return -1;
+
+    if (evt_expand(evt, evt->header.size) < 0) {
+        fprintf(stderr, "Corrupt event of type %d\n", evt->header.type);
+        return -1;
+    }
+
     return 0;
 }
 
@@ -48,6 +67,13 @@ int event_unget(struct state *st, union evt *evt) {
 
 int event_write(struct state *st, union evt *evt) {
     int ret;
+    int compact;
+
+    // Records read in the old fixed layout are written back out as-is, so
+    // header.size keeps describing what lands on disk.
+    compact = (evt->header.size != evt_fixed_size(evt->header.type));
+    if (compact)
+        evt->header.size = evt_compact(evt, evt->header.size);
     evt->header.sec_start = htonl(evt->header.sec_start);
     evt->header.nsec_start = htonl(evt->header.nsec_start);
     evt->header.sec_end = htonl(evt->header.sec_end);
@@ -60,11 +86,334 @@ int event_write(struct state *st, union evt *evt) {
     evt->header.sec_end = ntohl(evt->header.sec_end);
     evt->header.nsec_end = ntohl(evt->header.nsec_end);
     evt->header.size = ntohl(evt->header.size);
+    if (compact)
+        evt_expand(evt, evt->header.size);
 
     return ret;
 }
 
 
+/* Variable-length records.
+ * Events are built in memory as their full fixed-size struct, but only
+ * the used part of each array is written out.  Fields that come after an
+ * array (e.g. num_results, reserved, unknown[]) are moved down to follow
+ * the last used byte, and header.size is the real record length.
+ * Records whose size equals sizeof the struct are already in the
+ * fixed layout, so older event files are read unchanged.
+ *
+ * Count fields must be in network order, as they are on disk.
+ */
+uint32_t evt_fixed_size(uint8_t type) {
+    switch (type) {
+    case EVT_NAND_STATUS_RUN:
+        return sizeof(struct evt_nand_status_run);
+    case EVT_NAND_SANDISK_MACRO:
+        return sizeof(struct evt_nand_sandisk_macro);
+    case EVT_SD_CMD:
+        return sizeof(struct evt_sd_cmd);
+    case EVT_SD_MULTI:
+        return sizeof(struct evt_sd_multi);
+    case EVT_NAND_READ:
+    case EVT_NAND_CHANGE_READ_COLUMN:
+        return sizeof(struct evt_nand_read);
+    case EVT_NAND_PARAMETER_READ:
+        return sizeof(struct evt_nand_parameter_read);
+    default:
+        return 0;
+    }
+}
+
+int evt_compact(void *arg, uint32_t size) {
+    union evt *evt = arg;
+
+    switch (evt->header.type) {
+    case EVT_SD_CMD: {
+        struct evt_sd_cmd *sd = &evt->sd_cmd;
+        uint32_t num_args = ntohl(sd->num_args);
+        uint32_t num_results = ntohl(sd->num_results);
+        uint8_t reserved = sd->reserved;
+        uint8_t *p = sd->args + num_args;
+
+        if (num_args > sizeof(sd->args) || num_results > sizeof(sd->result))
+            return size;
+        memmove(p, &sd->num_results, sizeof(sd->num_results) + num_results);
+        p += sizeof(sd->num_results) + num_results;
+        *p++ = reserved;
+        return p - (uint8_t *)evt;
+    }
+
+    case EVT_SD_MULTI: {
+        struct evt_sd_multi *multi = &evt->sd_multi;
+        uint32_t num_blocks = ntohl(multi->num_blocks);
+
+        if (num_blocks > sizeof(multi->blocks) / sizeof(multi->blocks[0]))
+            return size;
+        memmove(&multi->blocks[num_blocks], multi->data,
+                num_blocks * SD_BLOCK_SIZE);
+        return offsetof(struct evt_sd_multi, blocks)
+             + num_blocks * (sizeof(multi->blocks[0]) + SD_BLOCK_SIZE);
+    }
+
+    case EVT_NAND_READ:
+    case EVT_NAND_CHANGE_READ_COLUMN: {
+        struct evt_nand_read *rd = &evt->nand_read;
+        uint32_t count = ntohl(rd->count);
+        uint8_t unknown[sizeof(rd->unknown)];
+
+        if (count > sizeof(rd->data))
+            return size;
+        memcpy(unknown, rd->unknown, sizeof(unknown));
+        memcpy(rd->data + count, unknown, sizeof(unknown));
+        return offsetof(struct evt_nand_read, data) + count + sizeof(unknown);
+    }
+
+    case EVT_NAND_PARAMETER_READ: {
+        struct evt_nand_parameter_read *param = &evt->nand_parameter_read;
+        uint16_t count = ntohs(param->count);
+
+        if (count > sizeof(param->data))
+            return size;
+        return offsetof(struct evt_nand_parameter_read, data) + count;
+    }
+
+    case EVT_NAND_STATUS_RUN: {
+        struct evt_nand_status_run *run = &evt->nand_status_run;
+        uint16_t num_changes = ntohs(run->num_changes);
+
+        if (num_changes > sizeof(run->changes) / sizeof(run->changes[0]))
+            return size;
+        return offsetof(struct evt_nand_status_run, changes)
+             + num_changes * sizeof(run->changes[0]);
+    }
+
+    case EVT_NAND_SANDISK_MACRO: {
+        struct evt_nand_sandisk_macro *macro = &evt->nand_sandisk_macro;
+
+        if (macro->num_steps > sizeof(macro->steps) / sizeof(macro->steps[0]))
+            return size;
+        return offsetof(struct evt_nand_sandisk_macro, steps)
+             + macro->num_steps * sizeof(macro->steps[0]);
+    }
+
+    default:
+        return size;
+    }
+}
+
+int evt_expand(void *arg, uint32_t size) {
+    union evt *evt = arg;
+    uint32_t fixed;
+
+    switch (evt->header.type) {
+    case EVT_SD_CMD: {
+        struct evt_sd_cmd *sd = &evt->sd_cmd;
+        uint32_t num_args, num_results;
+        uint8_t *p;
+
+        if (size == sizeof(*sd))
+            return 0;
+        num_args = ntohl(sd->num_args);
+        if (num_args > sizeof(sd->args))
+            return -1;
+        p = sd->args + num_args;
+
+        memcpy(&num_results, p, sizeof(num_results));
+        num_results = ntohl(num_results);
+        fixed = offsetof(struct evt_sd_cmd, args) + num_args
+              + sizeof(sd->num_results) + num_results + sizeof(sd->reserved);
+        if (num_results > sizeof(sd->result) || fixed != size)
+            return -1;
+
+        sd->reserved = p[sizeof(sd->num_results) + num_results];
+        memmove(&sd->num_results, p, sizeof(sd->num_results) + num_results);
+        return 0;
+    }
+
+    case EVT_SD_MULTI: {
+        struct evt_sd_multi *multi = &evt->sd_multi;
+        uint32_t num_blocks;
+
+        if (size == sizeof(*multi))
+            return 0;
+        num_blocks = ntohl(multi->num_blocks);
+        fixed = offsetof(struct evt_sd_multi, blocks)
+              + num_blocks * (sizeof(multi->blocks[0]) + SD_BLOCK_SIZE);
+        if (num_blocks > sizeof(multi->blocks) / sizeof(multi->blocks[0])
+         || fixed != size)
+            return -1;
+        memmove(multi->data, &multi->blocks[num_blocks],
+                num_blocks * SD_BLOCK_SIZE);
+        return 0;
+    }
+
+    case EVT_NAND_READ:
+    case EVT_NAND_CHANGE_READ_COLUMN: {
+        struct evt_nand_read *rd = &evt->nand_read;
+        uint32_t count;
+
+        if (size == sizeof(*rd))
+            return 0;
+        count = ntohl(rd->count);
+        fixed = offsetof(struct evt_nand_read, data)
+              + count + sizeof(rd->unknown);
+        if (count > sizeof(rd->data) || fixed != size)
+            return -1;
+        memcpy(rd->unknown, rd->data + count, sizeof(rd->unknown));
+        return 0;
+    }
+
+    case EVT_NAND_PARAMETER_READ: {
+        struct evt_nand_parameter_read *param = &evt->nand_parameter_read;
+
+        if (size == sizeof(*param))
+            return 0;
+        fixed = offsetof(struct evt_nand_parameter_read, data)
+              + ntohs(param->count);
+        if (ntohs(param->count) > sizeof(param->data) || fixed != size)
+            return -1;
+        return 0;
+    }
+
+    case EVT_NAND_STATUS_RUN:
+    case EVT_NAND_SANDISK_MACRO:
+        // Nothing follows the trailing array, so just check the length
+        if (size != evt_fixed_size(evt->header.type)
+         && evt_compact(evt, size) != size)
+            return -1;
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+int evt_buffer_append(struct evt_buffer *buf, void *arg, uint32_t size) {
+    if (buf->len + size > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 65536;
+        uint8_t *data;
+
+        while (cap < buf->len + size)
+            cap *= 2;
+        data = realloc(buf->data, cap);
+        if (!data) {
+            perror("Couldn't grow event buffer");
+            return -1;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, arg, size);
+    buf->len += size;
+    return size;
+}
+
+// Write out an event built by the grouper, whose header is already in
+// network order, trimmed to its actual length.
+int evt_emit(struct state *st, void *arg) {
+    struct evt_header *hdr = arg;
+    uint32_t size;
+
+    size = evt_compact(arg, ntohl(hdr->size));
+    hdr->size = htonl(size);
+    if (st->out_buf)
+        return evt_buffer_append(st->out_buf, arg, size);
+    return evt_sink(st, arg, size);
+}
+
+
+/* Finished grouper events go through the stages the grouper has set up
+ * in st->stages (collapsing, payload dedup, ...), and then to
+ * evt_output().
+ */
+int evt_add_stage(struct state *st,
+                  int (*event)(struct state *st, int stage,
+                               void *evt, uint32_t size),
+                  int (*flush)(struct state *st, int stage)) {
+    if (st->num_stages >= sizeof(st->stages) / sizeof(st->stages[0]))
+        return -1;
+    st->stages[st->num_stages].event = event;
+    st->stages[st->num_stages].flush = flush;
+    return st->num_stages++;
+}
+
+int evt_pass(struct state *st, int stage, void *arg, uint32_t size) {
+    if (stage < st->num_stages)
+        return st->stages[stage].event(st, stage, arg, size);
+    return evt_output(st, arg, size);
+}
+
+int evt_sink(struct state *st, void *arg, uint32_t size) {
+    return evt_pass(st, 0, arg, size);
+}
+
+// Feed a buffer of records, as built up by a grouper worker, to the sink
+int evt_sink_records(struct state *st, uint8_t *data, size_t len) {
+    while (len > 0) {
+        uint32_t size;
+        int ret;
+
+        if (!st->num_stages) {
+            ret = write(st->out_fd, data, len);
+            if (ret < 0) {
+                perror("Couldn't write events");
+                return -1;
+            }
+            data += ret;
+            len -= ret;
+            continue;
+        }
+
+        memcpy(&size, data + offsetof(struct evt_header, size), sizeof(size));
+        size = ntohl(size);
+        if (evt_sink(st, data, size) < 0)
+            return -1;
+        data += size;
+        len -= size;
+    }
+    return 0;
+}
+
+// Push out anything the stages are still holding at the end of the input
+int evt_sink_flush(struct state *st) {
+    int stage;
+
+    for (stage=0; stage<st->num_stages; stage++)
+        if (st->stages[stage].flush && st->stages[stage].flush(st, stage) < 0)
+            return -1;
+    return 0;
+}
+
+int evt_output(struct state *st, void *arg, uint32_t size) {
+    return write(st->out_fd, arg, size);
+}
+
+
+// Open items: take the one of a type out of st->events, or put one back
+void *evt_take(struct state *st, int type) {
+    int i;
+    for (i=0; i<(sizeof(st->events)/sizeof(st->events[0])); i++) {
+        if (st->events[i] && st->events[i]->type == type) {
+            void *val = st->events[i];
+            st->events[i] = NULL;
+            return val;
+        }
+    }
+    return NULL;
+}
+
+int evt_put(struct state *st, void *v) {
+    struct evt_header *val = v;
+    int i;
+    for (i=0; i<(sizeof(st->events)/sizeof(st->events[0])); i++) {
+        if (!st->events[i]) {
+            st->events[i] = val;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
 int evt_fill_header(void *arg, uint32_t sec_start, uint32_t nsec_start,
                     uint32_t size, uint8_t type) {
     struct evt_header *hdr = arg;
@@ -92,7 +441,7 @@ int evt_write_hello(struct state *st, struct pkt *pkt) {
     evt.magic1 = htonl(EVENT_MAGIC_1);
     evt.magic2 = htonl(EVENT_MAGIC_2);
     evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
-    write(st->out_fd, &evt, sizeof(evt));
+    evt_emit(st, &evt);
     return 0;
 }
 
@@ -103,7 +452,7 @@ int evt_write_reset(struct state *st, struct pkt *pkt) {
                     sizeof(evt), EVT_RESET);
     evt.version = pkt->data.reset.version;
     evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
-    write(st->out_fd, &evt, sizeof(evt));
+    evt_emit(st, &evt);
     return 0;
 }
 
@@ -115,6 +464,6 @@ int evt_write_nand_unk(struct state *st, struct pkt *pkt) {
     evt.ctrl = pkt->data.nand_cycle.control;
     evt.unknown = pkt->data.nand_cycle.unknown;
     evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
-    write(st->out_fd, &evt, sizeof(evt));
+    evt_emit(st, &evt);
     return 0;
 }
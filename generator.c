@@ -0,0 +1,720 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include "packet-struct.h"
+#include "state.h"
+
+/* Writes a synthetic capture, as it would come off the tap board, along
+ * with a "truth" file saying what's in it.
+ *
+ * The capture is a series of runs.  Each run starts with an "ib" command
+ * (or, every so often, a sync point), carries on with the SD and network
+ * traffic that went by live, and ends with the NAND buffer being drained:
+ * the run's NAND cycles, between a pair of buffer drain packets.  The
+ * board restarts its clock for every run, and starts each run's NAND
+ * block by replaying the end of the previous one, which is what the
+ * joiner matches up.  A FIFO overflow loses the end of a run's NAND block,
+ * and the next run has nothing to replay.
+ *
+ * The truth file has a line for each run, sync point, overflow and NAND
+ * block, and one for every operation, at its true time:
+ *
+ *   run N offset O shift NS
+ *   sync offset O hello|ib
+ *   op SEC.NSEC nand_read row R col C count N
+ *   ...
+ *   overflow offset O lost K
+ *   nand_block run N offset O replayed K cycles C
+ *   end packets N bytes B nand N replayed N lost N ops N
+ *
+ * Adding a run's shift to its packets' times gives their true times.  The
+ * first K NAND cycles of a block are replays of cycles already seen; the
+ * C after them are new.  An overflow loses the last K cycles of the run.
+ */
+
+#define OUT_BUFFER (4 * 1024 * 1024)
+
+// NAND control pins, as in nand.c
+#define CTRL_CLE 1
+#define CTRL_ALE 2
+#define CTRL_WE 4
+#define CTRL_RE 8
+#define CTRL_CS 16
+
+// The joiner looks back at most 80 NAND cycles
+#define MAX_OVERLAP 80
+
+struct buf {
+    uint8_t *data;
+    size_t len, cap;
+};
+
+struct nand_cycle {
+    uint64_t time;
+    uint8_t data;
+    uint8_t control;
+};
+
+struct gen {
+    uint64_t rng;
+    uint64_t time;              // True time, in ns
+    uint64_t shift;             // What the current run's clock is behind by
+    uint64_t offset;            // Bytes of capture written so far
+
+    // The run being put together: live traffic, and the NAND buffer
+    struct buf live, nand;
+    int nand_cycles;
+
+    // The last NAND cycles written, for replaying
+    struct nand_cycle ring[MAX_OVERLAP];
+    int ring_len, ring_pos;
+
+    int out_fd;
+    FILE *truth;
+
+    uint64_t packets, nand_total, replayed, lost, ops;
+};
+
+// Settings
+static uint64_t target_size = 16 * 1024 * 1024;
+static int weights[3] = { 80, 15, 5 };  // NAND, SD, network
+static int run_ops = 1000;
+static int overlap = 40;
+static int overflow_percent = 0;
+static int sync_every = 10;
+static int page_bytes = 2048;
+static int cycle_ns = 50;
+static int idle_ns = 10000;
+
+static uint8_t scramble[256];
+
+static uint64_t rnd(struct gen *g) {
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return g->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t rnd_below(struct gen *g, uint32_t n) {
+    return (rnd(g) >> 32) % n;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            perror("Couldn't write capture");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint8_t *buf_grow(struct buf *b, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : OUT_BUFFER;
+        uint8_t *data;
+
+        while (cap < b->len + len)
+            cap *= 2;
+        data = realloc(b->data, cap);
+        if (!data) {
+            perror("Couldn't grow run buffer");
+            exit(1);
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    b->len += len;
+    return b->data + b->len - len;
+}
+
+static void put_packet(struct gen *g, struct buf *b, uint8_t type,
+                       uint64_t time, const void *payload, int len) {
+    struct pkt_header hdr;
+    uint8_t *p = buf_grow(b, sizeof(hdr) + len);
+
+    time -= g->shift;
+    hdr.type = type;
+    hdr.sec = htonl(time / 1000000000);
+    hdr.nsec = htonl(time % 1000000000);
+    hdr.size = htons(sizeof(hdr) + len);
+    memcpy(p, &hdr, sizeof(hdr));
+    memcpy(p + sizeof(hdr), payload, len);
+    g->packets++;
+}
+
+static void tick(struct gen *g) {
+    g->time += cycle_ns;
+}
+
+static void idle(struct gen *g) {
+    g->time += rnd_below(g, idle_ns + 1);
+}
+
+static void put_truth_time(struct gen *g) {
+    fprintf(g->truth, "op %llu.%09llu ",
+            (unsigned long long)(g->time / 1000000000),
+            (unsigned long long)(g->time % 1000000000));
+    g->ops++;
+}
+
+
+/* NAND operations.  Cycles go into the run's NAND buffer. */
+
+static void nand(struct gen *g, uint8_t data, uint8_t control) {
+    struct pkt_nand_cycle cycle;
+
+    tick(g);
+    cycle.data = scramble[data];
+    cycle.control = control | CTRL_CS;
+    cycle.unknown = 0;
+    put_packet(g, &g->nand, PACKET_NAND_CYCLE, g->time, &cycle, sizeof(cycle));
+    g->nand_cycles++;
+    g->nand_total++;
+}
+
+static void nand_cmd(struct gen *g, uint8_t cmd) {
+    nand(g, cmd, CTRL_CLE | CTRL_WE);
+}
+
+static void nand_addr(struct gen *g, uint8_t addr) {
+    nand(g, addr, CTRL_ALE | CTRL_WE);
+}
+
+static void nand_out(struct gen *g, uint8_t data) {
+    nand(g, data, CTRL_RE);
+}
+
+static void op_nand_page(struct gen *g, int change_column) {
+    uint32_t row = rnd_below(g, 1 << 20);
+    uint16_t col = change_column ? rnd_below(g, page_bytes) : 0;
+    int count = change_column ? 1 + rnd_below(g, 64) : page_bytes;
+    int i;
+
+    put_truth_time(g);
+    fprintf(g->truth, "%s row 0x%06x col 0x%04x count %d\n",
+            change_column ? "nand_change_column" : "nand_read",
+            row, col, count);
+    nand_cmd(g, change_column ? 0x05 : 0x00);
+    nand_addr(g, col & 0xff);
+    nand_addr(g, col >> 8);
+    nand_addr(g, row & 0xff);
+    nand_addr(g, (row >> 8) & 0xff);
+    nand_addr(g, row >> 16);
+    nand_cmd(g, change_column ? 0xe0 : 0x30);
+    for (i=0; i<count; i++)
+        nand_out(g, rnd(g) >> 56);
+}
+
+static void op_nand_status(struct gen *g) {
+    int polls = 1 + rnd_below(g, 20);
+    int i;
+
+    put_truth_time(g);
+    fprintf(g->truth, "nand_status polls %d\n", polls);
+    for (i=0; i<polls; i++) {
+        nand_cmd(g, 0x70);
+        nand_out(g, i == polls - 1 ? 0x60 : 0x40);
+    }
+}
+
+static void op_nand_id(struct gen *g) {
+    static const uint8_t id[] = { 0x98, 0xd7, 0x84, 0x93, 0x72, 0x57, 0x08, 0x04 };
+    int i;
+
+    put_truth_time(g);
+    fprintf(g->truth, "nand_id\n");
+    nand_cmd(g, 0x90);
+    nand_addr(g, 0x00);
+    for (i=0; i<sizeof(id); i++)
+        nand_out(g, id[i]);
+}
+
+static void op_nand_param(struct gen *g) {
+    int i;
+
+    put_truth_time(g);
+    fprintf(g->truth, "nand_parameter_page count 256\n");
+    nand_cmd(g, 0xec);
+    nand_addr(g, 0x00);
+    for (i=0; i<256; i++)
+        nand_out(g, i);
+}
+
+// SanDisk vendor sequence: start, a parameter, then a "charge"
+static void op_nand_sandisk(struct gen *g) {
+    uint8_t param = rnd(g) >> 56;
+
+    put_truth_time(g);
+    fprintf(g->truth, "nand_sandisk param 0x%02x\n", param);
+    nand_cmd(g, 0x5c);
+    nand_cmd(g, 0xc5);
+    nand_cmd(g, 0x55);
+    nand_addr(g, 0x12);
+    nand(g, param, CTRL_WE);
+    nand_cmd(g, 0x65);
+    nand_addr(g, 0x01);
+    nand_addr(g, 0x02);
+    nand_addr(g, 0x03);
+}
+
+static void op_nand_reset(struct gen *g) {
+    put_truth_time(g);
+    fprintf(g->truth, "nand_reset\n");
+    nand_cmd(g, 0xff);
+    nand_cmd(g, 0x00);
+}
+
+static void op_nand_cache(struct gen *g) {
+    put_truth_time(g);
+    fprintf(g->truth, "nand_cache\n");
+    nand_cmd(g, 0xa2);
+    nand_cmd(g, 0x69);
+}
+
+static void op_nand(struct gen *g) {
+    uint32_t r = rnd_below(g, 100);
+
+    if (r < 35)
+        op_nand_page(g, 0);
+    else if (r < 65)
+        op_nand_status(g);
+    else if (r < 75)
+        op_nand_page(g, 1);
+    else if (r < 80)
+        op_nand_id(g);
+    else if (r < 85)
+        op_nand_sandisk(g);
+    else if (r < 90)
+        op_nand_reset(g);
+    else if (r < 95)
+        op_nand_param(g);
+    else
+        op_nand_cache(g);
+}
+
+
+/* SD and network operations, which go out live */
+
+static void sd_packet(struct gen *g, uint8_t type, const void *payload, int len) {
+    tick(g);
+    put_packet(g, &g->live, type, g->time, payload, len);
+}
+
+static void sd_cmd(struct gen *g, uint8_t cmd, uint32_t arg) {
+    struct pkt_sd_cmd_arg a;
+    int i;
+
+    a.reg = 0;
+    a.val = 0x40 | cmd;
+    sd_packet(g, PACKET_SD_CMD_ARG, &a, sizeof(a));
+    for (i=0; i<4; i++) {
+        a.reg = i + 1;
+        a.val = arg >> (24 - 8 * i);
+        sd_packet(g, PACKET_SD_CMD_ARG, &a, sizeof(a));
+    }
+    a.reg = 5;
+    a.val = 0x01;
+    sd_packet(g, PACKET_SD_CMD_ARG, &a, sizeof(a));
+}
+
+static void sd_response(struct gen *g, uint8_t byte) {
+    struct pkt_sd_response r;
+
+    r.byte = byte;
+    sd_packet(g, PACKET_SD_RESPONSE, &r, sizeof(r));
+}
+
+static void sd_block(struct gen *g) {
+    struct pkt_sd_data d;
+    int i;
+
+    for (i=0; i<sizeof(d.data); i+=8) {
+        uint64_t v = rnd(g);
+        memcpy(d.data + i, &v, sizeof(v));
+    }
+    sd_packet(g, PACKET_SD_DATA, &d, sizeof(d));
+}
+
+static void op_sd(struct gen *g) {
+    uint32_t r = rnd_below(g, 100);
+    uint32_t sector = rnd_below(g, 1 << 22);
+    int blocks, i;
+
+    put_truth_time(g);
+    if (r < 30) {
+        fprintf(g->truth, "sd CMD13\n");
+        sd_cmd(g, 13, 0x10000);
+        sd_response(g, 0x09);
+    }
+    else if (r < 35) {
+        fprintf(g->truth, "sd CMD16 arg 512\n");
+        sd_cmd(g, 16, 512);
+        sd_response(g, 0x09);
+    }
+    else if (r < 40) {
+        fprintf(g->truth, "sd ACMD41\n");
+        sd_cmd(g, 55, 0);
+        sd_response(g, 0x01);
+        sd_cmd(g, 41, 0x40ff8000);
+        sd_response(g, 0x3f);
+    }
+    else if (r < 80) {
+        fprintf(g->truth, "sd CMD17 sector %u\n", sector);
+        sd_cmd(g, 17, sector);
+        sd_response(g, 0x09);
+        sd_block(g);
+    }
+    else {
+        uint8_t cmd = r < 90 ? 18 : 25;
+
+        blocks = 1 + rnd_below(g, 256);
+        fprintf(g->truth, "sd CMD%d sector %u blocks %d\n", cmd, sector, blocks);
+        sd_cmd(g, cmd, sector);
+        sd_response(g, 0x09);
+        for (i=0; i<blocks; i++)
+            sd_block(g);
+        sd_cmd(g, 12, 0);
+        sd_response(g, 0x09);
+    }
+}
+
+static void net_cmd(struct gen *g, struct buf *b, const char *name,
+                    uint32_t arg, uint8_t start_stop) {
+    struct pkt_command c;
+
+    tick(g);
+    c.cmd[0] = name[0];
+    c.cmd[1] = name[1];
+    c.arg = arg;            // Host order, as the joiner reads it
+    c.start_stop = start_stop;
+    put_packet(g, b, PACKET_COMMAND, g->time, &c, sizeof(c));
+}
+
+static void op_net(struct gen *g) {
+    static const char *names[] = { "rc", "sd", "nd", "st" };
+    const char *name = names[rnd_below(g, 4)];
+    uint32_t arg = rnd_below(g, 256);
+
+    put_truth_time(g);
+    fprintf(g->truth, "net %s arg %u\n", name, arg);
+    net_cmd(g, &g->live, name, arg, CMD_START);
+    g->time += rnd_below(g, 100000);
+    net_cmd(g, &g->live, name, arg, CMD_STOP);
+}
+
+
+/* Runs */
+
+static void buffer_drain(struct gen *g, uint8_t start_stop) {
+    struct pkt_buffer_drain d;
+
+    tick(g);
+    d.start_stop = start_stop;
+    put_packet(g, &g->live, PACKET_BUFFER_DRAIN, g->time, &d, sizeof(d));
+}
+
+// Remember the NAND cycles in the block, for the next run to replay
+static void remember_nand(struct gen *g, const uint8_t *p, size_t len) {
+    size_t pos;
+
+    for (pos=0; pos<len; pos+=ntohs(((struct pkt_header *)(p + pos))->size)) {
+        const struct pkt *pkt = (const struct pkt *)(p + pos);
+        struct nand_cycle *c = &g->ring[g->ring_pos];
+
+        c->time = (uint64_t)ntohl(pkt->header.sec) * 1000000000
+                + ntohl(pkt->header.nsec) + g->shift;
+        c->data = pkt->data.nand_cycle.data;
+        c->control = pkt->data.nand_cycle.control;
+        g->ring_pos = (g->ring_pos + 1) % MAX_OVERLAP;
+        if (g->ring_len < MAX_OVERLAP)
+            g->ring_len++;
+    }
+}
+
+static int write_run(struct gen *g, int run) {
+    struct buf block;
+    uint64_t nand_offset;
+    int replay, lost = 0;
+    int i;
+
+    /* The run's NAND block: the previous run's tail, then this run's
+     * cycles, which may have overflowed
+     */
+    memset(&block, 0, sizeof(block));
+    replay = overlap < g->ring_len ? overlap : g->ring_len;
+    for (i=0; i<replay; i++) {
+        struct nand_cycle *c = &g->ring[(g->ring_pos - replay + i + MAX_OVERLAP)
+                                        % MAX_OVERLAP];
+        struct pkt_nand_cycle cycle;
+
+        cycle.data = c->data;
+        cycle.control = c->control;
+        cycle.unknown = 0;
+        put_packet(g, &block, PACKET_NAND_CYCLE, c->time, &cycle, sizeof(cycle));
+    }
+    g->replayed += replay;
+
+    if (g->nand_cycles && overflow_percent
+     && rnd_below(g, 100) < overflow_percent) {
+        struct pkt_error e;
+
+        lost = 1 + rnd_below(g, (g->nand_cycles + 3) / 4);
+        g->nand.len -= lost * (sizeof(struct pkt_header) + sizeof(struct pkt_nand_cycle));
+        g->nand_cycles -= lost;
+        g->packets -= lost;
+        g->lost += lost;
+
+        memset(&e, 0, sizeof(e));
+        e.subsystem = SUBSYS_FPGA;
+        e.code = FPGA_ERR_OVERFLOW;
+        memcpy(e.message, "FIFO overflow", 14);
+        tick(g);
+        put_packet(g, &g->live, PACKET_ERROR, g->time, &e,
+                   offsetof(struct pkt_error, message) + 14);
+        fprintf(g->truth, "overflow offset %llu lost %d\n",
+                (unsigned long long)(g->offset + g->live.len - sizeof(struct pkt_header)
+                                     - offsetof(struct pkt_error, message) - 14),
+                lost);
+    }
+    memcpy(buf_grow(&block, g->nand.len), g->nand.data, g->nand.len);
+
+    buffer_drain(g, PKT_BUFFER_DRAIN_START);
+    nand_offset = g->offset + g->live.len;
+    fprintf(g->truth, "nand_block run %d offset %llu replayed %d cycles %d\n",
+            run, (unsigned long long)nand_offset, replay, g->nand_cycles);
+
+    if (write_all(g->out_fd, g->live.data, g->live.len)
+     || write_all(g->out_fd, block.data, block.len))
+        return -1;
+    g->offset += g->live.len + block.len;
+    g->live.len = 0;
+
+    buffer_drain(g, PKT_BUFFER_DRAIN_STOP);
+
+    // After an overflow there's nothing to replay
+    g->ring_len = 0;
+    g->ring_pos = 0;
+    if (!lost)
+        remember_nand(g, g->nand.data, g->nand.len);
+    g->nand.len = 0;
+    g->nand_cycles = 0;
+    free(block.data);
+    return 0;
+}
+
+// Start a run: restart the clock, and resync or mark a sync point
+static void start_run(struct gen *g, int run) {
+    int sync = sync_every && run % sync_every == 0;
+
+    // The replayed cycles mustn't end up before the clock's new zero
+    if (run) {
+        uint64_t base = g->time;
+        int replay = overlap < g->ring_len ? overlap : g->ring_len;
+
+        if (replay)
+            base = g->ring[(g->ring_pos - replay + MAX_OVERLAP) % MAX_OVERLAP].time;
+        g->shift = base - rnd_below(g, 1000000);
+        g->time += rnd_below(g, idle_ns + 1);
+    }
+    fprintf(g->truth, "run %d offset %llu shift %llu\n", run,
+            (unsigned long long)(g->offset + g->live.len),
+            (unsigned long long)g->shift);
+    if (sync) {
+        fprintf(g->truth, "sync offset %llu ib\n",
+                (unsigned long long)(g->offset + g->live.len));
+        net_cmd(g, &g->live, "ib", 0, CMD_START);
+        net_cmd(g, &g->live, "ib", 0, CMD_STOP);
+    }
+    else {
+        net_cmd(g, &g->live, "ib", 1 + run, CMD_START);
+        net_cmd(g, &g->live, "ib", 1 + run, CMD_STOP);
+    }
+}
+
+static int generate(struct gen *g) {
+    int total = weights[0] + weights[1] + weights[2];
+    struct pkt_hello hello;
+    struct pkt_reset reset;
+    int run;
+
+    hello.version = 1;
+    fprintf(g->truth, "sync offset 0 hello\n");
+    put_packet(g, &g->live, PACKET_HELLO, g->time, &hello, sizeof(hello));
+    tick(g);
+    reset.version = 2;
+    put_packet(g, &g->live, PACKET_RESET, g->time, &reset, sizeof(reset));
+
+    for (run=0; g->offset < target_size; run++) {
+        int op;
+
+        start_run(g, run);
+        for (op=0; op<run_ops; op++) {
+            uint32_t r = rnd_below(g, total);
+
+            idle(g);
+            if (r < weights[0])
+                op_nand(g);
+            else if (r < weights[0] + weights[1])
+                op_sd(g);
+            else
+                op_net(g);
+
+            if (g->offset + g->live.len + g->nand.len >= target_size)
+                break;
+        }
+        if (write_run(g, run))
+            return -1;
+    }
+    if (write_all(g->out_fd, g->live.data, g->live.len))
+        return -1;
+    g->offset += g->live.len;
+
+    fprintf(g->truth, "end packets %llu bytes %llu nand %llu replayed %llu "
+            "lost %llu ops %llu\n",
+            (unsigned long long)g->packets, (unsigned long long)g->offset,
+            (unsigned long long)g->nand_total, (unsigned long long)g->replayed,
+            (unsigned long long)g->lost, (unsigned long long)g->ops);
+    return 0;
+}
+
+
+// A size, with an optional k, M, G or T
+static int parse_size(const char *str, uint64_t *size) {
+    char *end;
+
+    errno = 0;
+    *size = strtoull(str, &end, 0);
+    if (errno || end == str)
+        return -1;
+    switch (*end) {
+    case 'T': *size <<= 10;     /* fall through */
+    case 'G': *size <<= 10;     /* fall through */
+    case 'M': *size <<= 10;     /* fall through */
+    case 'k': *size <<= 10;
+        end++;
+        break;
+    }
+    return *end ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    struct gen g;
+    char *truth_path = NULL;
+    char path[4096];
+    uint64_t seed = 1;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "s:n:w:r:o:O:y:p:c:i:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            if (parse_size(optarg, &target_size)) {
+                fprintf(stderr, "Bad size %s\n", optarg);
+                argc = 0;
+            }
+            break;
+        case 'w':
+            if (sscanf(optarg, "%d,%d,%d", &weights[0], &weights[1], &weights[2]) != 3
+             || weights[0] < 0 || weights[1] < 0 || weights[2] < 0
+             || weights[0] + weights[1] + weights[2] <= 0) {
+                fprintf(stderr, "Weights are nand,sd,net\n");
+                argc = 0;
+            }
+            break;
+        case 'r':
+            run_ops = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            overlap = strtoul(optarg, NULL, 0);
+            if (overlap > MAX_OVERLAP) {
+                fprintf(stderr, "Overlap can be at most %d\n", MAX_OVERLAP);
+                argc = 0;
+            }
+            break;
+        case 'O':
+            overflow_percent = strtoul(optarg, NULL, 0);
+            break;
+        case 'y':
+            sync_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            page_bytes = strtoul(optarg, NULL, 0);
+            if (page_bytes < 1 || page_bytes > 16384) {
+                fprintf(stderr, "Page size must be 1 to 16384\n");
+                argc = 0;
+            }
+            break;
+        case 'c':
+            cycle_ns = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            idle_ns = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            truth_path = optarg;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+
+    if (argc - optind != 1 || run_ops < 1) {
+        fprintf(stderr, "Usage: %s [-s seed] [-n size] [-w nand,sd,net] [-r ops_per_run]\n"
+                        "       [-o overlap] [-O overflow_percent] [-y sync_every]\n"
+                        "       [-p page_bytes] [-c cycle_ns] [-i idle_ns]\n"
+                        "       [-t truth_filename] [out_filename]\n",
+                argv[0]);
+        return 1;
+    }
+
+    memset(&g, 0, sizeof(g));
+    g.rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+    g.time = 1000000000ULL;
+    for (i=0; i<256; i++)
+        scramble[nand_unscramble_byte(i)] = i;
+
+    g.out_fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (g.out_fd == -1) {
+        perror("Unable to open output file");
+        return 2;
+    }
+    if (!truth_path) {
+        snprintf(path, sizeof(path), "%s.truth", argv[optind]);
+        truth_path = path;
+    }
+    g.truth = fopen(truth_path, "w");
+    if (!g.truth) {
+        perror("Unable to open truth file");
+        return 2;
+    }
+    fprintf(g.truth, "# seed %llu weights %d,%d,%d ops_per_run %d overlap %d "
+            "overflow %d%% sync_every %d page %d cycle %d idle %d\n",
+            (unsigned long long)seed, weights[0], weights[1], weights[2],
+            run_ops, overlap, overflow_percent, sync_every, page_bytes,
+            cycle_ns, idle_ns);
+
+    if (generate(&g))
+        return 3;
+    if (fclose(g.truth)) {
+        perror("Couldn't write truth file");
+        return 3;
+    }
+    close(g.out_fd);
+    return 0;
+}
@@ -0,0 +1,1741 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "packet-struct.h"
+#include "event-struct.h"
+#include "state.h"
+#include "tapfilter.h"
+
+#define SKIP_AMOUNT 80
+#define SEARCH_LIMIT 20
+
+static char *types[] = {
+        "PACKET_UNKNOWN",
+        "PACKET_ERROR",
+        "PACKET_NAND_CYCLE",
+        "PACKET_SD_DATA",
+        "PACKET_SD_CMD_ARG",
+        "PACKET_SD_RESPONSE",
+        "PACKET_SD_CID",
+        "PACKET_SD_CSD",
+        "PACKET_BUFFER_OFFSET",
+        "PACKET_BUFFER_CONTENTS",
+        "PACKET_COMMAND",
+        "PACKET_RESET",
+        "PACKET_BUFFER_DRAIN",
+        "PACKET_HELLO",
+};
+
+enum prog_state {
+    ST_UNINITIALIZED,
+    ST_SCANNING,
+    ST_GROUPING,
+    ST_DONE,
+};
+
+
+static int st_uninitialized(struct state *st);
+static int st_scanning(struct state *st);
+static int st_grouping(struct state *st);
+static int st_done(struct state *st);
+
+static int (*st_funcs[])(struct state *st) = {
+    [ST_UNINITIALIZED]  = st_uninitialized,
+    [ST_SCANNING]       = st_scanning,
+    [ST_GROUPING]       = st_grouping,
+    [ST_DONE]           = st_done,
+};
+
+
+
+// True if the packet is a NAND address cycle
+static int is_addr_cycle(struct pkt *pkt) {
+    return pkt
+        && nand_ale(pkt->data.nand_cycle.control)
+        && !nand_cle(pkt->data.nand_cycle.control)
+        && nand_we(pkt->data.nand_cycle.control);
+}
+
+// True if the packet is the given NAND command cycle
+static int is_cmd_cycle(struct pkt *pkt, uint8_t cmd) {
+    return pkt
+        && !nand_ale(pkt->data.nand_cycle.control)
+        && nand_cle(pkt->data.nand_cycle.control)
+        && nand_we(pkt->data.nand_cycle.control)
+        && pkt->data.nand_cycle.data == cmd;
+}
+
+// True if the packet is a NAND data-out cycle
+static int is_read_cycle(struct pkt *pkt) {
+    return pkt && nand_re(pkt->data.nand_cycle.control);
+}
+
+
+static int evt_write_id(struct state *st, struct pkt *pkt) {
+    struct evt_nand_id evt;
+    struct pkt *next;
+
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_ID);
+    evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
+
+    // Grab the "address" byte.
+    next = packet_peek(st, 0);
+    if (!next) {
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+    if (!nand_ale(next->data.nand_cycle.control)
+     || !nand_we(next->data.nand_cycle.control))
+        fprintf(stderr, "Warning: ALE/WE not set for 'Read ID'\n");
+    evt.addr = next->data.nand_cycle.data;
+    evt_fill_end(&evt, next->header.sec, next->header.nsec);
+    packet_consume(st, 1);
+
+    // Read the actual ID
+    for (evt.size=0;
+         evt.size<sizeof(evt.id) && is_read_cycle(next = packet_peek(st, 0));
+         evt.size++) {
+        evt.id[evt.size] = next->data.nand_cycle.data;
+        evt_fill_end(&evt, next->header.sec, next->header.nsec);
+        packet_consume(st, 1);
+    }
+
+    evt_emit(st, &evt);
+    return 0;
+}
+
+static int evt_write_sandisk_set(struct state *st, struct pkt *pkt) {
+    struct evt_nand_unk_sandisk_code evt;
+    struct pkt *second_pkt;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_SANDISK_VENDOR_START);
+
+    // Make sure the subsequent packet is 0xc5
+    second_pkt = packet_peek(st, 0);
+    if (!second_pkt
+     || !nand_cle(second_pkt->data.nand_cycle.control)
+     || second_pkt->data.nand_cycle.data != 0xc5) {
+        fprintf(stderr, "Not a Sandisk packet!\n");
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+
+    evt_fill_end(&evt, second_pkt->header.sec, second_pkt->header.nsec);
+    packet_consume(st, 1);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+static int evt_write_sandisk_param(struct state *st, struct pkt *pkt) {
+    struct evt_nand_unk_sandisk_param evt;
+    struct pkt *second_pkt, *third_pkt;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_SANDISK_VENDOR_PARAM);
+
+    // Make sure the subsequent packet is an address, followed by data
+    second_pkt = packet_peek(st, 0);
+    third_pkt = packet_peek(st, 1);
+    if (!second_pkt || !third_pkt
+     || (!nand_ale(second_pkt->data.nand_cycle.control)
+      && !nand_we(second_pkt->data.nand_cycle.control))
+     || nand_ale(third_pkt->data.nand_cycle.control)
+     || nand_cle(third_pkt->data.nand_cycle.control)
+     || nand_re(third_pkt->data.nand_cycle.control)) {
+        fprintf(stderr, "Not a Sandisk param packet!\n");
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+
+    evt.addr = second_pkt->data.nand_cycle.data;
+    evt.data = third_pkt->data.nand_cycle.data;
+
+    evt_fill_end(&evt, third_pkt->header.sec, third_pkt->header.nsec);
+    packet_consume(st, 2);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+// Both "charge" commands are followed by three address cycles
+static int sandisk_charge_addrs(struct state *st, uint8_t addr[3],
+                                struct pkt **last) {
+    int counter;
+
+    for (counter=0; counter<3; counter++) {
+        struct pkt *next = packet_peek(st, counter);
+        if (!is_addr_cycle(next))
+            return 1;
+        addr[counter] = next->data.nand_cycle.data;
+        *last = next;
+    }
+    return 0;
+}
+
+static int evt_write_sandisk_charge1(struct state *st, struct pkt *pkt) {
+    struct evt_nand_sandisk_charge1 evt;
+    struct pkt *last;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_SANDISK_CHARGE1);
+
+    if (sandisk_charge_addrs(st, evt.addr, &last)) {
+        fprintf(stderr, "Not a Sandisk charge(?) packet!\n");
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+
+    evt_fill_end(&evt, last->header.sec, last->header.nsec);
+    packet_consume(st, 3);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+static int evt_write_sandisk_charge2(struct state *st, struct pkt *pkt) {
+    struct evt_nand_sandisk_charge2 evt;
+    struct pkt *last;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_SANDISK_CHARGE1);
+
+    if (sandisk_charge_addrs(st, evt.addr, &last)) {
+        fprintf(stderr, "Not a Sandisk charge2(?) packet!\n");
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+
+    evt_fill_end(&evt, last->header.sec, last->header.nsec);
+    packet_consume(st, 3);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+static int evt_write_nand_reset(struct state *st, struct pkt *pkt) {
+    struct evt_nand_reset evt;
+    struct pkt *second_pkt;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_RESET);
+
+    // Make sure the subsequent packet is 0x00
+    second_pkt = packet_peek(st, 0);
+    if (!second_pkt
+     || !nand_cle(second_pkt->data.nand_cycle.control)
+     || second_pkt->data.nand_cycle.data != 0x00) {
+        fprintf(stderr, "Not a reset packet!\n");
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+
+    evt_fill_end(&evt, second_pkt->header.sec, second_pkt->header.nsec);
+    packet_consume(st, 1);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+
+static int evt_write_nand_cache1(struct state *st, struct pkt *pkt) {
+    struct evt_nand_cache1 evt;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_CACHE1);
+    evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+static int evt_write_nand_cache2(struct state *st, struct pkt *pkt) {
+    struct evt_nand_cache2 evt;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_CACHE2);
+    evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+static int evt_write_nand_cache3(struct state *st, struct pkt *pkt) {
+    struct evt_nand_cache3 evt;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_CACHE3);
+    evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+static int evt_write_nand_cache4(struct state *st, struct pkt *pkt) {
+    struct evt_nand_cache4 evt;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_CACHE4);
+    evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+static int evt_write_nand_status(struct state *st, struct pkt *pkt) {
+    struct evt_nand_status evt;
+    struct pkt *second_pkt;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_STATUS);
+
+    // Make sure the subsequent packet is a read of status
+    second_pkt = packet_peek(st, 0);
+    if (!second_pkt
+     || nand_ale(second_pkt->data.nand_cycle.control)
+     || nand_cle(second_pkt->data.nand_cycle.control)
+     || nand_we(second_pkt->data.nand_cycle.control)) {
+        fprintf(stderr, "Not a NAND status packet!\n");
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+
+    evt.status = second_pkt->data.nand_cycle.data;
+
+    evt_fill_end(&evt, second_pkt->header.sec, second_pkt->header.nsec);
+    packet_consume(st, 1);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+static int evt_write_nand_parameter_page(struct state *st, struct pkt *pkt) {
+    struct evt_nand_parameter_read evt;
+    struct pkt *next;
+
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), EVT_NAND_PARAMETER_READ);
+
+    // Make sure the subsequent packet is an address
+    next = packet_peek(st, 0);
+    if (!is_addr_cycle(next)) {
+        fprintf(stderr, "Not a NAND parameter read!\n");
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+
+    evt.addr = next->data.nand_cycle.data;
+    evt.count = 0;
+    evt_fill_end(&evt, next->header.sec, next->header.nsec);
+    packet_consume(st, 1);
+
+    while (evt.count < sizeof(evt.data)
+        && is_read_cycle(next = packet_peek(st, 0))) {
+        evt.data[evt.count++] = next->data.nand_cycle.data;
+        evt_fill_end(&evt, next->header.sec, next->header.nsec);
+        packet_consume(st, 1);
+    }
+
+    evt.count = htons(evt.count);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+/* Page reads and column changes share a layout: the command, five address
+ * cycles, a confirm command, and then however many bytes are read out.
+ * The whole seven-cycle preamble is matched in the window before anything
+ * is consumed.
+ */
+static int evt_write_nand_page(struct state *st, struct pkt *pkt,
+                               uint8_t type, uint8_t confirm) {
+    struct evt_nand_read evt;
+    struct pkt *next;
+    int counter;
+    evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(evt), type);
+
+    for (counter=0; counter<sizeof(evt.addr); counter++) {
+        next = packet_peek(st, counter);
+        if (!is_addr_cycle(next)) {
+            fprintf(stderr, "Not a %s packet (counter %d)\n",
+                    type == EVT_NAND_READ ? "nand_read" : "page_select",
+                    counter);
+            evt_write_nand_unk(st, pkt);
+            return 0;
+        }
+        evt.addr[counter] = next->data.nand_cycle.data;
+    }
+
+    next = packet_peek(st, counter);
+    if (!is_cmd_cycle(next, confirm)) {
+        fprintf(stderr, "Not a %s packet (last packet wrong)\n",
+                type == EVT_NAND_READ ? "nand_read" : "page_select");
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+
+    evt.count = 0;
+    evt_fill_end(&evt, next->header.sec, next->header.nsec);
+    memcpy(evt.unknown, &pkt->data.nand_cycle.unknown, sizeof(evt.unknown));
+    packet_consume(st, counter + 1);
+
+    while (evt.count < sizeof(evt.data)
+        && is_read_cycle(next = packet_peek(st, 0))) {
+        evt.data[evt.count++] = next->data.nand_cycle.data;
+
+        evt_fill_end(&evt, next->header.sec, next->header.nsec);
+        memcpy(evt.unknown, &next->data.nand_cycle.unknown, sizeof(evt.unknown));
+        packet_consume(st, 1);
+    }
+
+    evt.count = htonl(evt.count);
+    evt_emit(st, &evt);
+    return 0;
+}
+
+
+static int evt_write_nand_change_read_column(struct state *st, struct pkt *pkt) {
+    return evt_write_nand_page(st, pkt, EVT_NAND_CHANGE_READ_COLUMN, 0xe0);
+}
+
+
+static int evt_write_nand_read(struct state *st, struct pkt *pkt) {
+    return evt_write_nand_page(st, pkt, EVT_NAND_READ, 0x30);
+}
+
+
+
+static int write_nand_cmd(struct state *st, struct pkt *pkt) {
+    struct pkt_nand_cycle *nand = &pkt->data.nand_cycle;
+
+    // If it's not a command, we're lost
+    if (!nand_cle(nand->control)) {
+        fprintf(stderr, "We're lost in NAND-land.  ");
+        nand_print(st, nand->data, nand->control);
+        evt_write_nand_unk(st, pkt);
+        return 0;
+    }
+
+    // "Get ID" command
+    if (nand->data == 0x90) {
+        return evt_write_id(st, pkt);
+    }
+    else if (nand->data == 0x5c) {
+        evt_write_sandisk_set(st, pkt);
+    }
+    else if (nand->data == 0xff) {
+        evt_write_nand_reset(st, pkt);
+    }
+    else if (nand->data == 0x55) {
+        evt_write_sandisk_param(st, pkt);
+    }
+    else if (nand->data == 0x70) {
+        evt_write_nand_status(st, pkt);
+    }
+    else if (nand->data == 0xec) {
+        evt_write_nand_parameter_page(st, pkt);
+    }
+    else if (nand->data == 0x60) {
+        evt_write_sandisk_charge2(st, pkt);
+    }
+    else if (nand->data == 0x65) {
+        evt_write_sandisk_charge1(st, pkt);
+    }
+    else if (nand->data == 0x05) {
+        evt_write_nand_change_read_column(st, pkt);
+    }
+    else if (nand->data == 0x00) {
+        evt_write_nand_read(st, pkt);
+    }
+    else if (nand->data == 0x30) {
+        evt_write_nand_cache1(st, pkt);
+    }
+    else if (nand->data == 0xa2) {
+        evt_write_nand_cache2(st, pkt);
+    }
+    else if (nand->data == 0x69) {
+        evt_write_nand_cache3(st, pkt);
+    }
+    else if (nand->data == 0xfd) {
+        evt_write_nand_cache4(st, pkt);
+    }
+    else {
+        fprintf(stderr, "Unknown NAND command.  ");
+        nand_print(st, nand->data, nand->control);
+    }
+    return 0;
+}
+
+
+// Initialize the "joiner" state machine
+static int gstate_init(struct state *st) {
+    st->is_logging = 0;
+    st->st = ST_SCANNING;
+    st->last_run_offset = 0;
+    st->join_buffer_capacity = 0;
+    st->buffer_offset = -1;
+    st->search_limit = 0;
+    return 0;
+}
+
+static int gstate_state(struct state *st) {
+    return st->st;
+}
+
+static int gstate_run(struct state *st) {
+    return st_funcs[st->st](st);
+}
+
+/* In-flight events are recycled through per-type free lists rather than
+ * going back to malloc.  When a list runs dry, a whole slab of objects is
+ * carved up at once.  A freed object stores the next-pointer in place of
+ * its header, so objects are spaced out to keep it aligned.  Slabs are
+ * chained together, through a pointer in front of the objects, so they
+ * can all be freed at the end.
+ */
+#define EVT_POOL_SLAB 64
+#define EVT_POOL_ALIGN _Alignof(void *)
+
+static void *evt_alloc(struct state *st, int type, int size) {
+    void *val;
+
+    size = (size + EVT_POOL_ALIGN - 1) & ~(EVT_POOL_ALIGN - 1);
+    if (!st->evt_pool[type]) {
+        char *slab;
+        int i;
+
+        slab = malloc(sizeof(void *) + size * EVT_POOL_SLAB);
+        if (!slab) {
+            perror("Couldn't allocate event pool");
+            exit(1);
+        }
+        *(void **)slab = st->evt_slabs;
+        st->evt_slabs = slab;
+        slab += sizeof(void *);
+        for (i=0; i<EVT_POOL_SLAB; i++) {
+            *(void **)(slab + i*size) = st->evt_pool[type];
+            st->evt_pool[type] = slab + i*size;
+        }
+    }
+
+    val = st->evt_pool[type];
+    st->evt_pool[type] = *(void **)val;
+    return val;
+}
+
+static void evt_free(struct state *st, void *v) {
+    struct evt_header *hdr = v;
+    int type = hdr->type;
+
+    *(void **)v = st->evt_pool[type];
+    st->evt_pool[type] = v;
+}
+
+// Free every slab, along with any events still open
+static void evt_pool_free(struct state *st) {
+    while (st->evt_slabs) {
+        void *next = *(void **)st->evt_slabs;
+        free(st->evt_slabs);
+        st->evt_slabs = next;
+    }
+    memset(st->evt_pool, 0, sizeof(st->evt_pool));
+    memset(st->events, 0, sizeof(st->events));
+}
+
+// Start a new SD command.  Pooled slots hold whatever the last command
+// left in them, so args[] and result[] are cleared too, as anything past
+// num_args and num_results would otherwise go out with the record.
+static struct evt_sd_cmd *evt_alloc_sd_cmd(struct state *st,
+                                           struct pkt *pkt) {
+    struct evt_sd_cmd *evt;
+
+    evt = evt_alloc(st, EVT_SD_CMD, sizeof(*evt));
+    evt_fill_header(evt, pkt->header.sec, pkt->header.nsec,
+                    sizeof(*evt), EVT_SD_CMD);
+    evt->cmd = 0;
+    evt->num_args = 0;
+    memset(evt->args, 0, sizeof(evt->args));
+    evt->num_results = 0;
+    memset(evt->result, 0, sizeof(evt->result));
+    evt->reserved = 0;
+    return evt;
+}
+
+// Start a multi-block transfer event, or the next part of a long one
+static struct evt_sd_multi *evt_alloc_sd_multi(struct state *st,
+                                               uint32_t sec, uint32_t nsec,
+                                               uint8_t cmd, uint32_t sector,
+                                               uint8_t flags) {
+    struct evt_sd_multi *multi;
+
+    multi = evt_alloc(st, EVT_SD_MULTI, sizeof(*multi));
+    evt_fill_header(multi, sec, nsec, sizeof(*multi), EVT_SD_MULTI);
+    evt_fill_end(multi, sec, nsec);
+    multi->cmd = cmd;
+    multi->flags = flags;
+    multi->sector = sector;
+    multi->num_results = 0;
+    multi->num_blocks = 0;
+    return multi;
+}
+
+static void evt_write_sd_multi(struct state *st, struct evt_sd_multi *multi) {
+    multi->sector = htonl(multi->sector);
+    multi->num_blocks = htonl(multi->num_blocks);
+    evt_emit(st, multi);
+    evt_free(st, multi);
+}
+
+// The first sector of a read or write is its argument, sent MSB first
+static uint32_t sd_cmd_sector(struct evt_sd_cmd *evt) {
+    if (evt->num_args < 4)
+        return 0;
+    return (evt->args[0] << 24) | (evt->args[1] << 16)
+         | (evt->args[2] << 8) | evt->args[3];
+}
+
+
+
+// Dummy state that should never be reached
+static int st_uninitialized(struct state *st) {
+    printf("state error: should not be in this state\n");
+    return -1;
+}
+
+// Packets that open, extend or close one of the in-flight events
+static int is_stateful(struct pkt *pkt) {
+    return pkt->header.type == PACKET_COMMAND
+        || pkt->header.type == PACKET_BUFFER_DRAIN
+        || pkt->header.type == PACKET_SD_CMD_ARG
+        || pkt->header.type == PACKET_SD_RESPONSE
+        || pkt->header.type == PACKET_SD_DATA;
+}
+
+// Group a packet that doesn't depend on the in-flight events
+static int group_stateless(struct state *st, struct pkt *pkt) {
+    if (pkt->header.type == PACKET_HELLO) {
+        evt_write_hello(st, pkt);
+    }
+
+    else if (pkt->header.type == PACKET_RESET) {
+        evt_write_reset(st, pkt);
+    }
+
+    else if (pkt->header.type == PACKET_NAND_CYCLE) {
+        write_nand_cmd(st, pkt);
+    }
+
+    else {
+        printf("Unknown packet type: %s\n", types[pkt->header.type]);
+    }
+    return 0;
+}
+
+// Group a packet that works on the in-flight events in st->events
+static int group_stateful(struct state *st, struct pkt *pkt) {
+    if (pkt->header.type == PACKET_COMMAND) {
+        if (pkt->data.command.start_stop == CMD_STOP) {
+            struct evt_net_cmd *net = evt_take(st, EVT_NET_CMD);
+            if (!net) {
+                struct evt_net_cmd evt;
+                fprintf(stderr, "NET_CMD end without begin\n");
+                evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                                sizeof(evt), EVT_NET_CMD);
+                evt.cmd[0] = pkt->data.command.cmd[0];
+                evt.cmd[1] = pkt->data.command.cmd[1];
+                evt.arg = pkt->data.command.arg;
+                evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
+                evt.arg = htonl(evt.arg);
+                evt_emit(st, &evt);
+            }
+            else {
+                evt_fill_end(net, pkt->header.sec, pkt->header.nsec);
+                net->arg = htonl(net->arg);
+                evt_emit(st, net);
+                evt_free(st, net);
+            }
+        }
+        else {
+            struct evt_net_cmd *net = evt_take(st, EVT_NET_CMD);
+            if (net) {
+                fprintf(stderr, "Multiple NET_CMDs going at once\n");
+                evt_free(st, net);
+            }
+
+            net = evt_alloc(st, EVT_NET_CMD, sizeof(*net));
+            evt_fill_header(net, pkt->header.sec, pkt->header.nsec,
+                            sizeof(*net), EVT_NET_CMD);
+            net->cmd[0] = pkt->data.command.cmd[0];
+            net->cmd[1] = pkt->data.command.cmd[1];
+            net->arg = pkt->data.command.arg;
+            evt_put(st, net);
+        }
+    }
+
+    else if (pkt->header.type == PACKET_BUFFER_DRAIN) {
+        if (pkt->data.buffer_drain.start_stop == PKT_BUFFER_DRAIN_STOP) {
+            struct evt_buffer_drain *evt = evt_take(st, EVT_BUFFER_DRAIN);
+            if (!evt) {
+                struct evt_buffer_drain evt;
+                fprintf(stderr, "BUFFER_DRAIN end without begin\n");
+                evt_fill_header(&evt, pkt->header.sec, pkt->header.nsec,
+                                sizeof(evt), EVT_BUFFER_DRAIN);
+                evt_fill_end(&evt, pkt->header.sec, pkt->header.nsec);
+                evt_emit(st, &evt);
+            }
+            else {
+                evt_fill_end(evt, pkt->header.sec, pkt->header.nsec);
+                evt_emit(st, evt);
+                evt_free(st, evt);
+            }
+        }
+        else {
+            struct evt_buffer_drain *evt = evt_take(st, EVT_BUFFER_DRAIN);
+            if (evt) {
+                fprintf(stderr, "Multiple BUFFER_DRAINs going at once\n");
+                evt_free(st, evt);
+            }
+
+            evt = evt_alloc(st, EVT_BUFFER_DRAIN, sizeof(*evt));
+            evt_fill_header(evt, pkt->header.sec, pkt->header.nsec,
+                            sizeof(*evt), EVT_BUFFER_DRAIN);
+            evt_put(st, evt);
+        }
+    }
+
+    else if (pkt->header.type == PACKET_SD_CMD_ARG) {
+        struct evt_sd_cmd *evt;
+        struct pkt_sd_cmd_arg *sd = &pkt->data.sd_cmd_arg;
+
+        // The next command (usually CMD12) ends a multi-block transfer
+        if (sd->reg == 0) {
+            struct evt_sd_multi *multi = evt_take(st, EVT_SD_MULTI);
+            if (multi)
+                evt_write_sd_multi(st, multi);
+        }
+
+        evt = evt_take(st, EVT_SD_CMD);
+        if (!evt)
+            evt = evt_alloc_sd_cmd(st, pkt);
+
+        // Ignore args for CMD55
+        if ((evt->num_args || sd->reg>0) && evt->cmd != 0x55) {
+            evt->args[evt->num_args++] = sd->val;
+        }
+
+        // Register 0 implies this is a CMD.
+        else if (sd->reg == 0) {
+            if (evt->cmd == 0x55)
+                evt->cmd = 0x80 | (0x3f & sd->val);
+            else
+                evt->cmd = 0x3f & sd->val;
+        }
+        evt_put(st, evt);
+    }
+    else if (pkt->header.type == PACKET_SD_RESPONSE) {
+        struct evt_sd_multi *multi = evt_take(st, EVT_SD_MULTI);
+        struct evt_sd_cmd *evt;
+
+        // More of the response to a multi-block command
+        if (multi) {
+            if (!multi->num_blocks
+             && multi->num_results < sizeof(multi->result))
+                multi->result[multi->num_results++] = pkt->data.response.byte;
+            evt_put(st, multi);
+            return 0;
+        }
+
+        evt = evt_take(st, EVT_SD_CMD);
+        if (!evt) {
+            fprintf(stderr, "Couldn't find old EVT_SD_CMD in SD_RESPONSE\n");
+            return 0;
+        }
+
+        // Ignore CMD17, as we'll pick it up on the PACKET_SD_DATA packet
+        if (evt->cmd == 17) {
+            evt_put(st, evt);
+        }
+
+        // CMD18 and CMD25 carry on until the next command, collecting
+        // blocks as they go by
+        else if (evt->cmd == 18 || evt->cmd == 25) {
+            multi = evt_alloc_sd_multi(st, ntohl(evt->hdr.sec_start),
+                                       ntohl(evt->hdr.nsec_start),
+                                       evt->cmd, sd_cmd_sector(evt), 0);
+            multi->result[multi->num_results++] = pkt->data.response.byte;
+            evt_fill_end(multi, pkt->header.sec, pkt->header.nsec);
+            evt_free(st, evt);
+            evt_put(st, multi);
+        }
+        else {
+            struct pkt_sd_response *sd = &pkt->data.response;
+
+            evt->result[evt->num_results++] = sd->byte;
+            evt->num_results = htonl(evt->num_results);
+            evt->num_args = htonl(evt->num_args);
+
+            evt_fill_end(evt, pkt->header.sec, pkt->header.nsec);
+            evt_emit(st, evt);
+            evt_free(st, evt);
+        }
+    }
+
+    else if (pkt->header.type == PACKET_SD_DATA) {
+        struct evt_sd_multi *multi = evt_take(st, EVT_SD_MULTI);
+        struct evt_sd_cmd *evt;
+        struct pkt_sd_data *sd = &pkt->data.sd_data;
+        int offset;
+
+        if (multi) {
+            struct evt_sd_block *blk;
+
+            if (multi->num_blocks == sizeof(multi->blocks) / sizeof(*blk)) {
+                uint8_t cmd = multi->cmd;
+                uint32_t sector = multi->sector + multi->num_blocks;
+
+                evt_write_sd_multi(st, multi);
+                multi = evt_alloc_sd_multi(st, pkt->header.sec,
+                                           pkt->header.nsec, cmd, sector,
+                                           SD_MULTI_CONTINUED);
+            }
+
+            blk = &multi->blocks[multi->num_blocks];
+            blk->sec = htonl(pkt->header.sec);
+            blk->nsec = htonl(pkt->header.nsec);
+            memcpy(multi->data + multi->num_blocks * SD_BLOCK_SIZE,
+                   sd->data, SD_BLOCK_SIZE);
+            multi->num_blocks++;
+            evt_fill_end(multi, pkt->header.sec, pkt->header.nsec);
+            evt_put(st, multi);
+            return 0;
+        }
+
+        evt = evt_take(st, EVT_SD_CMD);
+        if (!evt) {
+            fprintf(stderr, "Couldn't find old SD_EVT_CMD in SD_DATA\n");
+            return 0;
+        }
+
+        for (offset=0; offset<sizeof(sd->data); offset++)
+            evt->result[evt->num_results++] = sd->data[offset];
+
+        evt->num_results = htonl(evt->num_results);
+        evt->num_args = htonl(evt->num_args);
+        evt_fill_end(evt, pkt->header.sec, pkt->header.nsec);
+        evt_emit(st, evt);
+        evt_free(st, evt);
+    }
+    return 0;
+}
+
+/* Packet feeds.
+ * Where a decoder's packets are in the input, as the demultiplexer finds
+ * them: runs of the mapped input holding nothing but that decoder's
+ * packets, all of them already checked to be whole.  The demultiplexer
+ * only notes where the runs are, never waiting on the decoders, so no
+ * decoder is kept waiting on input that another one is holding up.
+ */
+struct demux_run {
+    off_t start, end;
+};
+
+struct demux_feed {
+    const uint8_t *map;
+
+    struct demux_run *runs;
+    size_t count, cap;
+
+    /* How many runs the decoder has been through, and how far into the
+     * next one it is
+     */
+    size_t taken;
+    off_t pos;
+
+    int finished;
+
+    /* Set with finished if the input couldn't be read to its end */
+    int error;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Long runs are handed over in pieces, so their decoder can get going
+#define DEMUX_RUN_MAX (1024 * 1024)
+
+static int feed_add(struct demux_feed *f, off_t start, off_t end) {
+    int ret = 0;
+
+    pthread_mutex_lock(&f->lock);
+    if (f->count == f->cap) {
+        size_t cap = f->cap ? f->cap * 2 : 1024;
+        struct demux_run *runs = realloc(f->runs, cap * sizeof(*runs));
+        if (!runs) {
+            perror("Couldn't grow packet runs");
+            ret = -1;
+        }
+        else {
+            f->runs = runs;
+            f->cap = cap;
+        }
+    }
+    if (!ret) {
+        f->runs[f->count].start = start;
+        f->runs[f->count].end = end;
+        f->count++;
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return ret;
+}
+
+static void feed_finish(struct demux_feed *f, int error) {
+    pthread_mutex_lock(&f->lock);
+    f->finished = 1;
+    f->error = error;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+// A decoder's window reads its packets through here
+static ssize_t feed_read(void *arg, uint8_t *buf, size_t len) {
+    struct demux_feed *f = arg;
+    const uint8_t *src = NULL;
+    ssize_t n = 0;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->taken == f->count && !f->finished)
+        pthread_cond_wait(&f->cond, &f->lock);
+    if (f->taken < f->count) {
+        struct demux_run *run = &f->runs[f->taken];
+
+        src = f->map + run->start + f->pos;
+        n = run->end - run->start - f->pos;
+        if (n > len)
+            n = len;
+        f->pos += n;
+        if (run->start + f->pos == run->end) {
+            f->pos = 0;
+            // Start the list over whenever the decoder catches up
+            if (++f->taken == f->count)
+                f->taken = f->count = 0;
+        }
+    }
+    else if (f->error)
+        n = -1;
+    pthread_mutex_unlock(&f->lock);
+
+    // The map doesn't change, so copying out of it needn't hold the lock
+    if (src)
+        memcpy(buf, src, n);
+    return n;
+}
+
+// Take the feed's next run whole, waiting for one if need be.  Returns 1
+// with a run, 0 at the end of the feed, and -1 if it ended early.
+static int feed_next_run(struct demux_feed *f, struct demux_run *run) {
+    int ret = 0;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->taken == f->count && !f->finished)
+        pthread_cond_wait(&f->cond, &f->lock);
+    if (f->taken < f->count) {
+        *run = f->runs[f->taken];
+        if (++f->taken == f->count)
+            f->taken = f->count = 0;
+        ret = 1;
+    }
+    else if (f->error)
+        ret = -1;
+    pthread_mutex_unlock(&f->lock);
+    return ret;
+}
+
+/* Parallel grouping.
+ * NAND decoding always starts afresh at a command cycle that directly
+ * follows a data-out cycle: no decoder looks past a data-out cycle, and no
+ * multi-cycle command continues with one.  The input is cut into chunks
+ * at such points and worker threads decode the chunks independently.
+ *
+ * Packets that work on the in-flight SD, network and buffer-drain events
+ * depend on everything before them, so workers set them aside along with
+ * where they fell in the chunk's output.  The main thread stitches the
+ * chunks back together in order, replaying those packets against the one
+ * set of in-flight events, which thereby carries over between chunks.
+ */
+#define CHUNK_SIZE (16 * 1024 * 1024)
+#define CHUNKS_PER_THREAD 4
+
+struct deferred_pkt {
+    size_t offset;
+    struct pkt pkt;
+};
+
+/* Where in the mapped input a chunk's packets are */
+struct run_list {
+    struct demux_run *runs;
+    int count, cap;
+};
+
+struct chunk {
+    /* The chunk's packets, and how far its decoder has read through them */
+    const uint8_t *map;
+    struct run_list in;
+    int in_run;
+    off_t in_pos;
+
+    struct evt_buffer out;
+    struct deferred_pkt *deferred;
+    int deferred_count, deferred_cap;
+    int done;
+
+    /* Set if decoding stopped short of the chunk's end */
+    int failed;
+
+    /* Time of the chunk's last packet */
+    uint32_t last_sec, last_nsec;
+};
+
+struct chunk_queue {
+    struct state *st;
+    const uint8_t *map;
+    struct chunk *chunks;
+    int slots;
+
+    /* Running counts of chunks queued, picked up by workers, and written */
+    int added, taken, merged;
+    int finished;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static int is_chunk_boundary(struct pkt *prev, struct pkt *pkt) {
+    return prev->header.type == PACKET_NAND_CYCLE
+        && pkt->header.type == PACKET_NAND_CYCLE
+        && nand_re(prev->data.nand_cycle.control)
+        && !nand_ale(prev->data.nand_cycle.control)
+        && !nand_cle(prev->data.nand_cycle.control)
+        && !nand_we(prev->data.nand_cycle.control)
+        && nand_cle(pkt->data.nand_cycle.control)
+        && !nand_re(pkt->data.nand_cycle.control);
+}
+
+static int run_list_add(struct run_list *l, off_t start, off_t end) {
+    if (start == end)
+        return 0;
+    // Packets that follow on from the last run just extend it
+    if (l->count && l->runs[l->count - 1].end == start) {
+        l->runs[l->count - 1].end = end;
+        return 0;
+    }
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 64;
+        struct demux_run *runs = realloc(l->runs, cap * sizeof(*runs));
+        if (!runs) {
+            perror("Couldn't grow chunk");
+            return -1;
+        }
+        l->runs = runs;
+        l->cap = cap;
+    }
+    l->runs[l->count].start = start;
+    l->runs[l->count].end = end;
+    l->count++;
+    return 0;
+}
+
+// Hand a chunk's packets to its decoder's window
+static ssize_t chunk_read(void *arg, uint8_t *buf, size_t len) {
+    struct chunk *c = arg;
+    size_t n = 0;
+
+    while (n < len && c->in_run < c->in.count) {
+        struct demux_run *run = &c->in.runs[c->in_run];
+        size_t left = run->end - run->start - c->in_pos;
+
+        if (left > len - n)
+            left = len - n;
+        memcpy(buf + n, c->map + run->start + c->in_pos, left);
+        n += left;
+        c->in_pos += left;
+        if (run->start + c->in_pos == run->end) {
+            c->in_run++;
+            c->in_pos = 0;
+        }
+    }
+    return n;
+}
+
+static int group_chunk(struct state *ws, struct chunk *c) {
+    struct pkt pkt;
+    struct pkt *next;
+
+    ws->out_buf = &c->out;
+    c->in_run = 0;
+    c->in_pos = 0;
+    if (packet_window_init(ws, 0, -1))
+        return -1;
+    ws->window.read = chunk_read;
+    ws->window.read_arg = c;
+
+    while ((next = packet_peek(ws, 0))) {
+        if (is_stateful(next)) {
+            struct deferred_pkt *d;
+
+            if (c->deferred_count == c->deferred_cap) {
+                int cap = c->deferred_cap ? c->deferred_cap * 2 : 256;
+                d = realloc(c->deferred, cap * sizeof(*d));
+                if (!d) {
+                    perror("Couldn't defer packet");
+                    return -1;
+                }
+                c->deferred = d;
+                c->deferred_cap = cap;
+            }
+            d = &c->deferred[c->deferred_count++];
+            d->offset = c->out.len;
+            memcpy(&d->pkt, next, next->header.size);
+            c->last_sec = next->header.sec;
+            c->last_nsec = next->header.nsec;
+            packet_consume(ws, 1);
+            continue;
+        }
+
+        memcpy(&pkt, next, next->header.size);
+        packet_consume(ws, 1);
+        group_stateless(ws, &pkt);
+        c->last_sec = pkt.header.sec;
+        c->last_nsec = pkt.header.nsec;
+    }
+    return ws->window.error ? -1 : 0;
+}
+
+static void *group_worker(void *arg) {
+    struct chunk_queue *q = arg;
+    struct state ws;
+
+    memset(&ws, 0, sizeof(ws));
+    ws.fd = q->st->fd;
+    ws.out_fd = -1;
+    ws.window.types = q->st->window.types;
+
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        struct chunk *c;
+
+        while (q->taken == q->added && !q->finished)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (q->taken == q->added)
+            break;
+        c = &q->chunks[q->taken++ % q->slots];
+        pthread_mutex_unlock(&q->lock);
+
+        c->failed = (group_chunk(&ws, c) != 0);
+
+        pthread_mutex_lock(&q->lock);
+        c->done = 1;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    packet_window_free(&ws);
+    evt_pool_free(&ws);
+    return NULL;
+}
+
+/* Write out a decoded chunk, handling its set-aside packets in place.  A
+ * chunk that failed part way is written out as far as it got, and then
+ * stops the merge.
+ */
+static int merge_chunk(struct state *st, struct chunk *c) {
+    size_t pos = 0;
+    int i;
+
+    for (i=0; i<c->deferred_count; i++) {
+        struct deferred_pkt *d = &c->deferred[i];
+        if (evt_sink_records(st, c->out.data + pos, d->offset - pos))
+            return -1;
+        pos = d->offset;
+        st->input_sec = d->pkt.header.sec;
+        st->input_nsec = d->pkt.header.nsec;
+        group_stateful(st, &d->pkt);
+    }
+    if (evt_sink_records(st, c->out.data + pos, c->out.len - pos))
+        return -1;
+
+    st->input_sec = c->last_sec;
+    st->input_nsec = c->last_nsec;
+    if (reorder_release(st))
+        return -1;
+
+    c->out.len = 0;
+    c->deferred_count = 0;
+    return c->failed ? -1 : 0;
+}
+
+// Write out chunks in order until at least `until` have been written,
+// along with any others that happen to be ready.
+static int merge_chunks(struct chunk_queue *q, int until) {
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->merged < q->added) {
+        struct chunk *c = &q->chunks[q->merged % q->slots];
+
+        if (!c->done) {
+            if (q->merged >= until)
+                break;
+            pthread_cond_wait(&q->cond, &q->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&q->lock);
+        ret = merge_chunk(q->st, c);
+        pthread_mutex_lock(&q->lock);
+
+        c->done = 0;
+        q->merged++;
+        if (ret)
+            break;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+// Queue up the packets gathered in `in`, leaving it empty
+static int queue_chunk(struct chunk_queue *q, struct run_list *in) {
+    struct run_list empty;
+    struct chunk *c;
+
+    // Make room by writing out the oldest chunk, if need be
+    if (merge_chunks(q, q->added - q->slots + 1))
+        return -1;
+
+    pthread_mutex_lock(&q->lock);
+    c = &q->chunks[q->added % q->slots];
+    empty = c->in;
+    c->in = *in;
+    *in = empty;
+    in->count = 0;
+    c->map = q->map;
+    c->failed = 0;
+    q->added++;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+static int group_parallel(struct state *st, struct demux_feed *feed) {
+    struct chunk_queue q;
+    struct run_list pending;
+    struct demux_run run;
+    pthread_t *threads;
+    const struct pkt *prev = NULL;
+    off_t pending_len = 0;
+    int started;
+    int more = 0;
+    int ret = 0;
+    int i;
+
+    memset(&q, 0, sizeof(q));
+    memset(&pending, 0, sizeof(pending));
+    q.st = st;
+    q.map = feed->map;
+    q.slots = st->threads * CHUNKS_PER_THREAD;
+    q.chunks = calloc(q.slots, sizeof(*q.chunks));
+    threads = calloc(st->threads, sizeof(*threads));
+    if (!q.chunks || !threads) {
+        perror("Couldn't allocate chunks");
+        free(q.chunks);
+        free(threads);
+        return -1;
+    }
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+
+    for (started=0; started<st->threads; started++) {
+        if (pthread_create(&threads[started], NULL, group_worker, &q)) {
+            fprintf(stderr, "Couldn't start decoder thread\n");
+            ret = -1;
+            break;
+        }
+    }
+
+    // Gather up runs of packets, cutting a chunk off at a place to start
+    // afresh.  Packets are only looked at once the chunk is big enough.
+    while (!ret && (more = feed_next_run(feed, &run)) > 0) {
+        off_t pos = run.start;
+
+        if (pending_len + (run.end - run.start) <= CHUNK_SIZE)
+            prev = NULL;
+        else {
+            while (pos < run.end) {
+                const struct pkt *pkt = (const void *)(feed->map + pos);
+
+                if (pending_len + (pos - run.start) >= CHUNK_SIZE
+                 && prev && is_chunk_boundary((struct pkt *)prev,
+                                              (struct pkt *)pkt)) {
+                    if (run_list_add(&pending, run.start, pos)
+                     || queue_chunk(&q, &pending))
+                        ret = -1;
+                    pending_len = 0;
+                    run.start = pos;
+                    prev = NULL;
+                    break;
+                }
+                prev = pkt;
+                pos += ntohs(pkt->header.size);
+            }
+        }
+        if (!ret && run_list_add(&pending, run.start, run.end))
+            ret = -1;
+        pending_len += run.end - run.start;
+    }
+    if (!ret && pending.count)
+        ret = queue_chunk(&q, &pending);
+
+    pthread_mutex_lock(&q.lock);
+    q.finished = 1;
+    pthread_cond_broadcast(&q.cond);
+    pthread_mutex_unlock(&q.lock);
+
+    if (!ret)
+        ret = merge_chunks(&q, q.added);
+
+    // The chunks before a bad packet are written out, as group_serial()
+    // would, before it's reported
+    if (!ret && more < 0)
+        ret = -1;
+
+    for (i=0; i<started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i=0; i<q.slots; i++) {
+        free(q.chunks[i].in.runs);
+        free(q.chunks[i].out.data);
+        free(q.chunks[i].deferred);
+    }
+    free(q.chunks);
+    free(threads);
+    free(pending.runs);
+
+    return ret ? ret : -2;
+}
+
+static int group_serial(struct state *st) {
+    struct pkt pkt;
+    struct pkt *next;
+
+    while ((next = packet_peek(st, 0))) {
+        memcpy(&pkt, next, next->header.size);
+        packet_consume(st, 1);
+        st->input_sec = pkt.header.sec;
+        st->input_nsec = pkt.header.nsec;
+
+        if (is_stateful(&pkt))
+            group_stateful(st, &pkt);
+        else
+            group_stateless(st, &pkt);
+    }
+    return st->window.error ? -1 : -2;
+}
+
+/* Demultiplexing.
+ * NAND cycles, SD traffic and control packets (hello, reset, network
+ * commands and buffer drains) are interleaved in the joined stream, but
+ * each bus only makes sense on its own: a NAND decoder looking ahead for
+ * data-out cycles mustn't trip over an SD packet in the middle of them.
+ * So each bus gets its own decoder thread.  A router thread reads the
+ * input once and hands each bus's decoder a feed of where its packets are.
+ * Decoders write their events to a queue of blocks of their own, and the
+ * main thread merges those queues by start time.
+ *
+ * NAND events come out in order of start time by themselves.  SD and
+ * control events come out as they finish, which is close enough unless
+ * the output has to be strictly in order (-o); then those decoders put
+ * their events in order with a reorder stage first.
+ */
+#define DEMUX_BLOCK (256 * 1024)
+#define DEMUX_BLOCKS 16
+
+enum demux_bus {
+    BUS_NAND,
+    BUS_SD,
+    BUS_CONTROL,
+    BUS_COUNT,
+};
+
+#define SD_TYPES ((1 << PACKET_SD_DATA) \
+                | (1 << PACKET_SD_CMD_ARG) \
+                | (1 << PACKET_SD_RESPONSE))
+
+static const uint32_t demux_types[BUS_COUNT] = {
+    [BUS_NAND]    = 1 << PACKET_NAND_CYCLE,
+    [BUS_SD]      = SD_TYPES,
+    [BUS_CONTROL] = ~((1 << PACKET_NAND_CYCLE) | SD_TYPES),
+};
+
+struct demux_stream {
+    /* Decoder state.  It comes first, so a decoder's stage can find its
+     * stream from the state it's given.
+     */
+    struct state st;
+    pthread_t thread;
+
+    struct demux_feed feed;
+
+    /* Blocks of finished events.  added and taken are running counts */
+    struct evt_buffer blocks[DEMUX_BLOCKS];
+    int added, taken;
+    int finished;
+
+    /* Set if the merge stopped early, so events are just dropped */
+    int abandoned;
+
+    /* Set if the decoder stopped on an error rather than the end */
+    int failed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* How far the merge is through the oldest block */
+    size_t pos;
+};
+
+struct demux_router {
+    struct demux_stream *streams;
+    const uint8_t *map;
+    off_t size;
+};
+
+// Read through the input once, noting where each bus's packets are
+static void *demux_route(void *arg) {
+    struct demux_router *r = arg;
+    off_t pos = 0, start = 0;
+    int bus = -1;
+    int error = 0;
+    int i;
+
+    while (pos + sizeof(struct pkt_header) <= r->size) {
+        const struct pkt_header *hdr = (const void *)(r->map + pos);
+        uint16_t size = ntohs(hdr->size);
+        int next = -1;
+
+        if (size < sizeof(*hdr) || size > sizeof(struct pkt)) {
+            fprintf(stderr, "Bad packet size %d at offset %lld\n",
+                    size, (long long)pos);
+            error = 1;
+            break;
+        }
+        // A packet cut off by the end of the input ends it, as in a window
+        if (pos + size > r->size)
+            break;
+
+        for (i=0; i<BUS_COUNT; i++) {
+            if (hdr->type < 32 && (demux_types[i] & (1 << hdr->type))) {
+                next = i;
+                break;
+            }
+        }
+        if (next != bus || pos - start >= DEMUX_RUN_MAX) {
+            if (bus >= 0 && feed_add(&r->streams[bus].feed, start, pos)) {
+                error = 1;
+                bus = -1;
+                break;
+            }
+            bus = next;
+            start = pos;
+        }
+        pos += size;
+    }
+
+    // The packets before a bad one still go to their decoder
+    if (bus >= 0 && feed_add(&r->streams[bus].feed, start, pos))
+        error = 1;
+
+    for (i=0; i<BUS_COUNT; i++)
+        feed_finish(&r->streams[i].feed, error);
+    return NULL;
+}
+
+// Hand over the block being filled, and wait for room for another
+static void demux_publish(struct demux_stream *s, int finished) {
+    pthread_mutex_lock(&s->lock);
+    if (s->abandoned)
+        s->blocks[s->added % DEMUX_BLOCKS].len = 0;
+    else if (s->blocks[s->added % DEMUX_BLOCKS].len)
+        s->added++;
+    s->finished = finished;
+    pthread_cond_broadcast(&s->cond);
+    while (!finished && !s->abandoned
+        && s->added - s->taken >= DEMUX_BLOCKS)
+        pthread_cond_wait(&s->cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// A decoder's last stage: add the event to the block being filled
+static int demux_queue_event(struct state *ws, int stage,
+                             void *arg, uint32_t size) {
+    struct demux_stream *s = (struct demux_stream *)ws;
+    struct evt_buffer *blk = &s->blocks[s->added % DEMUX_BLOCKS];
+
+    if (evt_buffer_append(blk, arg, size) < 0)
+        return -1;
+    if (blk->len >= DEMUX_BLOCK)
+        demux_publish(s, 0);
+    return 0;
+}
+
+static void *demux_worker(void *arg) {
+    struct demux_stream *s = arg;
+    struct state *ws = &s->st;
+    int ret;
+
+    if (ws->threads > 1)
+        ret = group_parallel(ws, &s->feed);
+    else
+        ret = group_serial(ws);
+    s->failed = (ret != -2);
+
+    evt_sink_flush(ws);
+    demux_publish(s, 1);
+    packet_window_free(ws);
+    evt_pool_free(ws);
+    return NULL;
+}
+
+// Find a stream's next event, waiting for its decoder if need be.
+// Returns NULL once the stream has ended.
+static struct evt_header *demux_head(struct demux_stream *s) {
+    struct evt_header *hdr = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        if (s->taken < s->added) {
+            struct evt_buffer *blk = &s->blocks[s->taken % DEMUX_BLOCKS];
+            if (s->pos < blk->len) {
+                hdr = (struct evt_header *)(blk->data + s->pos);
+                break;
+            }
+            blk->len = 0;
+            s->pos = 0;
+            s->taken++;
+            pthread_cond_broadcast(&s->cond);
+            continue;
+        }
+        if (s->finished)
+            break;
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return hdr;
+}
+
+static int demux_stream_init(struct state *st, struct demux_stream *s,
+                             enum demux_bus bus) {
+    struct state *ws = &s->st;
+
+    memset(s, 0, sizeof(*s));
+    ws->fd = st->fd;
+    ws->out_fd = -1;
+    ws->threads = (bus == BUS_NAND) ? st->threads : 1;
+    if (packet_window_init(ws, 0, -1))
+        return -1;
+    ws->window.types = demux_types[bus];
+    ws->window.read = feed_read;
+    ws->window.read_arg = &s->feed;
+
+    // Only needed when the merged output has to be strictly in order
+    if (bus != BUS_NAND && st->reorder && reorder_init(ws))
+        return -1;
+    if (evt_add_stage(ws, demux_queue_event, NULL) < 0)
+        return -1;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    pthread_mutex_init(&s->feed.lock, NULL);
+    pthread_cond_init(&s->feed.cond, NULL);
+    return 0;
+}
+
+// Undo demux_stream_init(), whether or not its decoder ran
+static void demux_stream_free(struct demux_stream *s) {
+    packet_window_free(&s->st);
+    reorder_free(&s->st);
+    free(s->feed.runs);
+}
+
+static int group_demux(struct state *st) {
+    struct demux_stream *streams;
+    struct evt_header *heads[BUS_COUNT];
+    struct demux_router router;
+    struct stat stat_buf;
+    pthread_t router_thread;
+    uint8_t *map;
+    int routing;
+    int started;
+    int ret = 0;
+    int i;
+
+    if (fstat(st->fd, &stat_buf) == -1) {
+        perror("Couldn't stat input");
+        return -1;
+    }
+    if (stat_buf.st_size == 0)
+        return -2;
+
+    map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, st->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Couldn't map input");
+        return -1;
+    }
+    madvise(map, stat_buf.st_size, MADV_SEQUENTIAL);
+
+    streams = calloc(BUS_COUNT, sizeof(*streams));
+    if (!streams) {
+        perror("Couldn't allocate streams");
+        munmap(map, stat_buf.st_size);
+        return -1;
+    }
+
+    for (i=0; i<BUS_COUNT; i++) {
+        if (demux_stream_init(st, &streams[i], i)) {
+            // Including the one that failed, which may be half set up
+            for (; i>=0; i--)
+                demux_stream_free(&streams[i]);
+            free(streams);
+            munmap(map, stat_buf.st_size);
+            return -1;
+        }
+        streams[i].feed.map = map;
+    }
+
+    router.streams = streams;
+    router.map = map;
+    router.size = stat_buf.st_size;
+    routing = !pthread_create(&router_thread, NULL, demux_route, &router);
+    if (!routing) {
+        fprintf(stderr, "Couldn't start router thread\n");
+        for (i=0; i<BUS_COUNT; i++)
+            feed_finish(&streams[i].feed, 1);
+        ret = -1;
+    }
+    for (started=0; started<BUS_COUNT; started++) {
+        if (pthread_create(&streams[started].thread, NULL,
+                           demux_worker, &streams[started])) {
+            fprintf(stderr, "Couldn't start decoder thread\n");
+            ret = -1;
+            break;
+        }
+    }
+
+    for (i=0; i<BUS_COUNT && !ret; i++)
+        heads[i] = demux_head(&streams[i]);
+
+    while (!ret) {
+        uint32_t sec = 0, nsec = 0;
+        uint32_t size;
+        int best = -1;
+
+        for (i=0; i<BUS_COUNT; i++) {
+            uint32_t s, ns;
+
+            if (!heads[i])
+                continue;
+            s = ntohl(heads[i]->sec_start);
+            ns = ntohl(heads[i]->nsec_start);
+            if (best < 0 || s < sec || (s == sec && ns < nsec)) {
+                best = i;
+                sec = s;
+                nsec = ns;
+            }
+        }
+        if (best < 0)
+            break;
+
+        // With the streams in order, everything still to come starts
+        // after this
+        st->input_sec = sec;
+        st->input_nsec = nsec;
+
+        size = ntohl(heads[best]->size);
+        if (evt_sink(st, heads[best], size) < 0)
+            ret = -1;
+        streams[best].pos += size;
+        heads[best] = demux_head(&streams[best]);
+    }
+
+    for (i=0; i<started; i++) {
+        // Let a decoder that's still going finish up
+        pthread_mutex_lock(&streams[i].lock);
+        streams[i].abandoned = 1;
+        pthread_cond_broadcast(&streams[i].cond);
+        pthread_mutex_unlock(&streams[i].lock);
+
+        pthread_join(streams[i].thread, NULL);
+        if (streams[i].failed)
+            ret = -1;
+    }
+    if (routing)
+        pthread_join(router_thread, NULL);
+
+    for (i=0; i<BUS_COUNT; i++) {
+        int b;
+
+        for (b=0; b<DEMUX_BLOCKS; b++)
+            free(streams[i].blocks[b].data);
+        demux_stream_free(&streams[i]);
+    }
+    free(streams);
+    munmap(map, stat_buf.st_size);
+
+    return ret ? ret : -2;
+}
+
+// Searching for either a NAND block or a sync point
+static int st_scanning(struct state *st) {
+    int ret = group_demux(st);
+    evt_sink_flush(st);
+    return ret;
+}
+
+static int st_grouping(struct state *st) {
+    return 0;
+}
+
+static int st_done(struct state *st) {
+    printf("Done.\n");
+    return 0;
+}
+
+
+// Group st->fd into st->out_fd
+int group_run(struct state *st, const struct tf_group_opts *opts) {
+    int ret = 0;
+
+    st->threads = opts->threads;
+    if (st->threads < 1)
+        st->threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ((opts->collapse && collapse_init(st))
+     || (opts->blob_path && blob_store_create(st, opts->blob_path))
+     || (opts->ordered && reorder_init(st))
+     || packet_window_init(st, 0, -1))
+        ret = -1;
+
+    if (!ret) {
+        gstate_init(st);
+        while (gstate_state(st) != ST_DONE && !ret)
+            ret = gstate_run(st);
+        printf("State machine finished with result: %d\n", ret);
+    }
+
+    packet_window_free(st);
+    evt_pool_free(st);
+    collapse_free(st);
+    reorder_free(st);
+    blob_store_close(st);
+
+    // Running out of input (-2) is how it finishes
+    return (ret < 0 && ret != -2) ? -1 : 0;
+}
@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "event-struct.h"
+
+/* Secondary indexes for sorted files (sorter -i).
+ * Each index maps a key -- the event type, the row address of a NAND
+ * read, or each sector of an SD command -- to the jump table positions of
+ * the events having it.  They're kept in a file next to the sorted file
+ * (<events>.idx):
+ *
+ *   "TBIx", then the number of indexes (32 bits)
+ *   For each index, in enum index_kind order: how many keys it has, and
+ *     where its directory is (64 bits each)
+ *   Each directory: for each key, in ascending order, the key, how many
+ *     events have it, and where their positions are (64 bits each)
+ *   The positions, ascending, as LEB128 varints: the first position, then
+ *     the difference from the one before
+ *
+ * All numbers are big-endian.
+ */
+
+#define INDEX_MAGIC "TBIx"
+#define INDEX_SUFFIX ".idx"
+
+struct index_entry {
+    uint64_t key;
+    uint64_t pos;
+};
+
+struct index_builder {
+    struct index_entry *entries[INDEX_KINDS];
+    size_t count[INDEX_KINDS];
+    size_t cap[INDEX_KINDS];
+};
+
+// Positions are written through this, in order
+struct index_out {
+    int fd;
+    uint64_t offset;
+    size_t len;
+    uint8_t buf[65536];
+};
+
+static char *index_path(const char *events_path) {
+    char *path = malloc(strlen(events_path) + sizeof(INDEX_SUFFIX));
+    if (!path) {
+        perror("Couldn't allocate index path");
+        return NULL;
+    }
+    strcpy(path, events_path);
+    strcat(path, INDEX_SUFFIX);
+    return path;
+}
+
+// Remove the index of a file that's been rewritten without one
+int index_remove(const char *events_path) {
+    char *path = index_path(events_path);
+    int ret = 0;
+
+    if (!path)
+        return -1;
+    if (unlink(path) && errno != ENOENT) {
+        perror("Couldn't remove old index");
+        ret = -1;
+    }
+    free(path);
+    return ret;
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+
+struct index_builder *index_builder_new(void) {
+    struct index_builder *b = calloc(1, sizeof(*b));
+    if (!b)
+        perror("Couldn't allocate index");
+    return b;
+}
+
+void index_builder_free(struct index_builder *b) {
+    int kind;
+
+    if (!b)
+        return;
+    for (kind=0; kind<INDEX_KINDS; kind++)
+        free(b->entries[kind]);
+    free(b);
+}
+
+static int index_add(struct index_builder *b, int kind,
+                     uint64_t key, uint64_t pos) {
+    struct index_entry *entry;
+
+    if (b->count[kind] == b->cap[kind]) {
+        size_t cap = b->cap[kind] ? b->cap[kind] * 2 : 4096;
+        entry = realloc(b->entries[kind], cap * sizeof(*entry));
+        if (!entry) {
+            perror("Couldn't grow index");
+            return -1;
+        }
+        b->entries[kind] = entry;
+        b->cap[kind] = cap;
+    }
+    entry = &b->entries[kind][b->count[kind]++];
+    entry->key = key;
+    entry->pos = pos;
+    return 0;
+}
+
+/* Note the keys of the event at jump table position `pos`.  Positions
+ * must be added in ascending order.  Only fields that come before any
+ * variable-length part are used, so compacted events, and those with
+ * their payload in the blob file, work the same as any other.
+ */
+int index_builder_add(struct index_builder *b, uint64_t pos,
+                      const void *arg, uint32_t size) {
+    const uint8_t *p = arg;
+    struct evt_header hdr;
+    uint8_t type;
+
+    memcpy(&hdr, arg, sizeof(hdr));
+    type = hdr.type & ~EVT_FLAG_REF;
+    if (index_add(b, INDEX_TYPE, type, pos))
+        return -1;
+
+    switch (type) {
+    case EVT_NAND_READ:
+    case EVT_NAND_CHANGE_READ_COLUMN:
+        // Address cycles are two of column, then the row, low byte first
+        p += offsetof(struct evt_nand_read, addr);
+        if (size < offsetof(struct evt_nand_read, addr) + 5)
+            break;
+        return index_add(b, INDEX_NAND_ROW,
+                         p[2] | (p[3] << 8) | (p[4] << 16), pos);
+
+    case EVT_SD_CMD:
+        if (size < offsetof(struct evt_sd_cmd, args) + 4
+         || get_be32(p + offsetof(struct evt_sd_cmd, num_args)) < 4)
+            break;
+        return index_add(b, INDEX_SD_SECTOR,
+                         get_be32(p + offsetof(struct evt_sd_cmd, args)), pos);
+
+    case EVT_SD_MULTI: {
+        // Every sector the transfer covers, so one in the middle is found
+        uint32_t sector, count, i;
+
+        if (size < offsetof(struct evt_sd_multi, num_blocks) + 4)
+            break;
+        sector = get_be32(p + offsetof(struct evt_sd_multi, sector));
+        count = get_be32(p + offsetof(struct evt_sd_multi, num_blocks));
+        if (!count || count > sizeof(((struct evt_sd_multi *)0)->blocks)
+                              / sizeof(struct evt_sd_block))
+            count = 1;
+        for (i=0; i<count; i++)
+            if (index_add(b, INDEX_SD_SECTOR, sector + i, pos))
+                return -1;
+        break;
+    }
+    }
+    return 0;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    const struct index_entry *ea = a, *eb = b;
+
+    if (ea->key != eb->key)
+        return ea->key < eb->key ? -1 : 1;
+    if (ea->pos != eb->pos)
+        return ea->pos < eb->pos ? -1 : 1;
+    return 0;
+}
+
+static int out_flush(struct index_out *o) {
+    if (pwrite(o->fd, o->buf, o->len, o->offset) != o->len) {
+        perror("Couldn't write index");
+        return -1;
+    }
+    o->offset += o->len;
+    o->len = 0;
+    return 0;
+}
+
+static int out_varint(struct index_out *o, uint64_t v) {
+    if (o->len + 10 > sizeof(o->buf) && out_flush(o))
+        return -1;
+    while (v >= 0x80) {
+        o->buf[o->len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    o->buf[o->len++] = v;
+    return 0;
+}
+
+// Gather up one kind of entry from all the builders, in key order
+static struct index_entry *index_gather(struct index_builder **builders,
+                                        int count, int kind, size_t *total,
+                                        uint64_t *keys) {
+    struct index_entry *all;
+    size_t n = 0;
+    size_t i;
+    int j;
+
+    for (j=0; j<count; j++)
+        n += builders[j]->count[kind];
+    all = malloc((n ? n : 1) * sizeof(*all));
+    if (!all) {
+        perror("Couldn't allocate index");
+        return NULL;
+    }
+
+    n = 0;
+    for (j=0; j<count; j++) {
+        memcpy(all + n, builders[j]->entries[kind],
+               builders[j]->count[kind] * sizeof(*all));
+        n += builders[j]->count[kind];
+        free(builders[j]->entries[kind]);
+        builders[j]->entries[kind] = NULL;
+        builders[j]->count[kind] = builders[j]->cap[kind] = 0;
+    }
+    qsort(all, n, sizeof(*all), entry_cmp);
+
+    *keys = 0;
+    for (i=0; i<n; i++)
+        if (!i || all[i].key != all[i - 1].key)
+            (*keys)++;
+    *total = n;
+    return all;
+}
+
+// Write out what the builders (one per slice of the output) have gathered
+int index_write(struct index_builder **builders, int count,
+                const char *events_path) {
+    uint8_t header[sizeof(INDEX_MAGIC) - 1 + sizeof(uint32_t)
+                   + INDEX_KINDS * 2 * sizeof(uint64_t)];
+    struct index_entry *all[INDEX_KINDS];
+    uint64_t keys[INDEX_KINDS];
+    size_t total[INDEX_KINDS];
+    struct index_out *o = NULL;
+    uint64_t dir_offset;
+    uint32_t kinds = htonl(INDEX_KINDS);
+    char *path;
+    int ret = -1;
+    int kind;
+
+    memset(all, 0, sizeof(all));
+    path = index_path(events_path);
+    if (!path)
+        return -1;
+
+    for (kind=0; kind<INDEX_KINDS; kind++) {
+        all[kind] = index_gather(builders, count, kind, &total[kind], &keys[kind]);
+        if (!all[kind])
+            goto out;
+    }
+
+    o = malloc(sizeof(*o));
+    if (!o) {
+        perror("Couldn't allocate index buffer");
+        goto out;
+    }
+    o->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (o->fd == -1) {
+        perror("Unable to open index file");
+        goto out;
+    }
+
+    // Directories follow the header, and positions follow them
+    memcpy(header, INDEX_MAGIC, sizeof(INDEX_MAGIC) - 1);
+    memcpy(header + sizeof(INDEX_MAGIC) - 1, &kinds, sizeof(kinds));
+    dir_offset = sizeof(header);
+    for (kind=0; kind<INDEX_KINDS; kind++) {
+        uint8_t *p = header + sizeof(INDEX_MAGIC) - 1 + sizeof(kinds)
+                   + kind * 2 * sizeof(uint64_t);
+        put_be64(p, keys[kind]);
+        put_be64(p + sizeof(uint64_t), dir_offset);
+        dir_offset += keys[kind] * 3 * sizeof(uint64_t);
+    }
+    if (pwrite(o->fd, header, sizeof(header), 0) != sizeof(header)) {
+        perror("Couldn't write index");
+        goto out_close;
+    }
+    o->offset = dir_offset;
+    o->len = 0;
+
+    dir_offset = sizeof(header);
+    for (kind=0; kind<INDEX_KINDS; kind++) {
+        size_t dir_bytes = keys[kind] * 3 * sizeof(uint64_t);
+        uint8_t *dir = malloc(dir_bytes ? dir_bytes : 1);
+        uint8_t *p = dir;
+        size_t i = 0;
+
+        if (!dir) {
+            perror("Couldn't allocate index directory");
+            goto out_close;
+        }
+        while (i < total[kind]) {
+            uint64_t prev = 0;
+            size_t j;
+
+            for (j=i; j<total[kind] && all[kind][j].key == all[kind][i].key; j++)
+                ;
+            put_be64(p, all[kind][i].key);
+            put_be64(p + sizeof(uint64_t), j - i);
+            put_be64(p + 2 * sizeof(uint64_t), o->offset + o->len);
+            p += 3 * sizeof(uint64_t);
+
+            for (; i<j; i++) {
+                if (out_varint(o, all[kind][i].pos - prev)) {
+                    free(dir);
+                    goto out_close;
+                }
+                prev = all[kind][i].pos;
+            }
+        }
+        if (pwrite(o->fd, dir, dir_bytes, dir_offset) != dir_bytes) {
+            perror("Couldn't write index directory");
+            free(dir);
+            goto out_close;
+        }
+        free(dir);
+        dir_offset += dir_bytes;
+    }
+    if (out_flush(o))
+        goto out_close;
+    ret = 0;
+
+out_close:
+    close(o->fd);
+out:
+    for (kind=0; kind<INDEX_KINDS; kind++)
+        free(all[kind]);
+    free(o);
+    free(path);
+    return ret;
+}
+
+
+int index_open(struct index_file *ix, const char *events_path) {
+    struct stat stat_buf;
+    char *path;
+    uint64_t header;
+    int fd;
+    int kind;
+
+    memset(ix, 0, sizeof(*ix));
+    path = index_path(events_path);
+    if (!path)
+        return -1;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) {
+        perror("Unable to open index file (sort with -i to make one)");
+        return -1;
+    }
+    if (fstat(fd, &stat_buf) == -1) {
+        perror("Couldn't stat index file");
+        close(fd);
+        return -1;
+    }
+    ix->size = stat_buf.st_size;
+    header = sizeof(INDEX_MAGIC) - 1 + sizeof(uint32_t)
+           + INDEX_KINDS * 2 * sizeof(uint64_t);
+    if (ix->size < header) {
+        fprintf(stderr, "Index file is too short\n");
+        close(fd);
+        return -1;
+    }
+
+    ix->map = mmap(NULL, ix->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ix->map == MAP_FAILED) {
+        perror("Couldn't map index file");
+        return -1;
+    }
+    if (memcmp(ix->map, INDEX_MAGIC, sizeof(INDEX_MAGIC) - 1)
+     || get_be32(ix->map + sizeof(INDEX_MAGIC) - 1) < INDEX_KINDS) {
+        fprintf(stderr, "Index file isn't one this can read\n");
+        goto err;
+    }
+
+    for (kind=0; kind<INDEX_KINDS; kind++) {
+        const uint8_t *p = ix->map + sizeof(INDEX_MAGIC) - 1 + sizeof(uint32_t)
+                         + kind * 2 * sizeof(uint64_t);
+        uint64_t offset = get_be64(p + sizeof(uint64_t));
+
+        ix->keys[kind] = get_be64(p);
+        if (offset > ix->size
+         || ix->keys[kind] > (ix->size - offset) / (3 * sizeof(uint64_t))) {
+            fprintf(stderr, "Index file is damaged\n");
+            goto err;
+        }
+        ix->dirs[kind] = ix->map + offset;
+    }
+    return 0;
+
+err:
+    munmap(ix->map, ix->size);
+    return -1;
+}
+
+void index_close(struct index_file *ix) {
+    munmap(ix->map, ix->size);
+}
+
+/* Call found() with the key and position of each event whose key is
+ * within [lo, hi], in order of key and then of position.
+ */
+int index_lookup(struct index_file *ix, int kind, uint64_t lo, uint64_t hi,
+                 int (*found)(void *arg, uint64_t key, uint64_t pos),
+                 void *arg) {
+    const uint8_t *dir = ix->dirs[kind];
+    uint64_t first = 0, last = ix->keys[kind];
+
+    // Binary search the directory for the first key not below lo
+    while (first < last) {
+        uint64_t mid = first + (last - first) / 2;
+        if (get_be64(dir + mid * 3 * sizeof(uint64_t)) < lo)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+
+    for (; first<ix->keys[kind]; first++) {
+        const uint8_t *entry = dir + first * 3 * sizeof(uint64_t);
+        uint64_t key = get_be64(entry);
+        uint64_t count = get_be64(entry + sizeof(uint64_t));
+        uint64_t offset = get_be64(entry + 2 * sizeof(uint64_t));
+        uint64_t pos = 0;
+        uint64_t i;
+
+        if (key > hi)
+            break;
+        for (i=0; i<count; i++) {
+            uint64_t delta = 0;
+            int shift = 0;
+
+            do {
+                if (offset >= ix->size || shift > 63) {
+                    fprintf(stderr, "Index file is damaged\n");
+                    return -1;
+                }
+                delta |= (uint64_t)(ix->map[offset] & 0x7f) << shift;
+                shift += 7;
+            } while (ix->map[offset++] & 0x80);
+
+            pos += delta;
+            if (found(arg, key, pos))
+                return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "event-struct.h"
+
+/* Sorting the sorter's keys by start time.  Kept apart from the sorter so
+ * that the benchmarks can time it on its own.
+ */
+
+/* LSD radix sort on the start time, a byte at a time.  Each pass is
+ * stable, so events that start together stay in the order they were
+ * written.  Bytes that are the same in every key (the top of the seconds
+ * field, usually) are skipped.
+ */
+static int radix_sort(struct sort_key *src, size_t count) {
+    size_t counts[8][256];
+    struct sort_key *orig = src;
+    struct sort_key *dst, *tmp;
+    size_t i;
+    int pass;
+
+    dst = malloc(count * sizeof(*dst));
+    if (count && !dst) {
+        perror("Couldn't allocate sort buffer");
+        return -1;
+    }
+
+    memset(counts, 0, sizeof(counts));
+    for (i=0; i<count; i++)
+        for (pass=0; pass<8; pass++)
+            counts[pass][(src[i].time >> (pass * 8)) & 0xff]++;
+
+    for (pass=0; pass<8; pass++) {
+        size_t *c = counts[pass];
+        size_t total = 0;
+        int shift = pass * 8;
+        int digit;
+
+        if (count == 0 || c[(src[0].time >> shift) & 0xff] == count)
+            continue;
+
+        for (digit=0; digit<256; digit++) {
+            size_t n = c[digit];
+            c[digit] = total;
+            total += n;
+        }
+        for (i=0; i<count; i++)
+            dst[c[(src[i].time >> shift) & 0xff]++] = src[i];
+
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    // Make sure the result ends up where it started
+    if (src != orig) {
+        memcpy(orig, src, count * sizeof(*orig));
+        dst = src;
+    }
+    free(dst);
+    return 0;
+}
+
+/* Natural merge sort, after timsort.
+ * Grouper output is nearly in order already: only events that finished
+ * late (SD commands, network commands, buffer drains) are out of place.
+ * The keys are cut into their natural ascending runs, short runs are
+ * topped up with an insertion sort, and neighbouring runs are merged with
+ * timsort's rules for keeping the merges balanced.
+ *
+ * Before merging two runs, the part of the first that is already below
+ * the second, and the part of the second that is already above the
+ * first, are found by binary search and left where they are.  A late
+ * event then costs about as much as the distance it has to move.
+ */
+#define MIN_MERGE 32
+
+struct sort_run {
+    size_t start, len;
+};
+
+// Where key would go in a[0..n), after any equal keys
+static size_t upper_bound(struct sort_key *a, size_t n, uint64_t time) {
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (a[mid].time <= time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Where key would go in a[0..n), before any equal keys
+static size_t lower_bound(struct sort_key *a, size_t n, uint64_t time) {
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (a[mid].time < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static size_t min_run_length(size_t n) {
+    size_t r = 0;
+
+    while (n >= MIN_MERGE * 2) {
+        r |= n & 1;
+        n >>= 1;
+    }
+    return n + r;
+}
+
+// Sort a[0..n), of which the first `sorted` are already in order
+static void insertion_sort(struct sort_key *a, size_t n, size_t sorted) {
+    size_t i;
+
+    for (i=sorted; i<n; i++) {
+        struct sort_key key = a[i];
+        size_t pos = upper_bound(a, i, key.time);
+
+        memmove(&a[pos + 1], &a[pos], (i - pos) * sizeof(*a));
+        a[pos] = key;
+    }
+}
+
+// Merge the neighbouring sorted runs a[0..na) and a[na..na+nb)
+static void merge_runs(struct sort_key *a, size_t na, size_t nb,
+                      struct sort_key *tmp) {
+    struct sort_key *b = a + na;
+    size_t skip;
+
+    // Leave the part of a that's below all of b
+    skip = upper_bound(a, na, b[0].time);
+    a += skip;
+    na -= skip;
+    if (!na)
+        return;
+
+    // Leave the part of b that's above all of a
+    nb = lower_bound(b, nb, a[na - 1].time);
+    if (!nb)
+        return;
+
+    if (na <= nb) {
+        // Merge forwards, with a moved out of the way
+        struct sort_key *out = a;
+        size_t i = 0, j = 0;
+
+        memcpy(tmp, a, na * sizeof(*a));
+        while (i < na && j < nb) {
+            if (b[j].time < tmp[i].time)
+                *out++ = b[j++];
+            else
+                *out++ = tmp[i++];
+        }
+        memcpy(out, &tmp[i], (na - i) * sizeof(*a));
+    }
+    else {
+        // Merge backwards, with b moved out of the way
+        struct sort_key *out = b + nb;
+        size_t i = na, j = nb;
+
+        memcpy(tmp, b, nb * sizeof(*b));
+        while (i > 0 && j > 0) {
+            if (tmp[j - 1].time < a[i - 1].time)
+                *--out = a[--i];
+            else
+                *--out = tmp[--j];
+        }
+        memcpy(out - j, tmp, j * sizeof(*b));
+    }
+}
+
+static void merge_at(struct sort_key *keys, struct sort_run *stack,
+                     int *depth, int i, struct sort_key *tmp) {
+    merge_runs(keys + stack[i].start, stack[i].len, stack[i + 1].len, tmp);
+    stack[i].len += stack[i + 1].len;
+    memmove(&stack[i + 1], &stack[i + 2],
+            (*depth - i - 2) * sizeof(*stack));
+    (*depth)--;
+}
+
+// Merge runs on the stack until their lengths shrink fast enough that
+// it can't get deep, and merges stay between runs of similar size.
+static void merge_collapse(struct sort_key *keys, struct sort_run *stack,
+                           int *depth, struct sort_key *tmp) {
+    while (*depth > 1) {
+        int n = *depth - 2;
+
+        if ((n > 0 && stack[n - 1].len <= stack[n].len + stack[n + 1].len)
+         || (n > 1 && stack[n - 2].len <= stack[n - 1].len + stack[n].len)) {
+            if (stack[n - 1].len < stack[n + 1].len)
+                n--;
+        }
+        else if (stack[n].len > stack[n + 1].len) {
+            break;
+        }
+        merge_at(keys, stack, depth, n, tmp);
+    }
+}
+
+static int natural_sort(struct sort_key *keys, size_t count) {
+    struct sort_run stack[96];
+    struct sort_key *tmp;
+    size_t min_run = min_run_length(count);
+    size_t pos = 0;
+    int depth = 0;
+
+    tmp = malloc((count / 2 + 1) * sizeof(*tmp));
+    if (!tmp) {
+        perror("Couldn't allocate sort buffer");
+        return -1;
+    }
+
+    while (pos < count) {
+        size_t len = 1;
+
+        while (pos + len < count && keys[pos + len - 1].time <= keys[pos + len].time)
+            len++;
+
+        // Top up short runs so the merges have something to work with
+        if (len < min_run) {
+            size_t want = (count - pos < min_run) ? count - pos : min_run;
+            insertion_sort(keys + pos, want, len);
+            len = want;
+        }
+
+        stack[depth].start = pos;
+        stack[depth].len = len;
+        depth++;
+        pos += len;
+        merge_collapse(keys, stack, &depth, tmp);
+    }
+
+    while (depth > 1) {
+        int n = depth - 2;
+        if (n > 0 && stack[n - 1].len < stack[n + 1].len)
+            n--;
+        merge_at(keys, stack, &depth, n, tmp);
+    }
+
+    free(tmp);
+    return 0;
+}
+
+/* Use the natural merge when the keys are mostly in order, which costs
+ * next to nothing if they are in order already, and the radix sort when
+ * they aren't.
+ */
+int sort_keys(struct sort_key *keys, size_t count) {
+    size_t descents = 0;
+    size_t i;
+
+    for (i=1; i<count; i++)
+        if (keys[i].time < keys[i - 1].time)
+            descents++;
+
+    if (!descents)
+        return 0;
+    if (descents <= count / MIN_MERGE)
+        return natural_sort(keys, count);
+    return radix_sort(keys, count);
+}
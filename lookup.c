@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include "event-reader.h"
+
+/* Finds events in a sorted file through its secondary indexes (sorter -i),
+ * and lists them in order of time.  Works on version 2 copies of the
+ * sorted file too, since converting keeps events in the same places.
+ */
+
+struct match {
+    uint64_t pos;
+    uint64_t key;
+};
+
+struct matches {
+    struct match *list;
+    size_t count, cap;
+};
+
+static const char *kind_names[] = {
+    [INDEX_TYPE]        = "type",
+    [INDEX_NAND_ROW]    = "row",
+    [INDEX_SD_SECTOR]   = "sector",
+};
+
+static int add_match(void *arg, uint64_t key, uint64_t pos) {
+    struct matches *m = arg;
+
+    if (m->count == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 1024;
+        struct match *list = realloc(m->list, cap * sizeof(*list));
+        if (!list) {
+            perror("Couldn't grow match list");
+            return -1;
+        }
+        m->list = list;
+        m->cap = cap;
+    }
+    m->list[m->count].pos = pos;
+    m->list[m->count].key = key;
+    m->count++;
+    return 0;
+}
+
+static int match_cmp(const void *a, const void *b) {
+    const struct match *ma = a, *mb = b;
+
+    if (ma->pos != mb->pos)
+        return ma->pos < mb->pos ? -1 : 1;
+    return 0;
+}
+
+// Parse "value" or "low-high"
+static int parse_range(const char *str, uint64_t *lo, uint64_t *hi) {
+    char *end;
+
+    errno = 0;
+    *lo = strtoull(str, &end, 0);
+    if (errno || end == str)
+        return -1;
+    *hi = *lo;
+    if (*end == '-') {
+        str = end + 1;
+        *hi = strtoull(str, &end, 0);
+        if (errno || end == str)
+            return -1;
+    }
+    return *end ? -1 : 0;
+}
+
+
+int main(int argc, char **argv) {
+    struct evr_file f;
+    struct index_file ix;
+    struct matches m;
+    uint64_t lo, hi;
+    int cmd = -1;
+    int kind;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c':
+            cmd = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+
+    if (argc - optind != 3) {
+        fprintf(stderr, "Usage: %s [-c sd_command] [sorted_filename] type|row|sector [value[-value]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    for (kind=0; kind<INDEX_KINDS; kind++)
+        if (!strcmp(argv[optind + 1], kind_names[kind]))
+            break;
+    if (kind == INDEX_KINDS) {
+        fprintf(stderr, "Unknown index %s\n", argv[optind + 1]);
+        return 1;
+    }
+    if (parse_range(argv[optind + 2], &lo, &hi)) {
+        fprintf(stderr, "Bad value %s\n", argv[optind + 2]);
+        return 1;
+    }
+
+    if (evr_open(&f, argv[optind]))
+        return 2;
+    if (index_open(&ix, argv[optind]))
+        return 2;
+
+    memset(&m, 0, sizeof(m));
+    if (index_lookup(&ix, kind, lo, hi, add_match, &m))
+        return 3;
+
+    // Positions in the jump table are in order of time
+    qsort(m.list, m.count, sizeof(*m.list), match_cmp);
+
+    for (i=0; i<m.count; i++) {
+        struct evr_event e;
+        struct evr_sd_multi multi;
+        struct evr_sd_cmd sd;
+        uint8_t type;
+
+        if (evr_event(&f, m.list[i].pos, &e)) {
+            fprintf(stderr, "Index doesn't match %s\n", argv[optind]);
+            return 3;
+        }
+        type = evr_type(&e);
+
+        if (cmd >= 0) {
+            if (!evr_as_sd_cmd(&e, &sd)) {
+                if (sd.cmd != cmd)
+                    continue;
+            }
+            else if (!evr_as_sd_multi(&e, &multi)) {
+                if (multi.cmd != cmd)
+                    continue;
+            }
+            else
+                continue;
+        }
+
+        printf("%llu %u.%09u-%u.%09u type %02x %s 0x%llx\n",
+               (unsigned long long)m.list[i].pos,
+               evr_sec_start(&e), evr_nsec_start(&e),
+               evr_sec_end(&e), evr_nsec_end(&e),
+               type, kind_names[kind], (unsigned long long)m.list[i].key);
+    }
+
+    free(m.list);
+    index_close(&ix);
+    evr_close(&f);
+    return 0;
+}
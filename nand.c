@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include "packet-struct.h"
 #include "state.h"
 
 enum control_pins {
@@ -71,3 +72,15 @@ uint8_t nand_cs(uint8_t ctrl) {
 uint8_t nand_rb(uint8_t ctrl) {
     return ctrl&NAND_RB;
 }
+
+// How many of the first count cycles in a and b have the same data and pins
+int nand_cycles_match(const struct pkt *a, const struct pkt *b, int count) {
+    int matches = 0;
+    int i;
+
+    for (i=0; i<count; i++)
+        if (a[i].data.nand_cycle.data == b[i].data.nand_cycle.data
+         && a[i].data.nand_cycle.control == b[i].data.nand_cycle.control)
+            matches++;
+    return matches;
+}
@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
 #include "packet-struct.h"
 #include "state.h"
 
@@ -53,3 +55,155 @@ int packet_write(struct state *st, struct pkt *pkt) {
 
     return write(st->out_fd, &cp, ntohs(cp.header.size));
 }
+
+
+#define WINDOW_PACKETS 64
+#define WINDOW_BUFFER (1024 * 1024)
+
+// Point the window at [start, end) of the input.  The buffers are kept
+// if the window was already set up.
+int packet_window_init(struct state *st, off_t start, off_t end) {
+    struct pkt_window *w = &st->window;
+
+    if (!w->pkts) {
+        w->pkts = malloc(WINDOW_PACKETS * sizeof(*w->pkts));
+        w->buf = malloc(WINDOW_BUFFER);
+        if (!w->pkts || !w->buf) {
+            perror("Couldn't allocate packet window");
+            return -1;
+        }
+    }
+    w->head = w->count = 0;
+    w->buf_pos = w->buf_len = 0;
+    w->file_pos = start;
+    w->file_end = end;
+    w->error = 0;
+    return 0;
+}
+
+void packet_window_free(struct state *st) {
+    free(st->window.pkts);
+    free(st->window.buf);
+    memset(&st->window, 0, sizeof(st->window));
+}
+
+// Top up the raw buffer, keeping whatever hasn't been decoded yet
+static int window_refill(struct pkt_window *w, int fd) {
+    int space;
+    int ret;
+
+    memmove(w->buf, w->buf + w->buf_pos, w->buf_len - w->buf_pos);
+    w->buf_len -= w->buf_pos;
+    w->buf_pos = 0;
+
+    space = WINDOW_BUFFER - w->buf_len;
+    if (w->file_end >= 0 && w->file_end - w->file_pos < space)
+        space = w->file_end - w->file_pos;
+    if (space <= 0)
+        return -2;
+
+    if (w->read) {
+        ret = w->read(w->read_arg, w->buf + w->buf_len, space);
+        if (ret < 0)
+            return -1;
+    }
+    else {
+        ret = pread(fd, w->buf + w->buf_len, space, w->file_pos);
+        if (ret < 0) {
+            perror("Couldn't read packets");
+            return -1;
+        }
+    }
+    if (ret == 0)
+        return -2;
+
+    w->buf_len += ret;
+    w->file_pos += ret;
+    return 0;
+}
+
+// True if the window passes through packets of this type
+int packet_window_wants(struct pkt_window *w, uint8_t type) {
+    return !w->types || (type < 32 && (w->types & (1 << type)));
+}
+
+// Decode one more packet onto the end of the ring, skipping over any
+// the window doesn't want
+static int window_decode(struct state *st) {
+    struct pkt_window *w = &st->window;
+    struct pkt *pkt;
+    uint16_t size;
+    int ret;
+
+    while (1) {
+        while (w->buf_len - w->buf_pos < sizeof(pkt->header))
+            if ((ret = window_refill(w, st->fd)))
+                return ret;
+
+        memcpy(&size, w->buf + w->buf_pos + offsetof(struct pkt_header, size),
+               sizeof(size));
+        size = ntohs(size);
+        if (size < sizeof(pkt->header) || size > sizeof(*pkt)) {
+            fprintf(stderr, "Bad packet size %d\n", size);
+            return -1;
+        }
+
+        while (w->buf_len - w->buf_pos < size)
+            if ((ret = window_refill(w, st->fd)))
+                return ret;
+
+        if (packet_window_wants(w, w->buf[w->buf_pos]))
+            break;
+        w->buf_pos += size;
+    }
+
+    pkt = &w->pkts[(w->head + w->count) % WINDOW_PACKETS];
+    memcpy(pkt, w->buf + w->buf_pos, size);
+    w->buf_pos += size;
+    w->count++;
+
+    pkt->header.sec = ntohl(pkt->header.sec);
+    pkt->header.nsec = ntohl(pkt->header.nsec);
+    pkt->header.size = size;
+    if (pkt->header.type == PACKET_NAND_CYCLE)
+        pkt->data.nand_cycle.data = nand_unscramble_byte(pkt->data.nand_cycle.data);
+    return 0;
+}
+
+/* Look at the nth upcoming packet without consuming it.  The pointer
+ * stays valid until that packet is consumed.  Returns NULL at the end of
+ * the input, or on an error, after which the window's error is set and
+ * it gives nothing more.
+ */
+struct pkt *packet_peek(struct state *st, int n) {
+    struct pkt_window *w = &st->window;
+    int ret;
+
+    if (n >= WINDOW_PACKETS) {
+        fprintf(stderr, "Can't look %d packets ahead\n", n);
+        w->error = 1;
+        return NULL;
+    }
+
+    while (w->count <= n) {
+        if (w->error)
+            return NULL;
+        if ((ret = window_decode(st))) {
+            if (ret != -2)
+                w->error = 1;
+            return NULL;
+        }
+    }
+
+    return &w->pkts[(w->head + n) % WINDOW_PACKETS];
+}
+
+int packet_consume(struct state *st, int n) {
+    struct pkt_window *w = &st->window;
+
+    if (n > w->count)
+        n = w->count;
+    w->head = (w->head + n) % WINDOW_PACKETS;
+    w->count -= n;
+    return n;
+}
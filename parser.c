@@ -1,114 +1,1100 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
 #include "packet-struct.h"
 #include "state.h"
 
-#define SKIP_AMOUNT 25
-
-static char *types[] = {
-        "PACKET_UNKNOWN",
-        "PACKET_ERROR",
-        "PACKET_NAND_CYCLE",
-        "PACKET_SD_DATA",
-        "PACKET_SD_CMD_ARG",
-        "PACKET_SD_RESPONSE",
-        "PACKET_SD_CID",
-        "PACKET_SD_CSD",
-        "PACKET_BUFFER_OFFSET",
-        "PACKET_BUFFER_CONTENTS",
-        "PACKET_COMMAND",
-        "PACKET_RESET",
-        "PACKET_BUFFER_DRAIN",
-        "PACKET_HELLO",
+/* Dumps a capture as text, CSV or JSON (one object per line), optionally
+ * only the packets of some types, in a window of time or in a range of
+ * file offsets.  The capture is mapped, and each packet is formatted
+ * straight into a large output buffer.  With -j, the file is cut into
+ * byte ranges on packet boundaries, and each range is formatted by its own
+ * thread; the output is the same as with one thread.
+ *
+ * --stats counts instead of dumping: packets by type, NAND and SD
+ * commands, sync points, errors, and the gaps between packets.
+ */
+
+#define OUT_BUFFER (4 * 1024 * 1024)
+
+// Room to leave in the output buffer for one packet, at most
+#define OUT_SLACK (16 * 1024)
+
+#define MAX_THREADS 64
+
+// Packets longer than this (a 16-byte line of a hex dump) are dumped in
+// full in text, rather than as a field
+#define INLINE_DATA 16
+
+enum dump_format {
+    FMT_TEXT,
+    FMT_CSV,
+    FMT_JSON,
+};
+
+static const char *type_names[] = {
+    [PACKET_UNKNOWN]            = "unknown",
+    [PACKET_ERROR]              = "error",
+    [PACKET_NAND_CYCLE]         = "nand",
+    [PACKET_SD_DATA]            = "sd_data",
+    [PACKET_SD_CMD_ARG]         = "sd_cmd_arg",
+    [PACKET_SD_RESPONSE]        = "sd_response",
+    [PACKET_SD_CID]             = "sd_cid",
+    [PACKET_SD_CSD]             = "sd_csd",
+    [PACKET_BUFFER_OFFSET]      = "buffer_offset",
+    [PACKET_BUFFER_CONTENTS]    = "buffer_contents",
+    [PACKET_COMMAND]            = "command",
+    [PACKET_RESET]              = "reset",
+    [PACKET_BUFFER_DRAIN]       = "buffer_drain",
+    [PACKET_HELLO]              = "hello",
+};
+#define PACKET_TYPES (sizeof(type_names) / sizeof(*type_names))
+
+struct filter {
+    uint32_t types;                     // One bit per type; 0 for all
+    uint64_t time_start, time_end;      // sec << 32 | nsec, end excluded
+};
+
+// Formatted output, on its way to fd
+struct out {
+    int fd;
+    char *buf;
+    size_t len;
+
+    // Per packet: whether a field or the data has been written yet
+    int fields;
+    int data;
 };
 
-struct pkt packet_buffer[SKIP_AMOUNT];
-int packet_buffer_offset = 0;
+/* Statistics, for --stats.  Each job counts its own range, and the counts
+ * are added up in order afterwards.
+ */
+struct stats {
+    uint64_t packets, bytes;
+    uint64_t types[256];
+    uint64_t nand_cmds[256];        // NAND command cycles, by opcode
+    uint64_t sd_cmds[128];          // CMD0-63, then ACMD0-63
+    uint64_t gaps[65];              // Time between packets, by bit length in ns
+    uint64_t backwards;             // Packets earlier than the one before
+    uint64_t max_gap, max_gap_offset;
+    uint64_t hellos, ib_syncs;      // Sync points, as the joiner sees them
+    uint64_t errors, overflows;
 
-enum prog_state {
-    ST_DRAINING,
-    ST_RUNNING,
-    ST_STARTING,
-    ST_JOINING,
-    ST_DONE,
-    ST_OVERFLOWED,
+    // In nanoseconds
+    uint64_t first_time, last_time;
+    uint64_t first_offset;
+    uint64_t min_time, max_time;
+
+    // The first and last SD commands, or -1, for telling ACMDs across jobs
+    int first_sd_cmd, last_sd_cmd;
+};
+
+// One thread's share of the capture
+struct dump_job {
+    pthread_t thread;
+    uint64_t start, end;                // Whole packets, by file offset
+    struct out out;
+    struct stats stats;
+    int ret;
 };
 
-static int print_hex(uint8_t *block, int count) {
-        int offset;
-        int byte;
-        for (offset=0; offset<count; offset+=16) {
-                printf("%08x ", offset);
-                for (byte=0; byte<16; byte++) {
-                        if (byte == 8)
-                                printf(" ");
-                        printf(" %02x", block[offset+byte]&0xff);
-                }
-
-                printf("  |");
-                for (byte=0; byte<16; byte++)
-                        printf("%c", isprint(block[offset+byte])?block[offset+byte]:'.');
-                printf("|\n");
+static const uint8_t *in_map;
+static uint64_t in_size;
+static int format = FMT_TEXT;
+static int stats_mode;
+static struct filter filter;
+static uint8_t unscramble[256];
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            perror("Couldn't write output");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int out_flush(struct out *o) {
+    if (write_all(o->fd, o->buf, o->len))
+        return -1;
+    o->len = 0;
+    return 0;
+}
+
+
+/* Formatting.  Each of these appends to the buffer, which is flushed
+ * before each packet unless it has OUT_SLACK bytes free.
+ */
+
+static inline void put_char(struct out *o, char c) {
+    o->buf[o->len++] = c;
+}
+
+static inline void put_str(struct out *o, const char *s) {
+    while (*s)
+        o->buf[o->len++] = *s++;
+}
+
+static inline void put_hex8(struct out *o, uint8_t v) {
+    o->buf[o->len++] = hex_digits[v >> 4];
+    o->buf[o->len++] = hex_digits[v & 15];
+}
+
+static inline void put_hex32(struct out *o, uint32_t v) {
+    int shift;
+
+    for (shift=28; shift>=0; shift-=4)
+        o->buf[o->len++] = hex_digits[(v >> shift) & 15];
+}
+
+static inline void put_dec(struct out *o, uint64_t v) {
+    char tmp[20];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n)
+        o->buf[o->len++] = tmp[--n];
+}
+
+// Nanoseconds, always nine digits
+static inline void put_nsec(struct out *o, uint32_t v) {
+    int i;
+
+    for (i=8; i>=0; i--) {
+        o->buf[o->len + i] = '0' + v % 10;
+        v /= 10;
+    }
+    o->len += 9;
+}
+
+// The same layout as hexdump -C
+static void put_hexdump(struct out *o, const uint8_t *block, int count) {
+    int offset;
+    int byte;
+
+    for (offset=0; offset<count; offset+=16) {
+        put_hex32(o, offset);
+        put_char(o, ' ');
+        for (byte=0; byte<16; byte++) {
+            if (byte == 8)
+                put_char(o, ' ');
+            put_char(o, ' ');
+            if (offset + byte < count)
+                put_hex8(o, block[offset+byte]);
+            else
+                put_str(o, "  ");
         }
+        put_str(o, "  |");
+        for (byte=0; byte<16 && offset+byte<count; byte++)
+            put_char(o, isprint(block[offset+byte]) ? block[offset+byte] : '.');
+        put_str(o, "|\n");
+    }
+}
+
+// A string from the capture, which may not be terminated or printable
+static void put_text(struct out *o, const uint8_t *s, int len) {
+    int i;
+
+    for (i=0; i<len && s[i]; i++) {
+        uint8_t c = s[i];
+        if (format == FMT_JSON && (c == '"' || c == '\\')) {
+            put_char(o, '\\');
+            put_char(o, c);
+        }
+        else if (format == FMT_CSV && c == '"') {
+            put_str(o, "\"\"");
+        }
+        else if (isprint(c)) {
+            put_char(o, c);
+        }
+        else if (format == FMT_JSON) {
+            put_str(o, "\\u00");
+            put_hex8(o, c);
+        }
+        else {
+            put_char(o, '.');
+        }
+    }
+}
+
+/* A packet is written as begin, any number of fields, at most one lot of
+ * data, and end:
+ *
+ *   text:  time offset type name=value ...    (long data as a hex dump)
+ *   CSV:   time,offset,type,"name=value ...",data
+ *   JSON:  {"time":...,"offset":...,"type":"...","name":value,...}
+ */
+static void put_begin(struct out *o, uint32_t sec, uint32_t nsec,
+                      uint64_t offset, uint8_t type) {
+    const char *name = type < PACKET_TYPES ? type_names[type] : NULL;
+
+    o->fields = 0;
+    o->data = 0;
+    if (format == FMT_JSON)
+        put_str(o, "{\"time\":");
+    put_dec(o, sec);
+    put_char(o, '.');
+    put_nsec(o, nsec);
+
+    if (format == FMT_JSON)
+        put_str(o, ",\"offset\":");
+    else
+        put_char(o, format == FMT_CSV ? ',' : ' ');
+    put_dec(o, offset);
+
+    if (format == FMT_JSON)
+        put_str(o, ",\"type\":\"");
+    else
+        put_char(o, format == FMT_CSV ? ',' : ' ');
+    if (name)
+        put_str(o, name);
+    else
+        put_dec(o, type);
+    if (format == FMT_JSON)
+        put_char(o, '"');
+    else if (format == FMT_CSV)
+        put_str(o, ",\"");
+}
+
+static void put_name(struct out *o, const char *name) {
+    if (format == FMT_JSON) {
+        put_str(o, ",\"");
+        put_str(o, name);
+        put_str(o, "\":");
+    }
+    else {
+        if (format == FMT_TEXT || o->fields)
+            put_char(o, ' ');
+        put_str(o, name);
+        put_char(o, '=');
+    }
+    o->fields++;
+}
+
+// A number; in hex in text and CSV if asked, but always decimal in JSON
+static void put_field(struct out *o, const char *name, uint32_t v, int hex) {
+    put_name(o, name);
+    if (hex && format != FMT_JSON) {
+        put_str(o, "0x");
+        if (v > 0xff)
+            put_hex32(o, v);
+        else
+            put_hex8(o, v);
+    }
+    else {
+        put_dec(o, v);
+    }
+}
+
+static void put_field_str(struct out *o, const char *name,
+                          const uint8_t *s, int len) {
+    put_name(o, name);
+    if (format == FMT_JSON)
+        put_char(o, '"');
+    put_text(o, s, len);
+    if (format == FMT_JSON)
+        put_char(o, '"');
+}
+
+static void put_data(struct out *o, const uint8_t *data, int len) {
+    int i;
+
+    if (format == FMT_TEXT && len > INLINE_DATA) {
+        o->data = 1;
+        put_char(o, '\n');
+        put_hexdump(o, data, len);
+        return;
+    }
+
+    if (format == FMT_CSV) {
+        put_str(o, "\",");
+        o->data = 1;
+    }
+    else {
+        put_name(o, "data");
+        if (format == FMT_JSON)
+            put_char(o, '"');
+    }
+    for (i=0; i<len; i++)
+        put_hex8(o, data[i]);
+    if (format == FMT_JSON)
+        put_char(o, '"');
+}
+
+static void put_end(struct out *o) {
+    if (format == FMT_JSON)
+        put_str(o, "}\n");
+    else if (format == FMT_CSV && !o->data)
+        put_str(o, "\",\n");
+    else if (!o->data)
+        put_char(o, '\n');
+    else if (format == FMT_CSV)
+        put_char(o, '\n');
+}
+
+
+static inline uint32_t get_be32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+// The size of the packet at offset, or 0 if it's damaged or cut short
+static inline uint16_t packet_size(uint64_t offset) {
+    uint16_t size;
+
+    if (in_size - offset < sizeof(struct pkt_header))
         return 0;
+    memcpy(&size, in_map + offset + offsetof(struct pkt_header, size),
+           sizeof(size));
+    size = ntohs(size);
+    if (size < sizeof(struct pkt_header)
+     || size > sizeof(struct pkt)
+     || size > in_size - offset)
+        return 0;
+    return size;
+}
+
+// Payload fields are in host order, as the joiner and grouper treat them
+static inline uint32_t get_u32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
+static inline uint16_t get_u16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Format one packet, whose payload is len bytes at p
+static void dump_packet(struct out *o, uint8_t type, const uint8_t *p, int len) {
+    switch (type) {
+    case PACKET_ERROR:
+        if (len < offsetof(struct pkt_error, message))
+            break;
+        put_field(o, "subsystem", p[offsetof(struct pkt_error, subsystem)], 0);
+        put_field(o, "code", p[offsetof(struct pkt_error, code)], 0);
+        put_field(o, "arg", get_u16(p + offsetof(struct pkt_error, arg)), 0);
+        put_field_str(o, "message", p + offsetof(struct pkt_error, message),
+                      len - offsetof(struct pkt_error, message));
+        return;
+
+    case PACKET_NAND_CYCLE: {
+        uint8_t ctrl;
+        uint8_t pins[6];
+
+        if (len < 2)
+            break;
+        ctrl = p[offsetof(struct pkt_nand_cycle, control)];
+        pins[0] = nand_ale(ctrl) ? 'A' : '-';
+        pins[1] = nand_cle(ctrl) ? 'C' : '-';
+        pins[2] = nand_we(ctrl) ? 'W' : '-';
+        pins[3] = nand_re(ctrl) ? 'R' : '-';
+        pins[4] = nand_cs(ctrl) ? 'S' : '-';
+        pins[5] = nand_rb(ctrl) ? 'B' : '-';
+        put_field(o, "data", unscramble[p[offsetof(struct pkt_nand_cycle, data)]], 1);
+        put_field(o, "control", ctrl, 1);
+        put_field_str(o, "pins", pins, sizeof(pins));
+        return;
+    }
+
+    case PACKET_SD_CMD_ARG:
+        if (len < sizeof(struct pkt_sd_cmd_arg))
+            break;
+        put_field(o, "reg", p[offsetof(struct pkt_sd_cmd_arg, reg)], 0);
+        put_field(o, "val", p[offsetof(struct pkt_sd_cmd_arg, val)], 1);
+        return;
+
+    case PACKET_SD_RESPONSE:
+        if (len < sizeof(struct pkt_sd_response))
+            break;
+        put_field(o, "byte", p[0], 1);
+        return;
+
+    case PACKET_BUFFER_OFFSET:
+        if (len < sizeof(struct pkt_buffer_offset))
+            break;
+        put_field(o, "number", p[offsetof(struct pkt_buffer_offset, number)], 0);
+        put_field(o, "offset", get_u32(p + offsetof(struct pkt_buffer_offset, offset)), 0);
+        return;
+
+    case PACKET_BUFFER_CONTENTS:
+        if (len < offsetof(struct pkt_buffer_contents, contents))
+            break;
+        put_field(o, "number", p[offsetof(struct pkt_buffer_contents, number)], 0);
+        put_data(o, p + offsetof(struct pkt_buffer_contents, contents),
+                 len - offsetof(struct pkt_buffer_contents, contents));
+        return;
+
+    case PACKET_COMMAND:
+        if (len < sizeof(struct pkt_command))
+            break;
+        put_field_str(o, "cmd", p + offsetof(struct pkt_command, cmd), 2);
+        put_field(o, "arg", get_u32(p + offsetof(struct pkt_command, arg)), 0);
+        put_field(o, "start_stop", p[offsetof(struct pkt_command, start_stop)], 0);
+        return;
+
+    case PACKET_RESET:
+    case PACKET_HELLO:
+        if (len < 1)
+            break;
+        put_field(o, "version", p[0], 0);
+        return;
+
+    case PACKET_BUFFER_DRAIN:
+        if (len < sizeof(struct pkt_buffer_drain))
+            break;
+        put_field(o, "start_stop", p[0], 0);
+        return;
+    }
+
+    // SD data, CID and CSD, and anything unknown or too short
+    if (len)
+        put_data(o, p, len);
+}
+
+// Whether a packet gets through -t and -T
+static inline int packet_wanted(uint8_t type, uint32_t sec, uint32_t nsec) {
+    if (filter.types && (type >= 32 || !(filter.types & (1 << type))))
+        return 0;
+    if (filter.time_end) {
+        uint64_t time = ((uint64_t)sec << 32) | nsec;
+        if (time < filter.time_start || time >= filter.time_end)
+            return 0;
+    }
+    return 1;
+}
+
+static int dump_range(struct out *o, uint64_t start, uint64_t end) {
+    uint64_t offset;
+    uint16_t size;
+
+    for (offset=start; offset<end; offset+=size) {
+        const uint8_t *pkt = in_map + offset;
+        uint8_t type = pkt[offsetof(struct pkt_header, type)];
+        uint32_t sec, nsec;
+
+        size = packet_size(offset);
+        if (!size) {
+            fprintf(stderr, "Bad packet at offset %llu\n",
+                    (unsigned long long)offset);
+            out_flush(o);
+            return -1;
+        }
+
+        sec = get_be32(pkt + offsetof(struct pkt_header, sec));
+        nsec = get_be32(pkt + offsetof(struct pkt_header, nsec));
+        if (!packet_wanted(type, sec, nsec))
+            continue;
+
+        if (o->len + OUT_SLACK > OUT_BUFFER && out_flush(o))
+            return -1;
+        put_begin(o, sec, nsec, offset, type);
+        dump_packet(o, type, pkt + sizeof(struct pkt_header),
+                    size - sizeof(struct pkt_header));
+        put_end(o);
+    }
+    return out_flush(o);
+}
+
+static void stats_init(struct stats *s) {
+    memset(s, 0, sizeof(*s));
+    s->min_time = UINT64_MAX;
+    s->first_sd_cmd = s->last_sd_cmd = -1;
+}
+
+static inline void stats_gap(struct stats *s, uint64_t from, uint64_t to,
+                             uint64_t offset) {
+    uint64_t gap;
+
+    if (to < from) {
+        s->backwards++;
+        return;
+    }
+    gap = to - from;
+    s->gaps[gap ? 64 - __builtin_clzll(gap) : 0]++;
+    if (gap > s->max_gap) {
+        s->max_gap = gap;
+        s->max_gap_offset = offset;
+    }
+}
+
+static inline void stats_sd_cmd(struct stats *s, uint8_t val) {
+    int cmd = val & 0x3f;
+
+    // CMD55 makes the next command an application command
+    if (s->last_sd_cmd == 55)
+        cmd += 64;
+    s->sd_cmds[cmd]++;
+    if (s->first_sd_cmd == -1)
+        s->first_sd_cmd = cmd;
+    s->last_sd_cmd = cmd;
+}
+
+static int stats_range(struct stats *s, uint64_t start, uint64_t end) {
+    uint64_t offset;
+    uint16_t size;
+
+    for (offset=start; offset<end; offset+=size) {
+        const uint8_t *pkt = in_map + offset;
+        const uint8_t *p = pkt + sizeof(struct pkt_header);
+        uint8_t type = pkt[offsetof(struct pkt_header, type)];
+        uint32_t sec, nsec;
+        uint64_t time;
+        int len;
+
+        size = packet_size(offset);
+        if (!size) {
+            fprintf(stderr, "Bad packet at offset %llu\n",
+                    (unsigned long long)offset);
+            return -1;
+        }
+        sec = get_be32(pkt + offsetof(struct pkt_header, sec));
+        nsec = get_be32(pkt + offsetof(struct pkt_header, nsec));
+        if (!packet_wanted(type, sec, nsec))
+            continue;
+        len = size - sizeof(struct pkt_header);
+
+        time = sec * 1000000000ULL + nsec;
+        if (s->packets)
+            stats_gap(s, s->last_time, time, offset);
+        else {
+            s->first_time = time;
+            s->first_offset = offset;
+        }
+        s->last_time = time;
+        if (time < s->min_time)
+            s->min_time = time;
+        if (time > s->max_time)
+            s->max_time = time;
+
+        s->packets++;
+        s->bytes += size;
+        s->types[type]++;
+
+        switch (type) {
+        case PACKET_NAND_CYCLE:
+            if (len >= 2 && nand_cle(p[offsetof(struct pkt_nand_cycle, control)]))
+                s->nand_cmds[unscramble[p[offsetof(struct pkt_nand_cycle, data)]]]++;
+            break;
+
+        case PACKET_SD_CMD_ARG:
+            if (len >= sizeof(struct pkt_sd_cmd_arg)
+             && p[offsetof(struct pkt_sd_cmd_arg, reg)] == 0)
+                stats_sd_cmd(s, p[offsetof(struct pkt_sd_cmd_arg, val)]);
+            break;
+
+        case PACKET_HELLO:
+            s->hellos++;
+            break;
+
+        case PACKET_COMMAND: {
+            uint32_t arg;
+
+            if (len < sizeof(struct pkt_command)
+             || p[offsetof(struct pkt_command, cmd)] != 'i'
+             || p[offsetof(struct pkt_command, cmd) + 1] != 'b')
+                break;
+            arg = get_u32(p + offsetof(struct pkt_command, arg));
+            if (arg == 0 || arg == 4026531839U)
+                s->ib_syncs++;
+            break;
+        }
+
+        case PACKET_ERROR:
+            s->errors++;
+            if (len >= 2
+             && p[offsetof(struct pkt_error, subsystem)] == SUBSYS_FPGA
+             && p[offsetof(struct pkt_error, code)] == FPGA_ERR_OVERFLOW)
+                s->overflows++;
+            break;
+        }
+    }
+    return 0;
+}
+
+// Add the counts for the range following total's
+static void stats_add(struct stats *total, struct stats *s) {
+    int i;
+
+    if (!s->packets)
+        return;
+
+    // The first command in s may have followed a CMD55 at the end of total
+    if (total->last_sd_cmd == 55 && s->first_sd_cmd >= 0
+     && s->first_sd_cmd < 64) {
+        s->sd_cmds[s->first_sd_cmd]--;
+        s->sd_cmds[s->first_sd_cmd + 64]++;
+    }
+    if (s->last_sd_cmd >= 0)
+        total->last_sd_cmd = s->last_sd_cmd;
+
+    if (total->packets)
+        stats_gap(total, total->last_time, s->first_time, s->first_offset);
+    else {
+        total->first_time = s->first_time;
+        total->first_offset = s->first_offset;
+    }
+    total->last_time = s->last_time;
+    if (s->min_time < total->min_time)
+        total->min_time = s->min_time;
+    if (s->max_time > total->max_time)
+        total->max_time = s->max_time;
+    if (s->max_gap > total->max_gap) {
+        total->max_gap = s->max_gap;
+        total->max_gap_offset = s->max_gap_offset;
+    }
+
+    total->packets += s->packets;
+    total->bytes += s->bytes;
+    for (i=0; i<256; i++)
+        total->types[i] += s->types[i];
+    for (i=0; i<256; i++)
+        total->nand_cmds[i] += s->nand_cmds[i];
+    for (i=0; i<128; i++)
+        total->sd_cmds[i] += s->sd_cmds[i];
+    for (i=0; i<65; i++)
+        total->gaps[i] += s->gaps[i];
+    total->backwards += s->backwards;
+    total->hellos += s->hellos;
+    total->ib_syncs += s->ib_syncs;
+    total->errors += s->errors;
+    total->overflows += s->overflows;
+}
+
+static void print_time(uint64_t ns) {
+    printf("%llu.%09llu", (unsigned long long)(ns / 1000000000),
+           (unsigned long long)(ns % 1000000000));
+}
+
+// A count of nanoseconds, in the largest unit that keeps it whole-ish
+static void print_span(uint64_t ns) {
+    if (ns >= 1000000000)
+        printf("%.3f s", ns / 1e9);
+    else if (ns >= 1000000)
+        printf("%.3f ms", ns / 1e6);
+    else if (ns >= 1000)
+        printf("%.3f us", ns / 1e3);
+    else
+        printf("%llu ns", (unsigned long long)ns);
+}
+
+static void stats_print(struct stats *s) {
+    int i, n;
+
+    printf("Packets:     %llu (%llu bytes)\n",
+           (unsigned long long)s->packets, (unsigned long long)s->bytes);
+    if (!s->packets)
+        return;
+    printf("Time:        ");
+    print_time(s->min_time);
+    printf(" to ");
+    print_time(s->max_time);
+    printf(" (");
+    print_span(s->max_time - s->min_time);
+    printf(")\n");
+    printf("Sync points: %llu (%llu hello, %llu ib)\n",
+           (unsigned long long)(s->hellos + s->ib_syncs),
+           (unsigned long long)s->hellos, (unsigned long long)s->ib_syncs);
+    printf("Errors:      %llu (%llu overflows)\n",
+           (unsigned long long)s->errors, (unsigned long long)s->overflows);
+
+    printf("\nPacket types:\n");
+    for (i=0; i<256; i++) {
+        if (!s->types[i])
+            continue;
+        if (i < PACKET_TYPES)
+            printf("  %-16s %12llu\n", type_names[i],
+                   (unsigned long long)s->types[i]);
+        else
+            printf("  %-16d %12llu\n", i, (unsigned long long)s->types[i]);
+    }
+
+    printf("\nNAND commands:\n");
+    for (i=0, n=0; i<256; i++) {
+        if (!s->nand_cmds[i])
+            continue;
+        printf("  %02x %10llu%s", i, (unsigned long long)s->nand_cmds[i],
+               ++n % 4 ? "" : "\n");
+    }
+    if (n % 4)
+        printf("\n");
+
+    printf("\nSD commands:\n");
+    for (i=0, n=0; i<128; i++) {
+        char name[8];
+
+        if (!s->sd_cmds[i])
+            continue;
+        snprintf(name, sizeof(name), "%s%d", i < 64 ? "CMD" : "ACMD", i & 63);
+        printf("  %-6s %10llu%s", name, (unsigned long long)s->sd_cmds[i],
+               ++n % 4 ? "" : "\n");
+    }
+    if (n % 4)
+        printf("\n");
+
+    printf("\nGaps between packets:\n");
+    for (i=0; i<65; i++) {
+        if (!s->gaps[i])
+            continue;
+        printf("  ");
+        if (i)
+            print_span(1ULL << (i - 1));
+        else
+            printf("0 ns");
+        printf(" and up\t%12llu\n", (unsigned long long)s->gaps[i]);
+    }
+    if (s->backwards)
+        printf("  backwards\t%12llu\n", (unsigned long long)s->backwards);
+    printf("  Largest: ");
+    print_span(s->max_gap);
+    printf(", before the packet at offset %llu\n",
+           (unsigned long long)s->max_gap_offset);
+}
+
+
+static void *dump_job(void *arg) {
+    struct dump_job *job = arg;
+
+    if (stats_mode)
+        job->ret = stats_range(&job->stats, job->start, job->end);
+    else
+        job->ret = dump_range(&job->out, job->start, job->end);
+    return NULL;
+}
+
+// Copy a job's output, held in a temporary file, to fd
+static int copy_out(int from, int fd, char *buf) {
+    off_t pos = 0;
+    ssize_t n;
+
+    while ((n = pread(from, buf, OUT_BUFFER, pos)) > 0) {
+        if (write_all(fd, buf, n))
+            return -1;
+        pos += n;
+    }
+    if (n < 0) {
+        perror("Couldn't read back output");
+        return -1;
+    }
+    return 0;
+}
+
+static int open_temp(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/parser-XXXXXX", dir ? dir : "/tmp");
+    fd = mkstemp(path);
+    if (fd == -1) {
+        perror("Couldn't create temporary output");
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+/* Split [start, end) among the jobs on packet boundaries, at roughly
+ * even byte counts.  When dumping, the first job writes straight to
+ * out_fd, and the rest to temporary files that are copied out after it,
+ * in order.  With --stats, the jobs' counts are added up and printed.
+ */
+static int dump(int out_fd, uint64_t start, uint64_t end, int threads) {
+    struct dump_job *jobs;
+    struct stats total;
+    uint64_t offset = start;
+    int ret = 0;
+    int i;
+
+    jobs = calloc(threads, sizeof(*jobs));
+    if (!jobs) {
+        perror("Couldn't allocate jobs");
+        return -1;
+    }
+    for (i=0; i<threads; i++) {
+        uint64_t target = start + (end - start) / threads * (i + 1);
+
+        jobs[i].start = offset;
+        if (i == threads - 1)
+            target = end;
+        while (offset < target) {
+            uint16_t size = packet_size(offset);
+            if (!size)
+                break;
+            offset += size;
+        }
+        jobs[i].end = offset;
+
+        if (stats_mode) {
+            stats_init(&jobs[i].stats);
+            continue;
+        }
+        jobs[i].out.buf = malloc(OUT_BUFFER);
+        if (!jobs[i].out.buf) {
+            perror("Couldn't allocate output buffer");
+            return -1;
+        }
+        jobs[i].out.fd = i ? open_temp() : out_fd;
+        if (jobs[i].out.fd == -1)
+            return -1;
+    }
+    // A damaged packet stops the last job, which reports it
+    jobs[threads - 1].end = end;
+
+    if (threads == 1) {
+        dump_job(&jobs[0]);
+        ret = jobs[0].ret;
+    }
+    else {
+        for (i=0; i<threads; i++) {
+            if (pthread_create(&jobs[i].thread, NULL, dump_job, &jobs[i])) {
+                perror("Couldn't start dump thread");
+                return -1;
+            }
+        }
+    }
+
+    stats_init(&total);
+    for (i=0; i<threads; i++) {
+        if (threads > 1)
+            pthread_join(jobs[i].thread, NULL);
+        // A job stopped by a bad packet has still flushed everything before
+        // it, which goes out as it would without -j
+        if (!stats_mode && !ret && i
+         && copy_out(jobs[i].out.fd, out_fd, jobs[i].out.buf))
+            ret = -1;
+        if (!ret && jobs[i].ret)
+            ret = -1;
+        if (stats_mode) {
+            stats_add(&total, &jobs[i].stats);
+            continue;
+        }
+        if (i)
+            close(jobs[i].out.fd);
+        free(jobs[i].out.buf);
+    }
+    if (stats_mode && !ret)
+        stats_print(&total);
+    free(jobs);
+    return ret;
+}
+
+
+static int parse_time(const char *str, char **endp, uint64_t *time) {
+    char *end;
+    unsigned long long sec;
+    uint32_t nsec = 0;
+    int digits = 0;
+
+    errno = 0;
+    sec = strtoull(str, &end, 10);
+    if (errno || end == str || sec > UINT32_MAX)
+        return -1;
+    if (*end == '.') {
+        for (end++; *end >= '0' && *end <= '9'; end++) {
+            if (digits++ < 9)
+                nsec = nsec * 10 + (*end - '0');
+        }
+        for (; digits < 9; digits++)
+            nsec *= 10;
+    }
+
+    *endp = end;
+    *time = ((uint64_t)sec << 32) | nsec;
+    return 0;
+}
+
+// "start-end", "start-" or "start"; end is left alone if not given
+static int parse_time_range(const char *str, uint64_t *start, uint64_t *end) {
+    char *p;
+
+    if (parse_time(str, &p, start))
+        return -1;
+    if (*p == '-' && p[1] && parse_time(p + 1, &p, end))
+        return -1;
+    else if (*p == '-' && !p[1])
+        p++;
+    return *p ? -1 : 0;
+}
+
+static int parse_offset_range(const char *str, uint64_t *start, uint64_t *end) {
+    char *p;
+
+    errno = 0;
+    *start = strtoull(str, &p, 0);
+    if (errno || p == str)
+        return -1;
+    if (*p == '-' && p[1]) {
+        str = p + 1;
+        *end = strtoull(str, &p, 0);
+        if (errno || p == str)
+            return -1;
+    }
+    else if (*p == '-') {
+        p++;
+    }
+    return *p ? -1 : 0;
+}
+
+// A comma-separated list of type names or numbers
+static int parse_types(char *str, uint32_t *types) {
+    char *name;
+
+    for (name = strtok(str, ","); name; name = strtok(NULL, ",")) {
+        char *end;
+        unsigned long type;
+
+        for (type=0; type<PACKET_TYPES; type++)
+            if (!strcmp(name, type_names[type]))
+                break;
+        if (type == PACKET_TYPES) {
+            type = strtoul(name, &end, 0);
+            if (end == name || *end || type >= 32) {
+                fprintf(stderr, "Unknown packet type %s\n", name);
+                return -1;
+            }
+        }
+        *types |= 1 << type;
+    }
+    return 0;
+}
+
+static const struct option long_options[] = {
+    { "stats", no_argument, NULL, 's' },
+    { NULL, 0, NULL, 0 },
+};
+
 int main(int argc, char **argv) {
-    struct state state;
-    struct pkt pkt;
+    struct stat stat_buf;
+    uint64_t start = 0, end = UINT64_MAX;
+    uint64_t offset;
+    int threads = 1;
+    int fd;
+    int opt;
+    int i;
 
-    memset(&state, 0, sizeof(state));
+    filter.time_end = 0;
+    while ((opt = getopt_long(argc, argv, "f:t:T:b:j:s", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            stats_mode = 1;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "text"))
+                format = FMT_TEXT;
+            else if (!strcmp(optarg, "csv"))
+                format = FMT_CSV;
+            else if (!strcmp(optarg, "json"))
+                format = FMT_JSON;
+            else {
+                fprintf(stderr, "Unknown format %s\n", optarg);
+                argc = 0;
+            }
+            break;
+        case 't':
+            if (parse_types(optarg, &filter.types))
+                argc = 0;
+            break;
+        case 'T':
+            filter.time_end = UINT64_MAX;
+            if (parse_time_range(optarg, &filter.time_start, &filter.time_end)) {
+                fprintf(stderr, "Times must be seconds, with an optional fraction\n");
+                argc = 0;
+            }
+            break;
+        case 'b':
+            if (parse_offset_range(optarg, &start, &end)) {
+                fprintf(stderr, "Bad offset range %s\n", optarg);
+                argc = 0;
+            }
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 0);
+            if (threads < 1 || threads > MAX_THREADS) {
+                fprintf(stderr, "Threads must be 1 to %d\n", MAX_THREADS);
+                argc = 0;
+            }
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s [in_filename]\n", argv[0]);
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-f text|csv|json] [-t type,...] [-T start[-end]]\n"
+                        "       [-b start[-end]] [-j threads] [-s|--stats] [in_filename]\n",
+                argv[0]);
+        fprintf(stderr, "Types:");
+        for (i=0; i<PACKET_TYPES; i++)
+            fprintf(stderr, " %s", type_names[i]);
+        fprintf(stderr, "\n");
         return 1;
     }
 
-    state.fd = open(argv[1], O_RDONLY);
-    if (state.fd == -1) {
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1) {
         perror("Unable to open input file");
         return 2;
     }
+    if (fstat(fd, &stat_buf) == -1) {
+        perror("Couldn't stat input");
+        return 2;
+    }
+    in_size = stat_buf.st_size;
+    if (!in_size)
+        return 0;
+    in_map = mmap(NULL, in_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (in_map == MAP_FAILED) {
+        perror("Couldn't map input");
+        return 2;
+    }
+    madvise((void *)in_map, in_size, MADV_SEQUENTIAL);
 
-    state.is_logging = 0;
-    state.st = ST_RUNNING;
-    while (-1 != packet_get_next(&state, &pkt)) {
-        if (pkt.header.type == PACKET_NAND_CYCLE) {
-            nand_print(&state,
-		nand_unscramble_byte(pkt.data.nand_cycle.data),
-		pkt.data.nand_cycle.control);
-
-            if (state.st == ST_JOINING) {
-                if (state.skip_counter < SKIP_AMOUNT) {
-                    printf("Old: %02x %02x   New: %02x %02x\n",
-                            pkt.data.nand_cycle.data&0xff,
-                            pkt.data.nand_cycle.control&0xff,
-                            packet_buffer[packet_buffer_offset].data.nand_cycle.data&0xff,
-                            packet_buffer[packet_buffer_offset].data.nand_cycle.control&0xff);
-                    state.skip_counter++;
-                }
-            }
-            memcpy(&packet_buffer[packet_buffer_offset], &pkt, sizeof(pkt));
-            packet_buffer_offset++;
-            packet_buffer_offset %= SKIP_AMOUNT;
-        }
-	else if (pkt.header.type == PACKET_SD_DATA) {
-		print_hex(pkt.data.sd_data.data, 512);
-	}
-		
-        else {
-            printf("Packet: %s\n", types[pkt.header.type]);
-        }
+    for (i=0; i<256; i++)
+        unscramble[i] = nand_unscramble_byte(i);
 
-        if (state.is_logging) {
-            write(state.out_fd, &pkt, sizeof(pkt));
-        }
+    // Packets can only be found by walking from the start
+    for (offset=0; offset<start; ) {
+        uint16_t size = packet_size(offset);
+        if (!size)
+            break;
+        offset += size;
     }
+    if (end > in_size)
+        end = in_size;
+    if (offset >= end)
+        return 0;
 
+    if (format == FMT_CSV && !stats_mode
+     && write_all(STDOUT_FILENO, "time,offset,type,fields,data\n", 29))
+        return 3;
+    if (dump(STDOUT_FILENO, offset, end, threads))
+        return 3;
     return 0;
 }
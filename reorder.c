@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "state.h"
+#include "event-struct.h"
+
+/* Time-ordered grouper output (grouper -o).
+ * Events are written when they finish, so an SD command comes out when its
+ * response arrives, after NAND events that started later.  But no event
+ * that is still to come can start before the earliest of:
+ *
+ *  - the packet being grouped (st->input_sec/nsec),
+ *  - the events still in flight in st->events, and
+ *  - whatever the collapse stage is holding on to.
+ *
+ * That's the watermark.  Events are held in a heap keyed on start time,
+ * and let out once they're at or below the watermark.  Events with the
+ * same start time keep the order they arrived in.
+ */
+
+// Don't hold on to more than this much; past it, order isn't guaranteed
+#define REORDER_MAX_BYTES (256 * 1024 * 1024)
+
+struct reorder_entry {
+    uint32_t sec, nsec;
+    uint64_t seq;
+    uint8_t *rec;
+    uint32_t size;
+};
+
+struct reorder {
+    /* Stage that ordered events are passed on to */
+    int next;
+
+    struct reorder_entry *heap;
+    size_t count, cap;
+    size_t bytes;
+    uint64_t seq;
+
+    /* Start of the last event let out, and how many came in before it */
+    uint32_t out_sec, out_nsec;
+    uint64_t late;
+};
+
+static int time_before(uint32_t sec1, uint32_t nsec1,
+                       uint32_t sec2, uint32_t nsec2) {
+    return sec1 < sec2 || (sec1 == sec2 && nsec1 < nsec2);
+}
+
+static int entry_before(struct reorder_entry *a, struct reorder_entry *b) {
+    if (a->sec != b->sec || a->nsec != b->nsec)
+        return time_before(a->sec, a->nsec, b->sec, b->nsec);
+    return a->seq < b->seq;
+}
+
+static void heap_up(struct reorder *r, size_t i) {
+    struct reorder_entry e = r->heap[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!entry_before(&e, &r->heap[parent]))
+            break;
+        r->heap[i] = r->heap[parent];
+        i = parent;
+    }
+    r->heap[i] = e;
+}
+
+static void heap_down(struct reorder *r, size_t i) {
+    struct reorder_entry e = r->heap[i];
+
+    while (1) {
+        size_t child = i * 2 + 1;
+        if (child >= r->count)
+            break;
+        if (child + 1 < r->count
+         && entry_before(&r->heap[child + 1], &r->heap[child]))
+            child++;
+        if (!entry_before(&r->heap[child], &e))
+            break;
+        r->heap[i] = r->heap[child];
+        i = child;
+    }
+    r->heap[i] = e;
+}
+
+// Pass on the earliest event being held
+static int release_one(struct state *st) {
+    struct reorder *r = st->reorder;
+    struct reorder_entry e = r->heap[0];
+    int ret;
+
+    r->heap[0] = r->heap[--r->count];
+    if (r->count)
+        heap_down(r, 0);
+    r->bytes -= e.size;
+
+    r->out_sec = e.sec;
+    r->out_nsec = e.nsec;
+    ret = evt_pass(st, r->next, e.rec, e.size);
+    free(e.rec);
+    return ret;
+}
+
+static void watermark(struct state *st, uint32_t *sec, uint32_t *nsec) {
+    uint32_t held_sec, held_nsec;
+    int i;
+
+    *sec = st->input_sec;
+    *nsec = st->input_nsec;
+
+    for (i=0; i<(sizeof(st->events)/sizeof(st->events[0])); i++) {
+        struct evt_header *hdr = st->events[i];
+        if (hdr && time_before(ntohl(hdr->sec_start), ntohl(hdr->nsec_start),
+                               *sec, *nsec)) {
+            *sec = ntohl(hdr->sec_start);
+            *nsec = ntohl(hdr->nsec_start);
+        }
+    }
+
+    if (st->collapse && collapse_held(st, &held_sec, &held_nsec)
+     && time_before(held_sec, held_nsec, *sec, *nsec)) {
+        *sec = held_sec;
+        *nsec = held_nsec;
+    }
+}
+
+// Let out everything that nothing still to come can precede
+int reorder_release(struct state *st) {
+    struct reorder *r = st->reorder;
+    uint32_t sec, nsec;
+
+    if (!r || !r->count)
+        return 0;
+
+    // Nothing can be let out before the grouper has moved past it
+    if (time_before(st->input_sec, st->input_nsec,
+                    r->heap[0].sec, r->heap[0].nsec))
+        return 0;
+
+    watermark(st, &sec, &nsec);
+    while (r->count
+        && !time_before(sec, nsec, r->heap[0].sec, r->heap[0].nsec))
+        if (release_one(st) < 0)
+            return -1;
+    return 0;
+}
+
+static int reorder_event(struct state *st, int stage,
+                         void *arg, uint32_t size) {
+    struct reorder *r = st->reorder;
+    struct evt_header *hdr = arg;
+    struct reorder_entry *e;
+
+    if (r->count == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 4096;
+        e = realloc(r->heap, cap * sizeof(*e));
+        if (!e) {
+            perror("Couldn't grow reorder buffer");
+            return -1;
+        }
+        r->heap = e;
+        r->cap = cap;
+    }
+
+    e = &r->heap[r->count];
+    e->sec = ntohl(hdr->sec_start);
+    e->nsec = ntohl(hdr->nsec_start);
+    e->seq = r->seq++;
+    e->size = size;
+    e->rec = malloc(size);
+    if (!e->rec) {
+        perror("Couldn't hold event");
+        return -1;
+    }
+    memcpy(e->rec, arg, size);
+
+    if (time_before(e->sec, e->nsec, r->out_sec, r->out_nsec))
+        r->late++;
+
+    heap_up(r, r->count++);
+    r->bytes += size;
+
+    while (r->bytes > REORDER_MAX_BYTES)
+        if (release_one(st) < 0)
+            return -1;
+
+    return reorder_release(st);
+}
+
+static int reorder_flush(struct state *st, int stage) {
+    struct reorder *r = st->reorder;
+
+    while (r->count)
+        if (release_one(st) < 0)
+            return -1;
+
+    if (r->late)
+        fprintf(stderr, "Warning: %llu events arrived too late to be "
+                        "put in order\n", (unsigned long long)r->late);
+    return 0;
+}
+
+int reorder_init(struct state *st) {
+    st->reorder = calloc(1, sizeof(*st->reorder));
+    if (!st->reorder) {
+        perror("Couldn't allocate reorder buffer");
+        return -1;
+    }
+    st->reorder->next = evt_add_stage(st, reorder_event, reorder_flush) + 1;
+    return 0;
+}
+
+// Drop the buffer, along with anything still held in it
+void reorder_free(struct state *st) {
+    struct reorder *r = st->reorder;
+    size_t i;
+
+    if (!r)
+        return;
+    for (i=0; i<r->count; i++)
+        free(r->heap[i].rec);
+    free(r->heap);
+    free(r);
+    st->reorder = NULL;
+}
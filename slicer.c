@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include "event-struct.h"
+
+/* Cuts the events that start within a window of time out of a sorted
+ * file.  The jump table is binary searched for both ends of the window,
+ * and the events between are copied out behind a new jump table.
+ */
+
+#define TABLE_ENTRIES 65536
+
+// Parse "seconds[.fraction]" into the same form as sorted_time()
+static int parse_time(const char *str, uint64_t *time) {
+    char *end;
+    unsigned long long sec;
+    uint32_t nsec = 0;
+    int digits = 0;
+
+    errno = 0;
+    sec = strtoull(str, &end, 10);
+    if (errno || end == str || sec > UINT32_MAX)
+        return -1;
+    if (*end == '.') {
+        for (end++; *end >= '0' && *end <= '9'; end++) {
+            if (digits++ < 9)
+                nsec = nsec * 10 + (*end - '0');
+        }
+        for (; digits < 9; digits++)
+            nsec *= 10;
+    }
+    if (*end)
+        return -1;
+
+    *time = ((uint64_t)sec << 32) | nsec;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            perror("Couldn't write output");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copy [start, end) of the input to the output, in the kernel if it can
+static int copy_events(struct sorted_file *s, int out_fd,
+                       uint64_t start, uint64_t end) {
+    loff_t pos = start;
+
+    while (pos < end) {
+        ssize_t n = copy_file_range(s->fd, &pos, out_fd, NULL, end - pos, 0);
+        if (n > 0)
+            continue;
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS
+                   || errno == EINVAL || errno == EOPNOTSUPP))
+            return write_all(out_fd, s->map + pos, end - pos);
+        perror("Couldn't copy events");
+        return -1;
+    }
+    return 0;
+}
+
+// Size of event i, or 0 if the jump table doesn't lead to one
+static uint32_t event_size(struct sorted_file *s, uint64_t i) {
+    struct evt_header *hdr = sorted_event(s, i);
+
+    if (!hdr) {
+        fprintf(stderr, "Sorted file's jump table is damaged\n");
+        return 0;
+    }
+    return ntohl(hdr->size);
+}
+
+/* Write events [first, last) of the input as a sorted file of their own.
+ * The events are usually one contiguous stretch of the input, but after
+ * appending (sorter -a) some may be elsewhere, so each stretch that is
+ * contiguous is copied on its own.
+ */
+static int write_slice(struct sorted_file *s, int out_fd,
+                       uint64_t first, uint64_t last) {
+    uint64_t count = last - first;
+    uint64_t bytes = 0;
+    uint64_t width, offset, start, end, i;
+    uint8_t *table;
+    size_t table_len = 0;
+    int wide;
+
+    for (i=first; i<last; i++) {
+        uint32_t size = event_size(s, i);
+        if (!size)
+            return -1;
+        bytes += size;
+    }
+
+    // Same rule as the sorter: 64-bit entries only if 32 won't do
+    wide = count > UINT32_MAX
+        || sizeof(EVENT_HDR_1) + (count + 1) * sizeof(uint32_t)
+           + sizeof(EVENT_HDR_2) + bytes > UINT32_MAX;
+    width = wide ? sizeof(uint64_t) : sizeof(uint32_t);
+
+    table = malloc(TABLE_ENTRIES * width);
+    if (!table) {
+        perror("Couldn't allocate jump table");
+        return -1;
+    }
+
+    if (wide) {
+        uint64_t n = htobe64(count);
+        memcpy(table, &n, sizeof(n));
+    }
+    else {
+        uint32_t n = htonl(count);
+        memcpy(table, &n, sizeof(n));
+    }
+    if (write_all(out_fd, wide ? EVENT_HDR_1_WIDE : EVENT_HDR_1,
+                  sizeof(EVENT_HDR_1))
+     || write_all(out_fd, table, width))
+        goto err;
+
+    // The events go in back to back after the table
+    offset = sizeof(EVENT_HDR_1) + width + count * width + sizeof(EVENT_HDR_2);
+    for (i=first; i<last; i++) {
+        if (wide) {
+            uint64_t entry = htobe64(offset - EVENT_JUMP_SKEW);
+            memcpy(table + table_len * width, &entry, sizeof(entry));
+        }
+        else {
+            uint32_t entry = htonl(offset - EVENT_JUMP_SKEW);
+            memcpy(table + table_len * width, &entry, sizeof(entry));
+        }
+        offset += event_size(s, i);
+        if (++table_len == TABLE_ENTRIES) {
+            if (write_all(out_fd, table, table_len * width))
+                goto err;
+            table_len = 0;
+        }
+    }
+    if (write_all(out_fd, table, table_len * width)
+     || write_all(out_fd, EVENT_HDR_2, sizeof(EVENT_HDR_2)))
+        goto err;
+
+    start = end = 0;
+    for (i=first; i<last; i++) {
+        uint64_t at = sorted_offset(s, i);
+
+        if (at != end) {
+            if (copy_events(s, out_fd, start, end))
+                goto err;
+            start = at;
+        }
+        end = at + event_size(s, i);
+    }
+    if (copy_events(s, out_fd, start, end))
+        goto err;
+
+    free(table);
+    return 0;
+
+err:
+    free(table);
+    return -1;
+}
+
+
+int main(int argc, char **argv) {
+    struct sorted_file s;
+    char *outfile = NULL;
+    uint64_t t0, t1;
+    uint64_t first, last;
+    int out_fd = STDOUT_FILENO;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+        case 'o':
+            outfile = optarg;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+
+    if (argc - optind != 3) {
+        fprintf(stderr, "Usage: %s [-o out_filename] [in_filename] [start] [end]\n"
+                        "Times are seconds, with an optional fraction\n",
+                argv[0]);
+        return 1;
+    }
+
+    if (parse_time(argv[optind + 1], &t0) || parse_time(argv[optind + 2], &t1)) {
+        fprintf(stderr, "Times must be seconds, with an optional fraction\n");
+        return 1;
+    }
+
+    if (sorted_open(&s, argv[optind]))
+        return 2;
+
+    if (outfile) {
+        out_fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd == -1) {
+            perror("Unable to open output file");
+            return 3;
+        }
+        if (blob_store_copy(argv[optind], outfile))
+            return 4;
+    }
+
+    // Events starting anywhere in [t0, t1]
+    first = sorted_lower_bound(&s, t0);
+    last = t1 < t0 ? first
+         : t1 == UINT64_MAX ? s.count
+         : sorted_lower_bound(&s, t1 + 1);
+    if (last < first)
+        last = first;
+
+    if (write_slice(&s, out_fd, first, last))
+        return 5;
+
+    fprintf(stderr, "Sliced out %llu of %llu events\n",
+            (unsigned long long)(last - first), (unsigned long long)s.count);
+    return 0;
+}
@@ -0,0 +1,1211 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "packet-struct.h"
+#include "event-struct.h"
+#include "state.h"
+#include "tapfilter.h"
+
+#define SKIP_AMOUNT 80
+#define SEARCH_LIMIT 20
+
+enum prog_state {
+    ST_UNINITIALIZED,
+    ST_SCANNING,
+    ST_GROUPING,
+    ST_DONE,
+};
+
+
+static int st_uninitialized(struct state *st);
+static int st_scanning(struct state *st);
+static int st_grouping(struct state *st);
+static int st_done(struct state *st);
+
+static int (*st_funcs[])(struct state *st) = {
+    [ST_UNINITIALIZED]  = st_uninitialized,
+    [ST_SCANNING]       = st_scanning,
+    [ST_GROUPING]       = st_grouping,
+    [ST_DONE]           = st_done,
+};
+
+#define SCAN_BUFFER (1024 * 1024)
+#define TABLE_ENTRIES 65536
+
+/* Keys are kept within a memory budget (-m).  Once the budget is full,
+ * the keys so far are sorted and spilled to a temporary file as a run,
+ * and the runs are merged as the output is written.
+ */
+#define DEFAULT_BUDGET_MB 1024
+
+struct run {
+    /* What's left of the run in the spill file */
+    off_t pos, end;
+
+    struct sort_key *buf;
+    size_t buf_len, buf_pos;
+};
+
+/* Sorting and writing out are split over this many threads (-j), for
+ * inputs big enough to be worth it.
+ */
+#define PARALLEL_MIN_KEYS 65536
+
+/* Events are copied out of a map of the input.  Stretches of events that
+ * are contiguous in the input too are gathered up, and those of at least
+ * COPY_MIN bytes are copied file to file by the kernel rather than through
+ * the output buffer.  PREFETCH_AHEAD keys ahead of the one being copied,
+ * its header is pulled into the cache.
+ */
+#define COPY_MIN (64 * 1024)
+#define PREFETCH_AHEAD 16
+
+/* A sort in progress, hung off its struct state, so that sorts can run
+ * side by side
+ */
+struct sorter {
+    struct sort_key *keys;
+    size_t key_count, key_cap;
+    size_t total_count;
+    uint64_t total_bytes;
+
+    /* Jump table entries are 32 bits unless the sorted file is too big
+     * for them, or -w asks for 64 bits anyway.
+     */
+    int wide;
+
+    size_t budget;
+    size_t key_limit;
+    int spill_fd;
+    off_t spill_end;
+    struct run *runs;
+    int run_count;
+
+    // Threads to sort and write out with (-j)
+    int threads;
+
+    uint8_t *in_map;
+    int copy_range;
+
+    // Where to write secondary indexes to (-i), if anywhere
+    const char *index_path;
+
+    // The sorted file being added to (-a), and where the new events are from
+    const char *append_path;
+    const char *input_path;
+};
+
+/* The output is written with pwrite: the jump table at the top, and the
+ * events after it, as each event's place in the order becomes known.
+ * Each thread writing out has an emitter for its own slice of both.
+ */
+struct emitter {
+    uint8_t *table;
+    size_t table_len;
+
+    /* Jump table index of the slice's first event, and how many so far */
+    size_t first;
+    size_t written;
+
+    uint8_t *buf;
+    size_t buf_len;
+
+    /* Where the next event goes, and where buf goes */
+    uint64_t offset;
+    uint64_t buf_offset;
+
+    /* Input not yet copied, which goes after buf */
+    off_t span_start;
+    size_t span_len;
+
+    struct index_builder *index;
+};
+
+
+
+static int add_key(struct sorter *s, struct evt_header *hdr, off_t offset) {
+    struct sort_key *key;
+
+    if (s->key_count == s->key_cap) {
+        size_t cap = s->key_cap ? s->key_cap * 2 : 65536;
+        if (cap > s->key_limit)
+            cap = s->key_limit;
+        key = realloc(s->keys, cap * sizeof(*s->keys));
+        if (!key) {
+            perror("Couldn't grow key array");
+            return -1;
+        }
+        s->keys = key;
+        s->key_cap = cap;
+    }
+
+    key = &s->keys[s->key_count++];
+    key->time = ((uint64_t)ntohl(hdr->sec_start) << 32)
+              | ntohl(hdr->nsec_start);
+    key->offset = offset;
+    key->size = ntohl(hdr->size);
+    return 0;
+}
+
+/* Parallel sort.
+ * Each thread sorts a slice of the keys, and the slices are then merged
+ * in pairs, round by round.  Each merge is itself split between threads
+ * by cutting its output into equal parts; where each part starts in the
+ * two inputs is found by binary search ("merge path").
+ */
+struct sort_job {
+    pthread_t thread;
+
+    /* Keys to sort, or the two neighbouring runs to merge */
+    struct sort_key *a;
+    size_t na, nb;
+
+    /* Part of the merged output this job makes, and where it goes */
+    size_t k0, k1;
+    struct sort_key *out;
+
+    int ret;
+};
+
+// How many of the first k merged keys come from a, with ties going to a
+static size_t merge_split(struct sort_key *a, size_t na,
+                            struct sort_key *b, size_t nb, size_t k) {
+    size_t lo = (k > nb) ? k - nb : 0;
+    size_t hi = (k < na) ? k : na;
+
+    while (lo < hi) {
+        size_t i = lo + (hi - lo) / 2;
+        if (a[i].time <= b[k - i - 1].time)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+static void *sort_job(void *arg) {
+    struct sort_job *job = arg;
+    job->ret = sort_keys(job->a, job->na);
+    return NULL;
+}
+
+static void *merge_job(void *arg) {
+    struct sort_job *job = arg;
+    struct sort_key *a = job->a;
+    struct sort_key *b = job->a + job->na;
+    struct sort_key *out = job->out + job->k0;
+    size_t i = merge_split(a, job->na, b, job->nb, job->k0);
+    size_t j = job->k0 - i;
+    size_t i_end = merge_split(a, job->na, b, job->nb, job->k1);
+    size_t j_end = job->k1 - i_end;
+
+    while (i < i_end && j < j_end) {
+        if (b[j].time < a[i].time)
+            *out++ = b[j++];
+        else
+            *out++ = a[i++];
+    }
+    memcpy(out, &a[i], (i_end - i) * sizeof(*a));
+    out += i_end - i;
+    memcpy(out, &b[j], (j_end - j) * sizeof(*b));
+    return NULL;
+}
+
+static int run_jobs(struct sort_job *jobs, int count,
+                    void *(*fn)(void *)) {
+    int ret = 0;
+    int i;
+
+    // Threads that can't be started are run here instead
+    for (i=0; i<count; i++) {
+        jobs[i].ret = 0;
+        if (pthread_create(&jobs[i].thread, NULL, fn, &jobs[i])) {
+            jobs[i].thread = 0;
+            fn(&jobs[i]);
+        }
+    }
+    for (i=0; i<count; i++) {
+        if (jobs[i].thread)
+            pthread_join(jobs[i].thread, NULL);
+        if (jobs[i].ret)
+            ret = jobs[i].ret;
+    }
+    return ret;
+}
+
+static int parallel_sort(struct sorter *s, struct sort_key *keys,
+                         size_t count) {
+    int parts = s->threads;
+    struct sort_key *src = keys, *dst, *tmp;
+    struct sort_job *jobs;
+    size_t *bounds;
+    size_t i;
+    int width, p;
+
+    if (parts > count / PARALLEL_MIN_KEYS)
+        parts = count / PARALLEL_MIN_KEYS;
+    if (parts < 2)
+        return sort_keys(keys, count);
+
+    for (i=1; i<count; i++)
+        if (keys[i].time < keys[i - 1].time)
+            break;
+    if (i == count)
+        return 0;
+
+    dst = malloc(count * sizeof(*dst));
+    jobs = calloc(parts, sizeof(*jobs));
+    bounds = malloc((parts + 1) * sizeof(*bounds));
+    if (!dst || !jobs || !bounds) {
+        perror("Couldn't allocate parallel sort");
+        return -1;
+    }
+
+    for (p=0; p<=parts; p++)
+        bounds[p] = (uint64_t)count * p / parts;
+
+    for (p=0; p<parts; p++) {
+        jobs[p].a = keys + bounds[p];
+        jobs[p].na = bounds[p + 1] - bounds[p];
+    }
+    if (run_jobs(jobs, parts, sort_job))
+        return -1;
+
+    for (width=1; width<parts; width*=2) {
+        int n = 0;
+
+        for (p=0; p<parts; p+=2*width) {
+            size_t start = bounds[p];
+            size_t mid = bounds[(p + width < parts) ? p + width : parts];
+            size_t end = bounds[(p + 2*width < parts) ? p + 2*width : parts];
+            int slices = (uint64_t)s->threads * (end - start) / count;
+            int slice;
+
+            if (slices < 1)
+                slices = 1;
+            for (slice=0; slice<slices; slice++) {
+                struct sort_job *job;
+
+                if (n == parts) {
+                    if (run_jobs(jobs, n, merge_job))
+                        return -1;
+                    n = 0;
+                }
+                job = &jobs[n++];
+                memset(job, 0, sizeof(*job));
+                job->a = src + start;
+                job->na = mid - start;
+                job->nb = end - mid;
+                job->k0 = (uint64_t)(end - start) * slice / slices;
+                job->k1 = (uint64_t)(end - start) * (slice + 1) / slices;
+                job->out = dst + start;
+            }
+        }
+        if (run_jobs(jobs, n, merge_job))
+            return -1;
+
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != keys) {
+        memcpy(keys, src, count * sizeof(*keys));
+        dst = src;
+    }
+    free(dst);
+    free(jobs);
+    free(bounds);
+    return 0;
+}
+
+static int open_spill_file(struct sorter *s) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/sorter-XXXXXX", dir ? dir : "/tmp");
+    s->spill_fd = mkstemp(path);
+    if (s->spill_fd == -1) {
+        perror("Couldn't create spill file");
+        return -1;
+    }
+    unlink(path);
+    return 0;
+}
+
+// Sort the keys gathered so far, and move them out to the spill file
+static int spill_run(struct sorter *s) {
+    size_t bytes = s->key_count * sizeof(*s->keys);
+    struct run *r;
+
+    if (s->spill_fd == -1 && open_spill_file(s))
+        return -1;
+    if (sort_keys(s->keys, s->key_count))
+        return -1;
+
+    r = realloc(s->runs, (s->run_count + 1) * sizeof(*s->runs));
+    if (!r) {
+        perror("Couldn't add run");
+        return -1;
+    }
+    s->runs = r;
+    r = &s->runs[s->run_count++];
+    memset(r, 0, sizeof(*r));
+
+    if (pwrite(s->spill_fd, s->keys, bytes, s->spill_end) != bytes) {
+        perror("Couldn't write run");
+        return -1;
+    }
+    r->pos = s->spill_end;
+    r->end = s->spill_end + bytes;
+    s->spill_end += bytes;
+    s->key_count = 0;
+    return 0;
+}
+
+// Read the next stretch of a run into its buffer
+static int run_fill(struct sorter *s, struct run *r, size_t per_run) {
+    size_t n = (r->end - r->pos) / sizeof(*r->buf);
+    size_t bytes;
+
+    if (n > per_run)
+        n = per_run;
+    bytes = n * sizeof(*r->buf);
+    if (pread(s->spill_fd, r->buf, bytes, r->pos) != bytes) {
+        perror("Couldn't read run");
+        return -1;
+    }
+    r->pos += bytes;
+    r->buf_len = n;
+    r->buf_pos = 0;
+    return n;
+}
+
+static int run_before(struct sorter *s, int a, int b) {
+    struct sort_key *ka = &s->runs[a].buf[s->runs[a].buf_pos];
+    struct sort_key *kb = &s->runs[b].buf[s->runs[b].buf_pos];
+
+    // Runs are in file order, so ties go to the earlier run
+    if (ka->time != kb->time)
+        return ka->time < kb->time;
+    return a < b;
+}
+
+static void heap_down(struct sorter *s, int *heap, int count, int i) {
+    int top = heap[i];
+
+    while (1) {
+        int child = i * 2 + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && run_before(s, heap[child + 1], heap[child]))
+            child++;
+        if (!run_before(s, heap[child], top))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = top;
+}
+
+
+// Bytes per jump table entry, which is also the size of the count
+static size_t table_width(struct sorter *s) {
+    return s->wide ? sizeof(uint64_t) : sizeof(uint32_t);
+}
+
+// Fill in entry i of a stretch of jump table, for the event at `offset`
+static void put_entry(struct sorter *s, uint8_t *table, size_t i,
+                      uint64_t offset) {
+    offset -= EVENT_JUMP_SKEW;
+    if (s->wide) {
+        uint64_t entry = htobe64(offset);
+        memcpy(table + i * sizeof(entry), &entry, sizeof(entry));
+    }
+    else {
+        uint32_t entry = htonl(offset);
+        memcpy(table + i * sizeof(entry), &entry, sizeof(entry));
+    }
+}
+
+// Where the events start, after a jump table of `count` entries
+static uint64_t events_start(struct sorter *s, uint64_t count) {
+    return sizeof(EVENT_HDR_1) + table_width(s) + count * table_width(s)
+         + sizeof(EVENT_HDR_2);
+}
+
+// Write the magic numbers and the count around a jump table
+static int write_header(struct state *st, uint64_t count) {
+    struct sorter *s = st->sorter;
+    const char *magic;
+    uint8_t buf[sizeof(uint64_t)];
+
+    if (s->wide) {
+        uint64_t n = htobe64(count);
+        memcpy(buf, &n, sizeof(n));
+        magic = EVENT_HDR_1_WIDE;
+    }
+    else {
+        uint32_t n = htonl(count);
+        memcpy(buf, &n, sizeof(n));
+        magic = EVENT_HDR_1;
+    }
+
+    if (pwrite(st->out_fd, magic, sizeof(EVENT_HDR_1), 0) != sizeof(EVENT_HDR_1)
+     || pwrite(st->out_fd, buf, table_width(s), sizeof(EVENT_HDR_1)) != table_width(s)
+     || pwrite(st->out_fd, EVENT_HDR_2, sizeof(EVENT_HDR_2),
+               events_start(s, count) - sizeof(EVENT_HDR_2)) != sizeof(EVENT_HDR_2)) {
+        perror("Couldn't write header");
+        return -1;
+    }
+    return 0;
+}
+
+// Write the header, and find where the events start
+static int emit_header(struct state *st, uint64_t *offset) {
+    struct sorter *s = st->sorter;
+
+    *offset = events_start(s, s->total_count);
+    if (!s->wide && (*offset + s->total_bytes > UINT32_MAX
+               || s->total_count > UINT32_MAX)) {
+        printf("Sorted file is over 4 GB, using a 64-bit jump table\n");
+        s->wide = 1;
+        *offset = events_start(s, s->total_count);
+    }
+    return write_header(st, s->total_count);
+}
+
+// Set up to write events from jump table entry `first`, at `offset`
+static int emit_start(struct sorter *s, struct emitter *e, size_t first,
+                      uint64_t offset) {
+    memset(e, 0, sizeof(*e));
+    e->table = malloc(TABLE_ENTRIES * table_width(s));
+    e->buf = malloc(SCAN_BUFFER);
+    if (!e->table || !e->buf) {
+        perror("Couldn't allocate output buffers");
+        return -1;
+    }
+    e->first = first;
+    e->offset = e->buf_offset = offset;
+    if (s->index_path && !(e->index = index_builder_new()))
+        return -1;
+    return 0;
+}
+
+static void emit_free(struct emitter *e) {
+    free(e->table);
+    free(e->buf);
+}
+
+static int emit_flush(struct state *st, struct emitter *e) {
+    struct sorter *s = st->sorter;
+    off_t table_pos = sizeof(EVENT_HDR_1) + table_width(s)
+                    + (off_t)(e->first + e->written - e->table_len)
+                      * table_width(s);
+    size_t table_bytes = e->table_len * table_width(s);
+
+    if (pwrite(st->out_fd, e->table, table_bytes, table_pos) != table_bytes
+     || pwrite(st->out_fd, e->buf, e->buf_len, e->buf_offset) != e->buf_len) {
+        perror("Couldn't write events");
+        return -1;
+    }
+    e->buf_offset += e->buf_len;
+    e->buf_len = 0;
+    e->table_len = 0;
+    return 0;
+}
+
+// Copy part of the input straight to the output
+static int copy_span(struct state *st, off_t src, size_t len, uint64_t dst) {
+    struct sorter *s = st->sorter;
+
+    while (len) {
+        ssize_t n;
+
+        if (s->copy_range) {
+            loff_t in = src, out = dst;
+            n = copy_file_range(st->fd, &in, st->out_fd, &out, len, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS
+                       || errno == EINVAL || errno == EOPNOTSUPP)) {
+                s->copy_range = 0;
+                continue;
+            }
+        }
+        else {
+            n = pwrite(st->out_fd, s->in_map + src, len, dst);
+        }
+        if (n <= 0) {
+            perror("Couldn't copy events");
+            return -1;
+        }
+        src += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write out the input gathered so far
+static int emit_span(struct state *st, struct emitter *e) {
+    struct sorter *s = st->sorter;
+
+    if (e->span_len >= COPY_MIN) {
+        if (emit_flush(st, e)
+         || copy_span(st, e->span_start, e->span_len, e->buf_offset))
+            return -1;
+        e->buf_offset += e->span_len;
+    }
+    else if (e->span_len) {
+        if (e->buf_len + e->span_len > SCAN_BUFFER && emit_flush(st, e))
+            return -1;
+        memcpy(e->buf + e->buf_len, s->in_map + e->span_start, e->span_len);
+        e->buf_len += e->span_len;
+    }
+    e->span_len = 0;
+    return 0;
+}
+
+// Copy the next event in order to the output
+static int emit_event(struct state *st, struct emitter *e,
+                      struct sort_key *key) {
+    struct sorter *s = st->sorter;
+
+    if (e->table_len == TABLE_ENTRIES && emit_flush(st, e))
+        return -1;
+
+    if (e->span_len && key->offset != e->span_start + e->span_len
+     && emit_span(st, e))
+        return -1;
+    if (!e->span_len)
+        e->span_start = key->offset;
+    e->span_len += key->size;
+
+    if (e->index && index_builder_add(e->index, e->first + e->written,
+                                      s->in_map + key->offset, key->size))
+        return -1;
+
+    put_entry(s, e->table, e->table_len++, e->offset);
+    e->written++;
+    e->offset += key->size;
+    return 0;
+}
+
+// Write out whatever is left
+static int emit_finish(struct state *st, struct emitter *e) {
+    if (emit_span(st, e) || emit_flush(st, e))
+        return -1;
+    return 0;
+}
+
+/* Takes keys from the spilled runs in order, merging them with a heap of
+ * the runs' next keys.
+ */
+struct run_merge {
+    struct sorter *s;
+    int *heap;
+    int count;
+    size_t per_run;
+};
+
+static int runs_start(struct sorter *s, struct run_merge *m) {
+    int i;
+
+    m->s = s;
+    m->count = 0;
+    m->per_run = s->budget / s->run_count / sizeof(struct sort_key);
+    if (m->per_run < 1024)
+        m->per_run = 1024;
+
+    m->heap = malloc(s->run_count * sizeof(*m->heap));
+    if (!m->heap) {
+        perror("Couldn't allocate merge heap");
+        return -1;
+    }
+    for (i=0; i<s->run_count; i++) {
+        s->runs[i].buf = malloc(m->per_run * sizeof(*s->runs[i].buf));
+        if (!s->runs[i].buf) {
+            perror("Couldn't allocate run buffer");
+            return -1;
+        }
+        if (run_fill(s, &s->runs[i], m->per_run) > 0)
+            m->heap[m->count++] = i;
+    }
+    for (i=m->count/2-1; i>=0; i--)
+        heap_down(s, m->heap, m->count, i);
+    return 0;
+}
+
+// Take the next key, returning 1, or 0 once they've all been taken
+static int runs_next(struct run_merge *m, struct sort_key *key) {
+    struct sorter *s = m->s;
+    struct run *r;
+    int n = 1;
+
+    if (!m->count)
+        return 0;
+    r = &s->runs[m->heap[0]];
+    *key = r->buf[r->buf_pos++];
+
+    if (r->buf_pos == r->buf_len && (n = run_fill(s, r, m->per_run)) < 0)
+        return -1;
+    if (!n)
+        m->heap[0] = m->heap[--m->count];
+    heap_down(s, m->heap, m->count, 0);
+    return 1;
+}
+
+static void runs_end(struct run_merge *m) {
+    struct sorter *s = m->s;
+    int i;
+
+    for (i=0; i<s->run_count; i++) {
+        free(s->runs[i].buf);
+        s->runs[i].buf = NULL;
+    }
+    free(m->heap);
+}
+
+// Merge the spilled runs straight into the output
+static int emit_runs(struct state *st, struct emitter *e) {
+    struct sorter *s = st->sorter;
+    struct run_merge m;
+    struct sort_key key;
+    int ret;
+
+    if (runs_start(s, &m))
+        return -1;
+    while ((ret = runs_next(&m, &key)) > 0) {
+        if (emit_event(st, e, &key)) {
+            ret = -1;
+            break;
+        }
+    }
+    runs_end(&m);
+    return ret;
+}
+
+
+// Initialize the "joiner" state machine
+static int sstate_init(struct state *st) {
+    st->is_logging = 0;
+    st->st = ST_SCANNING;
+    st->last_run_offset = 0;
+    st->join_buffer_capacity = 0;
+    st->buffer_offset = -1;
+    st->search_limit = 0;
+    return 0;
+}
+
+static int sstate_state(struct state *st) {
+    return st->st;
+}
+
+static int sstate_run(struct state *st) {
+    return st_funcs[st->st](st);
+}
+
+static int sstate_set(struct state *st, enum prog_state new_state) {
+    st->st = new_state;
+    return 0;
+}
+
+
+
+// Dummy state that should never be reached
+static int st_uninitialized(struct state *st) {
+    printf("state error: should not be in this state\n");
+    return -1;
+}
+
+// Read through the events once, noting each one's start time and place
+static int st_scanning(struct state *st) {
+    struct sorter *s = st->sorter;
+    uint8_t *buf;
+    int buf_len = 0;
+    int pos = 0;
+    off_t offset = 0;
+    int ret;
+
+    buf = malloc(SCAN_BUFFER);
+    if (!buf) {
+        perror("Couldn't allocate scan buffer");
+        return -1;
+    }
+
+    s->key_count = s->total_count = 0;
+    s->total_bytes = 0;
+    s->key_limit = s->budget / (2 * sizeof(struct sort_key));
+    if (s->key_limit < 65536)
+        s->key_limit = 65536;
+    lseek(st->fd, 0, SEEK_SET);
+    while (1) {
+        struct evt_header hdr;
+
+        if (buf_len - pos < sizeof(hdr)) {
+            memmove(buf, buf + pos, buf_len - pos);
+            buf_len -= pos;
+            pos = 0;
+            ret = read(st->fd, buf + buf_len, SCAN_BUFFER - buf_len);
+            if (ret < 0) {
+                perror("Couldn't read events");
+                free(buf);
+                return -1;
+            }
+            buf_len += ret;
+            if (buf_len - pos < sizeof(hdr))
+                break;
+        }
+
+        memcpy(&hdr, buf + pos, sizeof(hdr));
+        if (ntohl(hdr.size) < sizeof(hdr)
+         || ntohl(hdr.size) > sizeof(union evt)) {
+            fprintf(stderr, "Bad event size %d at offset %lld\n",
+                    ntohl(hdr.size), (long long)offset);
+            free(buf);
+            return -1;
+        }
+        if (s->key_count == s->key_limit && spill_run(s)) {
+            free(buf);
+            return -1;
+        }
+        if (add_key(s, &hdr, offset)) {
+            free(buf);
+            return -1;
+        }
+        s->total_count++;
+        s->total_bytes += ntohl(hdr.size);
+
+        // Skip the body, which may run past what's buffered
+        offset += ntohl(hdr.size);
+        if (ntohl(hdr.size) <= buf_len - pos) {
+            pos += ntohl(hdr.size);
+        }
+        else {
+            lseek(st->fd, offset, SEEK_SET);
+            pos = buf_len = 0;
+        }
+    }
+    free(buf);
+    printf("Working on %llu events...\n", (unsigned long long)s->total_count);
+
+    sstate_set(st, ST_GROUPING);
+    return 0;
+}
+
+static int st_grouping(struct state *st) {
+    struct sorter *s = st->sorter;
+
+    printf("Sorting...\n");
+
+    // Once anything has been spilled, everything goes through the merge
+    if (s->run_count) {
+        if (s->key_count && spill_run(s))
+            return -1;
+        free(s->keys);
+        s->keys = NULL;
+        s->key_cap = 0;
+        printf("Merging %d runs...\n", s->run_count);
+    }
+    else if (parallel_sort(s, s->keys, s->key_count))
+        return -1;
+    sstate_set(st, ST_DONE);
+    return 0;
+}
+
+
+struct emit_job {
+    pthread_t thread;
+    struct state *st;
+    size_t first, count;
+    uint64_t offset;
+    struct index_builder *index;
+    int ret;
+};
+
+static void *emit_job(void *arg) {
+    struct emit_job *job = arg;
+    struct sorter *s = job->st->sorter;
+    struct emitter e;
+    size_t i;
+
+    job->ret = -1;
+    if (emit_start(s, &e, job->first, job->offset))
+        return NULL;
+    for (i=job->first; i<job->first + job->count; i++) {
+        if (i + PREFETCH_AHEAD < job->first + job->count)
+            __builtin_prefetch(s->in_map + s->keys[i + PREFETCH_AHEAD].offset);
+        if (emit_event(job->st, &e, &s->keys[i]))
+            goto out;
+    }
+    job->ret = emit_finish(job->st, &e);
+out:
+    job->index = e.index;
+    emit_free(&e);
+    return NULL;
+}
+
+// Write out the sorted keys, each thread taking a contiguous slice
+static int emit_parallel(struct state *st, uint64_t offset) {
+    struct sorter *s = st->sorter;
+    int parts = s->threads;
+    struct emit_job *jobs;
+    int ret = 0;
+    size_t i;
+    int p;
+
+    if (parts > s->key_count / PARALLEL_MIN_KEYS)
+        parts = s->key_count / PARALLEL_MIN_KEYS;
+    if (parts < 1)
+        parts = 1;
+
+    jobs = calloc(parts, sizeof(*jobs));
+    if (!jobs) {
+        perror("Couldn't allocate writers");
+        return -1;
+    }
+
+    // Each slice starts where the events before it end
+    i = 0;
+    for (p=0; p<parts; p++) {
+        size_t end = (uint64_t)s->key_count * (p + 1) / parts;
+
+        jobs[p].st = st;
+        jobs[p].first = i;
+        jobs[p].count = end - i;
+        jobs[p].offset = offset;
+        for (; i<end; i++)
+            offset += s->keys[i].size;
+    }
+
+    for (p=1; p<parts; p++) {
+        if (pthread_create(&jobs[p].thread, NULL, emit_job, &jobs[p])) {
+            jobs[p].thread = 0;
+            emit_job(&jobs[p]);
+        }
+    }
+    emit_job(&jobs[0]);
+    for (p=0; p<parts; p++) {
+        if (jobs[p].thread)
+            pthread_join(jobs[p].thread, NULL);
+        if (jobs[p].ret)
+            ret = jobs[p].ret;
+    }
+
+    // The slices' index entries are put back together in order
+    if (!ret && s->index_path) {
+        struct index_builder **builders = calloc(parts, sizeof(*builders));
+        if (!builders) {
+            perror("Couldn't allocate index");
+            ret = -1;
+        }
+        else {
+            for (p=0; p<parts; p++)
+                builders[p] = jobs[p].index;
+            ret = index_write(builders, parts, s->index_path);
+            free(builders);
+        }
+    }
+    for (p=0; p<parts; p++)
+        index_builder_free(jobs[p].index);
+    free(jobs);
+    return ret;
+}
+
+
+/* Appending (-a) merges the new events into an existing sorted file in
+ * place.  The jump table is rewritten, and the new events' bodies go on
+ * the end of the file, along with any old events in the way of the table
+ * having grown; the rest of the old events stay where they are.  The old
+ * events that go before each new one are found by binary search, so only
+ * the jump table is read in full.
+ */
+struct appender {
+    // The merged jump table is put together in the spill file
+    uint8_t *table;
+    size_t table_len;
+    uint64_t table_offset;
+
+    // Bodies for the end of the sorted file
+    uint8_t *buf;
+    size_t buf_len;
+    uint64_t buf_offset;
+};
+
+static int append_flush(struct state *st, struct appender *a) {
+    struct sorter *s = st->sorter;
+    size_t table_bytes = a->table_len * table_width(s);
+
+    if (pwrite(s->spill_fd, a->table, table_bytes, a->table_offset) != table_bytes
+     || pwrite(st->out_fd, a->buf, a->buf_len, a->buf_offset) != a->buf_len) {
+        perror("Couldn't write appended events");
+        return -1;
+    }
+    a->table_offset += table_bytes;
+    a->table_len = 0;
+    a->buf_offset += a->buf_len;
+    a->buf_len = 0;
+    return 0;
+}
+
+/* Add the next jump table entry.  Events that stay where they are just
+ * have their offset given; events to go on the end come with their body,
+ * and any payload reference is moved by `shift`.
+ */
+static int append_event(struct state *st, struct appender *a,
+                        uint64_t offset, const uint8_t *body, uint32_t size,
+                        uint64_t shift) {
+    struct sorter *s = st->sorter;
+
+    if ((a->table_len == TABLE_ENTRIES || a->buf_len + size > SCAN_BUFFER)
+     && append_flush(st, a))
+        return -1;
+
+    if (body) {
+        offset = a->buf_offset + a->buf_len;
+        memcpy(a->buf + a->buf_len, body, size);
+        if (blob_rebase(a->buf + a->buf_len, size, shift)) {
+            fprintf(stderr, "Bad payload reference in event at %llu\n",
+                    (unsigned long long)offset);
+            return -1;
+        }
+        a->buf_len += size;
+    }
+    put_entry(s, a->table, a->table_len++, offset);
+    return 0;
+}
+
+// Take the next new key in order, returning 1, or 0 once there are none
+static int next_new_key(struct sorter *s, struct run_merge *m,
+                        size_t *next, struct sort_key *key) {
+    if (s->run_count)
+        return runs_next(m, key);
+    if (*next == s->key_count)
+        return 0;
+    *key = s->keys[(*next)++];
+    return 1;
+}
+
+static int emit_append(struct state *st) {
+    struct sorter *s = st->sorter;
+    struct sorted_file sf;
+    struct appender a;
+    struct run_merge m;
+    struct sort_key key;
+    uint64_t start, end, displaced, shift;
+    uint64_t count, i, bound;
+    size_t next = 0;
+    off_t table_base;
+    int have;
+
+    if (sorted_open(&sf, s->append_path))
+        return -1;
+    count = sf.count + s->total_count;
+    if (sf.wide)
+        s->wide = 1;
+
+    // Old events up to where the new jump table ends have to move
+    while (1) {
+        start = events_start(s, count);
+        displaced = 0;
+        for (i=0; i<sf.count; i++) {
+            if (sorted_offset(&sf, i) >= start)
+                continue;
+            if (!sorted_event(&sf, i)) {
+                fprintf(stderr, "%s has a damaged jump table\n", s->append_path);
+                return -1;
+            }
+            displaced += ntohl(sorted_event(&sf, i)->size);
+        }
+        end = sf.size + displaced + s->total_bytes;
+        if (s->wide || (end <= UINT32_MAX && count <= UINT32_MAX))
+            break;
+        printf("Sorted file is over 4 GB, using a 64-bit jump table\n");
+        s->wide = 1;
+    }
+
+    if (blob_store_append(s->input_path, s->append_path, &shift))
+        return -1;
+    if (s->spill_fd == -1 && open_spill_file(s))
+        return -1;
+    if (s->total_bytes) {
+        s->in_map = mmap(NULL, s->total_bytes, PROT_READ, MAP_SHARED, st->fd, 0);
+        if (s->in_map == MAP_FAILED) {
+            perror("Couldn't map input");
+            return -1;
+        }
+    }
+
+    memset(&a, 0, sizeof(a));
+    a.table = malloc(TABLE_ENTRIES * table_width(s));
+    a.buf = malloc(SCAN_BUFFER);
+    if (!a.table || !a.buf) {
+        perror("Couldn't allocate output buffers");
+        return -1;
+    }
+    a.table_offset = table_base = s->spill_end;
+    a.buf_offset = sf.size;
+
+    if (s->run_count && runs_start(s, &m))
+        return -1;
+
+    // Old events go before new ones with the same start time
+    i = 0;
+    have = next_new_key(s, &m, &next, &key);
+    while (have > 0 || i < sf.count) {
+        bound = sf.count;
+        if (have > 0 && key.time != UINT64_MAX)
+            bound = sorted_lower_bound(&sf, key.time + 1);
+        for (; i<bound; i++) {
+            uint64_t offset = sorted_offset(&sf, i);
+            struct evt_header *hdr = NULL;
+
+            if (offset < start)
+                hdr = sorted_event(&sf, i);
+            if (append_event(st, &a, offset, (uint8_t *)hdr,
+                             hdr ? ntohl(hdr->size) : 0, 0))
+                return -1;
+        }
+        if (have > 0) {
+            if (append_event(st, &a, 0, s->in_map + key.offset, key.size, shift))
+                return -1;
+            have = next_new_key(s, &m, &next, &key);
+        }
+        if (have < 0)
+            return -1;
+    }
+    if (append_flush(st, &a))
+        return -1;
+    if (s->run_count)
+        runs_end(&m);
+
+    // Everything's safely on the end; now the new jump table goes in
+    if (fdatasync(st->out_fd)) {
+        perror("Couldn't sync appended events");
+        return -1;
+    }
+    sorted_close(&sf);
+    for (i=0; i<count; i+=TABLE_ENTRIES) {
+        size_t n = count - i < TABLE_ENTRIES ? count - i : TABLE_ENTRIES;
+        size_t bytes = n * table_width(s);
+
+        if (pread(s->spill_fd, a.table, bytes, table_base + i * table_width(s)) != bytes
+         || pwrite(st->out_fd, a.table, bytes,
+                   sizeof(EVENT_HDR_1) + table_width(s) + i * table_width(s)) != bytes) {
+            perror("Couldn't write jump table");
+            return -1;
+        }
+    }
+    if (write_header(st, count))
+        return -1;
+
+    free(a.table);
+    free(a.buf);
+    printf("Added %llu events to %llu\n", (unsigned long long)s->total_count,
+           (unsigned long long)(count - s->total_count));
+    return 0;
+}
+
+
+/* We're all done sorting.  Write out the logfile.
+ * Format:
+ *   Magic number 0x43 0x9f 0x22 0x53 ("TBEv"), or "TBE8" when wide
+ *   Number of elements (32 bits, or 64 when wide)
+ *   Array of offsets from the start of the file, less 4 (likewise)
+ *   Magic number 0xa4 0xc3 0x2d 0xe5
+ *   Array of events
+ */
+static int st_done(struct state *st) {
+    struct sorter *s = st->sorter;
+    struct emitter e;
+    uint64_t offset;
+
+    printf("Writing out...\n");
+
+    if (s->append_path) {
+        if (emit_append(st))
+            return -1;
+        printf("Done.\n");
+        return 1;
+    }
+
+    if (emit_header(st, &offset))
+        return -1;
+
+    if (s->total_bytes) {
+        s->in_map = mmap(NULL, s->total_bytes, PROT_READ, MAP_SHARED, st->fd, 0);
+        if (s->in_map == MAP_FAILED) {
+            perror("Couldn't map input");
+            return -1;
+        }
+    }
+
+    if (s->run_count) {
+        if (emit_start(s, &e, 0, offset)
+         || emit_runs(st, &e)
+         || emit_finish(st, &e))
+            return -1;
+        if (e.index && index_write(&e.index, 1, s->index_path))
+            return -1;
+        index_builder_free(e.index);
+        emit_free(&e);
+    }
+    else if (emit_parallel(st, offset)) {
+        return -1;
+    }
+
+    printf("Done.\n");
+    return 1;
+}
+
+
+// Sort the events in st->fd into st->out_fd
+int sort_run(struct state *st, const struct tf_sort_opts *opts) {
+    struct sorter *s;
+    int ret = 0;
+
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        perror("Couldn't allocate sorter");
+        return -1;
+    }
+    s->wide = opts->wide;
+    s->budget = (size_t)(opts->budget_mb ? opts->budget_mb : DEFAULT_BUDGET_MB)
+           * 1024 * 1024;
+    s->spill_fd = -1;
+    s->threads = opts->threads;
+    if (s->threads < 1)
+        s->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    s->copy_range = 1;
+    s->index_path = opts->index_path;
+    s->append_path = opts->append_path;
+    s->input_path = opts->input_path;
+    st->sorter = s;
+
+    sstate_init(st);
+    while (!ret)
+        ret = sstate_run(st);
+
+    // st_done() ends it with 1
+    if (ret < 0)
+        printf("State machine finished with result: %d\n", ret);
+
+    if (s->in_map && s->in_map != MAP_FAILED && s->total_bytes)
+        munmap(s->in_map, s->total_bytes);
+    if (s->spill_fd != -1)
+        close(s->spill_fd);
+    free(s->keys);
+    free(s->runs);
+    free(s);
+    st->sorter = NULL;
+    return (ret < 0) ? -1 : 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "event-struct.h"
+
+/* Read access to sorted event files (the sorter's output), in either
+ * jump table width.  The file is mapped, and events are found through the
+ * jump table as they're asked for.
+ */
+
+int sorted_open(struct sorted_file *sf, const char *filename) {
+    struct stat stat_buf;
+    uint64_t width;
+    uint64_t events;
+
+    memset(sf, 0, sizeof(*sf));
+    sf->fd = open(filename, O_RDONLY);
+    if (sf->fd == -1) {
+        perror("Unable to open sorted file");
+        return -1;
+    }
+    if (fstat(sf->fd, &stat_buf) == -1) {
+        perror("Couldn't stat sorted file");
+        goto err;
+    }
+    sf->size = stat_buf.st_size;
+    if (sf->size < sizeof(EVENT_HDR_1) + sizeof(uint32_t) + sizeof(EVENT_HDR_2)) {
+        fprintf(stderr, "%s is too short to be a sorted file\n", filename);
+        goto err;
+    }
+
+    sf->map = mmap(NULL, sf->size, PROT_READ, MAP_SHARED, sf->fd, 0);
+    if (sf->map == MAP_FAILED) {
+        perror("Couldn't map sorted file");
+        goto err;
+    }
+
+    if (!memcmp(sf->map, EVENT_HDR_1_WIDE, sizeof(EVENT_HDR_1_WIDE))) {
+        uint64_t count;
+        sf->wide = 1;
+        memcpy(&count, sf->map + sizeof(EVENT_HDR_1), sizeof(count));
+        sf->count = be64toh(count);
+    }
+    else if (!memcmp(sf->map, EVENT_HDR_1, sizeof(EVENT_HDR_1))) {
+        uint32_t count;
+        memcpy(&count, sf->map + sizeof(EVENT_HDR_1), sizeof(count));
+        sf->count = ntohl(count);
+    }
+    else {
+        fprintf(stderr, "%s isn't a sorted file\n", filename);
+        goto err_unmap;
+    }
+
+    width = sf->wide ? sizeof(uint64_t) : sizeof(uint32_t);
+    sf->table = sf->map + sizeof(EVENT_HDR_1) + width;
+    events = sizeof(EVENT_HDR_1) + width + sf->count * width;
+    if (sf->count > sf->size / width
+     || events + sizeof(EVENT_HDR_2) > sf->size
+     || memcmp(sf->map + events, EVENT_HDR_2, sizeof(EVENT_HDR_2))) {
+        fprintf(stderr, "%s has a damaged jump table\n", filename);
+        goto err_unmap;
+    }
+    return 0;
+
+err_unmap:
+    munmap(sf->map, sf->size);
+err:
+    close(sf->fd);
+    return -1;
+}
+
+void sorted_close(struct sorted_file *sf) {
+    munmap(sf->map, sf->size);
+    close(sf->fd);
+}
+
+// Where event i starts, going by the jump table
+uint64_t sorted_offset(struct sorted_file *sf, uint64_t i) {
+    if (sf->wide) {
+        uint64_t entry;
+        memcpy(&entry, sf->table + i * sizeof(entry), sizeof(entry));
+        return be64toh(entry) + EVENT_JUMP_SKEW;
+    }
+    else {
+        uint32_t entry;
+        memcpy(&entry, sf->table + i * sizeof(entry), sizeof(entry));
+        return (uint64_t)ntohl(entry) + EVENT_JUMP_SKEW;
+    }
+}
+
+// Event i, or NULL if the jump table points outside the file
+struct evt_header *sorted_event(struct sorted_file *sf, uint64_t i) {
+    uint64_t offset = sorted_offset(sf, i);
+    struct evt_header *hdr;
+
+    if (offset > sf->size - sizeof(*hdr))
+        return NULL;
+    hdr = (struct evt_header *)(sf->map + offset);
+    if (ntohl(hdr->size) < sizeof(*hdr)
+     || ntohl(hdr->size) > sf->size - offset)
+        return NULL;
+    return hdr;
+}
+
+// Start time of event i, seconds in the top half and nanoseconds below
+uint64_t sorted_time(struct sorted_file *sf, uint64_t i) {
+    struct evt_header *hdr = sorted_event(sf, i);
+
+    if (!hdr)
+        return UINT64_MAX;
+    return ((uint64_t)ntohl(hdr->sec_start) << 32) | ntohl(hdr->nsec_start);
+}
+
+// Index of the first event starting at or after `time`
+uint64_t sorted_lower_bound(struct sorted_file *sf, uint64_t time) {
+    uint64_t lo = 0, hi = sf->count;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (sorted_time(sf, mid) < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
@@ -2,8 +2,57 @@
 #define __STATE_H__
 
 #include <stdint.h>
+#include <sys/types.h>
 
 struct pkt;
+struct collapse;
+struct blob_store;
+struct reorder;
+struct sorter;
+struct state;
+
+/* A sliding window over the input, for decoders that need to look ahead.
+ * Raw bytes are read in large blocks, and packets are decoded into a ring
+ * as they're peeked at.
+ */
+struct pkt_window {
+    struct pkt *pkts;
+    int head, count;
+
+    uint8_t *buf;
+    int buf_pos, buf_len;
+
+    /* Next offset to read from, and where to stop (-1 for end of file) */
+    off_t file_pos, file_end;
+
+    /* Packet types to pass through, one bit per type; 0 passes them all */
+    uint32_t types;
+
+    /* If set, bytes come from here rather than the input file: up to len
+     * of them into buf, returning how many, 0 at the end, or -1
+     */
+    ssize_t (*read)(void *arg, uint8_t *buf, size_t len);
+    void *read_arg;
+
+    /* Set once the input couldn't be read, or had a bad packet in it, so
+     * the NULL from packet_peek() isn't taken for the end of the input
+     */
+    int error;
+};
+
+/* Events collected in memory rather than written straight to out_fd */
+struct evt_buffer {
+    uint8_t *data;
+    size_t len, cap;
+};
+
+/* A stage that finished grouper events pass through on their way out.
+ * Each stage hands events on to the next with evt_pass(st, stage + 1, ...).
+ */
+struct evt_stage {
+    int (*event)(struct state *st, int stage, void *evt, uint32_t size);
+    int (*flush)(struct state *st, int stage);
+};
 
 struct state {
     int fd;
@@ -29,15 +78,64 @@ struct state {
 
     int join_buffer_capacity;
 
+    /* When joining, the last packets written, to match the next run against */
+    struct pkt *join_buffer;
+
     /* For group-joining, a list of open items */
     struct evt_header *events[128];
+
+    /* Recycled open items, one free list per event type */
+    void *evt_pool[16];
+    void *evt_slabs;
+
+    struct pkt_window window;
+
+    /* Where evt_emit() sends events, if not to out_fd */
+    struct evt_buffer *out_buf;
+
+    /* Number of grouper worker threads */
+    int threads;
+
+    /* Optional stages that finished events pass through (see evt_sink) */
+    struct evt_stage stages[4];
+    int num_stages;
+
+    /* Pending runs of status polls and vendor commands, with -c */
+    struct collapse *collapse;
+
+    /* Payload store for deduplicated page and sector data */
+    struct blob_store *blobs;
+
+    /* Events held back to be written in order of start time, with -o */
+    struct reorder *reorder;
+
+    /* The sorter's keys, spilled runs and output, while sorting */
+    struct sorter *sorter;
+
+    /* Time of the packet being grouped.  No event that's yet to be
+     * emitted starts before it, apart from those in st->events.
+     */
+    uint32_t input_sec, input_nsec;
 };
 
+/* The stages, run over st->fd into st->out_fd (see tapfilter.h) */
+struct tf_group_opts;
+struct tf_sort_opts;
+int join_run(struct state *st);
+int group_run(struct state *st, const struct tf_group_opts *opts);
+int sort_run(struct state *st, const struct tf_sort_opts *opts);
+
 int packet_get_next(struct state *st, struct pkt *pkt);
 int packet_get_next_raw(struct state *st, struct pkt *pkt);
 int packet_unget(struct state *st, struct pkt *pkt);
 int packet_write(struct state *st, struct pkt *pkt);
 
+int packet_window_init(struct state *st, off_t start, off_t end);
+void packet_window_free(struct state *st);
+struct pkt *packet_peek(struct state *st, int n);
+int packet_consume(struct state *st, int n);
+int packet_window_wants(struct pkt_window *w, uint8_t type);
+
 uint8_t nand_unscramble_byte(uint8_t byte);
 int nand_print(struct state *st, uint8_t data, uint8_t ctrl);
 uint8_t nand_ale(uint8_t ctrl);
@@ -46,6 +144,7 @@ uint8_t nand_we(uint8_t ctrl);
 uint8_t nand_re(uint8_t ctrl);
 uint8_t nand_cs(uint8_t ctrl);
 uint8_t nand_rb(uint8_t ctrl);
+int nand_cycles_match(const struct pkt *a, const struct pkt *b, int count);
 
 
 #endif // __STATE_H__
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "packet-struct.h"
+#include "event-struct.h"
+#include "state.h"
+#include "tapfilter.h"
+
+/* Stage contexts for libtapfilter (see tapfilter.h).  Each run gets a
+ * fresh struct state, as each tool did; what a context holds is just its
+ * options and where its input and output are.
+ */
+
+enum tf_kind {
+    TF_JOINER,
+    TF_GROUPER,
+    TF_SORTER,
+};
+
+struct tf_stage {
+    enum tf_kind kind;
+    int ran;
+
+    /* -1 until set.  own_in and own_out are set for memfds made here,
+     * which are closed along with the stage.
+     */
+    int in_fd, out_fd;
+    int own_in, own_out;
+
+    struct tf_group_opts group;
+    struct tf_sort_opts sort;
+};
+
+static struct tf_stage *stage_new(enum tf_kind kind) {
+    struct tf_stage *s = calloc(1, sizeof(*s));
+
+    if (!s) {
+        perror("Couldn't allocate stage");
+        return NULL;
+    }
+    s->kind = kind;
+    s->in_fd = -1;
+    s->out_fd = -1;
+    return s;
+}
+
+struct tf_stage *tf_joiner_new(void) {
+    return stage_new(TF_JOINER);
+}
+
+struct tf_stage *tf_grouper_new(const struct tf_group_opts *opts) {
+    struct tf_stage *s = stage_new(TF_GROUPER);
+
+    if (s && opts)
+        s->group = *opts;
+    return s;
+}
+
+struct tf_stage *tf_sorter_new(const struct tf_sort_opts *opts) {
+    struct tf_stage *s = stage_new(TF_SORTER);
+
+    if (s && opts)
+        s->sort = *opts;
+    return s;
+}
+
+void tf_free(struct tf_stage *s) {
+    if (!s)
+        return;
+    if (s->own_in)
+        close(s->in_fd);
+    if (s->own_out)
+        close(s->out_fd);
+    free(s);
+}
+
+static int memfd(const char *name) {
+    int fd = memfd_create(name, MFD_CLOEXEC);
+
+    if (fd == -1)
+        perror("Couldn't create in-memory file");
+    return fd;
+}
+
+int tf_set_input(struct tf_stage *s, int fd) {
+    if (s->in_fd != -1 || s->ran) {
+        fprintf(stderr, "Stage already has its input\n");
+        return -1;
+    }
+    s->in_fd = fd;
+    return 0;
+}
+
+int tf_set_output(struct tf_stage *s, int fd) {
+    if (s->out_fd != -1 || s->ran) {
+        fprintf(stderr, "Stage already has its output\n");
+        return -1;
+    }
+    s->out_fd = fd;
+    return 0;
+}
+
+int tf_push(struct tf_stage *s, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    if (s->ran || (s->in_fd != -1 && !s->own_in)) {
+        fprintf(stderr, "Stage isn't taking records\n");
+        return -1;
+    }
+    if (s->in_fd == -1) {
+        s->in_fd = memfd("tapfilter-in");
+        if (s->in_fd == -1)
+            return -1;
+        s->own_in = 1;
+    }
+
+    while (len) {
+        ssize_t n = write(s->in_fd, p, len);
+        if (n <= 0) {
+            perror("Couldn't add records");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int tf_run(struct tf_stage *s) {
+    struct state st;
+    int ret = -1;
+
+    if (s->ran) {
+        fprintf(stderr, "Stage has already run\n");
+        return -1;
+    }
+    s->ran = 1;
+
+    if (s->in_fd == -1) {
+        s->in_fd = memfd("tapfilter-in");
+        if (s->in_fd == -1)
+            return -1;
+        s->own_in = 1;
+    }
+    if (s->out_fd == -1) {
+        s->out_fd = memfd("tapfilter-out");
+        if (s->out_fd == -1)
+            return -1;
+        s->own_out = 1;
+    }
+
+    // Input made here has been written to, or chained, up to its end
+    if (s->own_in && lseek(s->in_fd, 0, SEEK_SET) == -1) {
+        perror("Couldn't rewind input");
+        return -1;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.fd = s->in_fd;
+    st.out_fd = s->out_fd;
+    switch (s->kind) {
+    case TF_JOINER:
+        ret = join_run(&st);
+        break;
+    case TF_GROUPER:
+        ret = group_run(&st, &s->group);
+        break;
+    case TF_SORTER:
+        ret = sort_run(&st, &s->sort);
+        break;
+    }
+
+    if (s->own_out && lseek(s->out_fd, 0, SEEK_SET) == -1) {
+        perror("Couldn't rewind output");
+        return -1;
+    }
+    return ret;
+}
+
+ssize_t tf_pull(struct tf_stage *s, void *buf, size_t len) {
+    ssize_t n;
+
+    if (!s->ran || !s->own_out) {
+        fprintf(stderr, "Stage has no output to pull\n");
+        return -1;
+    }
+    n = read(s->out_fd, buf, len);
+    if (n < 0)
+        perror("Couldn't read output");
+    return n;
+}
+
+int tf_chain(struct tf_stage *from, struct tf_stage *to) {
+    if (!from->ran || !from->own_out) {
+        fprintf(stderr, "Stage has no output to pass on\n");
+        return -1;
+    }
+    if (to->ran || to->in_fd != -1) {
+        fprintf(stderr, "Stage already has its input\n");
+        return -1;
+    }
+
+    to->in_fd = from->out_fd;
+    to->own_in = 1;
+    from->out_fd = -1;
+    from->own_out = 0;
+    return 0;
+}
+
+int tf_pipeline(int in_fd, int out_fd, const struct tf_group_opts *group,
+                const struct tf_sort_opts *sort) {
+    struct tf_stage *joiner, *grouper, *sorter;
+    int ret = -1;
+
+    joiner = tf_joiner_new();
+    grouper = tf_grouper_new(group);
+    sorter = tf_sorter_new(sort);
+    if (joiner && grouper && sorter
+     && !tf_set_input(joiner, in_fd)
+     && !tf_run(joiner)
+     && !tf_chain(joiner, grouper)
+     && !tf_run(grouper)
+     && !tf_chain(grouper, sorter)
+     && !tf_set_output(sorter, out_fd)
+     && !tf_run(sorter))
+        ret = 0;
+
+    tf_free(joiner);
+    tf_free(grouper);
+    tf_free(sorter);
+    return ret;
+}
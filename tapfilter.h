@@ -0,0 +1,88 @@
+#ifndef __TAPFILTER_H__
+#define __TAPFILTER_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* libtapfilter: the joiner, grouper and sorter, as a library, so that a
+ * program can run them in-process rather than spawning the tools.
+ *
+ * Each stage is a context, made with tf_joiner_new(), tf_grouper_new()
+ * or tf_sorter_new() and run once with tf_run().  Its input is either an
+ * fd given with tf_set_input(), or records pushed with tf_push(); its
+ * output goes to an fd given with tf_set_output(), or is kept to be
+ * pulled with tf_pull() or handed to the next stage with tf_chain().
+ * Records are in the tools' file formats: raw capture packets into the
+ * joiner and grouper, grouper events into the sorter, and a sorted file
+ * out of it.
+ *
+ * The stages look back and ahead in their input, and the sorter maps it,
+ * so a stage runs over all of its input at once, and fds given to it must
+ * be of regular files (or memfds).  Pushed input, and output kept for the
+ * next stage, live in memfds: in memory, never on disk, and handed from
+ * stage to stage without being copied.
+ *
+ * Stages print progress to stdout, as the tools do.  Each keeps its state
+ * in its own context, so any stages can run side by side.
+ */
+
+struct tf_stage;
+
+struct tf_group_opts {
+    int collapse;       // Collapse status polls and vendor commands (-c)
+    int ordered;        // Write events strictly in order of start time (-o)
+    int threads;        // NAND decoder threads (-j), 0 for one per CPU
+
+    /* If set, payloads are stored once in <blob_path>.blob (-d), where
+     * blob_path is the event file the references will be read through.
+     */
+    const char *blob_path;
+};
+
+struct tf_sort_opts {
+    int threads;        // Sorting and writing threads (-j), 0 for one per CPU
+    size_t budget_mb;   // Memory for keys (-m), 0 for the default
+    int wide;           // Always use 64-bit jump table entries (-w)
+
+    // If set, secondary indexes are written to <index_path>.idx (-i)
+    const char *index_path;
+
+    /* If set, the output fd is append_path, an existing sorted file
+     * (opened for reading and writing), and the events are added to it
+     * (-a).  Their payloads are added to its blob file from input_path's.
+     */
+    const char *append_path;
+    const char *input_path;
+};
+
+struct tf_stage *tf_joiner_new(void);
+struct tf_stage *tf_grouper_new(const struct tf_group_opts *opts);
+struct tf_stage *tf_sorter_new(const struct tf_sort_opts *opts);
+void tf_free(struct tf_stage *s);
+
+// The fds stay the caller's, and aren't closed by tf_free()
+int tf_set_input(struct tf_stage *s, int fd);
+int tf_set_output(struct tf_stage *s, int fd);
+
+// Add records to the end of a stage's input, before it's run
+int tf_push(struct tf_stage *s, const void *data, size_t len);
+
+// Returns 0 once the stage has been through all of its input
+int tf_run(struct tf_stage *s);
+
+/* Read the next len bytes or less of a stage's output, after it's run,
+ * unless the output went to an fd.  Returns 0 at the end.
+ */
+ssize_t tf_pull(struct tf_stage *s, void *buf, size_t len);
+
+// Make from's output, after it's run, to's input
+int tf_chain(struct tf_stage *from, struct tf_stage *to);
+
+/* Join, group and sort the capture in in_fd into a sorted file in out_fd,
+ * with nothing in between written to disk.  Either set of options may be
+ * NULL, for the defaults.
+ */
+int tf_pipeline(int in_fd, int out_fd, const struct tf_group_opts *group,
+                const struct tf_sort_opts *sort);
+
+#endif // __TAPFILTER_H__
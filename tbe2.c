@@ -0,0 +1,839 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "event-struct.h"
+
+/* Version 2 event files ("TBE2").
+ * Records start on 8-byte boundaries, with an aligned little-endian header
+ * (struct tbe2_header) that can be read straight out of a map of the
+ * file.  There's no jump table at the front: the file ends with an index
+ * of record offsets and a footer saying where it is, so a file is written
+ * in one pass without knowing beforehand how many events it will hold.
+ *
+ *   struct tbe2_file_header
+ *   Records, each padded to a multiple of 8 bytes
+ *   Index: the offset of each record, in order (64 bits each)
+ *   struct tbe2_footer
+ *
+ * Event bodies are converted too, into the aligned little-endian layouts
+ * of the tbe2_* body structs, so their fields can be read in place as
+ * well.  Going back, bodies come out in version 1's compact layout.
+ */
+
+#define TBE2_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+// Index offsets are gathered here before going on the end
+#define TBE2_INDEX_ENTRIES 65536
+#define TBE2_BUFFER (1024 * 1024)
+
+// No body grows past the largest version 1 event in converting
+#define TBE2_RECORD_MAX TBE2_ALIGN(sizeof(struct tbe2_header) + sizeof(union evt))
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            perror("Couldn't write events");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint16_t get_be16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+static void put_be16(uint8_t *p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+// A body being taken apart, from the front
+struct body_in {
+    const uint8_t *p, *end;
+};
+
+// The next len bytes of the body, or NULL if it's too short
+static const uint8_t *take(struct body_in *in, size_t len) {
+    const uint8_t *p = in->p;
+
+    if (len > in->end - in->p)
+        return NULL;
+    in->p += len;
+    return p;
+}
+
+// Copy a payload, or the reference standing in for it, to out + *o
+static int payload_to_v2(struct body_in *in, int ref, uint32_t len,
+                         uint8_t *out, uint32_t *o) {
+    const uint8_t *p;
+
+    if (ref) {
+        struct tbe2_payload_ref r;
+
+        if (!(p = take(in, sizeof(struct evt_payload_ref))))
+            return -1;
+        r.hash = htole64(get_be64(p));
+        r.offset = htole64(get_be64(p + sizeof(uint64_t)));
+        memcpy(out + *o, &r, sizeof(r));
+        *o += sizeof(r);
+        return 0;
+    }
+    if (!(p = take(in, len)))
+        return -1;
+    memcpy(out + *o, p, len);
+    *o += len;
+    return 0;
+}
+
+static int payload_to_v1(struct body_in *in, int ref, uint32_t len,
+                         uint8_t *out, uint32_t *o) {
+    const uint8_t *p;
+
+    if (ref) {
+        struct tbe2_payload_ref r;
+
+        if (!(p = take(in, sizeof(r))))
+            return -1;
+        memcpy(&r, p, sizeof(r));
+        put_be64(out + *o, le64toh(r.hash));
+        put_be64(out + *o + sizeof(uint64_t), le64toh(r.offset));
+        *o += sizeof(struct evt_payload_ref);
+        return 0;
+    }
+    if (!(p = take(in, len)))
+        return -1;
+    memcpy(out + *o, p, len);
+    *o += len;
+    return 0;
+}
+
+/* Turn a compact version 1 body into a version 2 one at out, returning
+ * its length, or -1 if the body doesn't hold together
+ */
+static int body_to_v2(uint8_t type, const uint8_t *body, uint32_t len,
+                      uint8_t *out) {
+    struct body_in in = { body, body + len };
+    int ref = !!(type & EVT_FLAG_REF);
+    const uint8_t *p;
+    uint32_t o;
+    uint32_t i;
+
+    switch (type & ~EVT_FLAG_REF) {
+    case EVT_SD_CMD: {
+        struct tbe2_sd_cmd sd;
+        const uint8_t *args;
+        uint32_t num_args, num_results;
+
+        memset(&sd, 0, sizeof(sd));
+        if (!(p = take(&in, 1 + sizeof(uint32_t))))
+            return -1;
+        sd.cmd = p[0];
+        num_args = get_be32(p + 1);
+        if (num_args > sizeof(((struct evt_sd_cmd *)0)->args)
+         || !(args = take(&in, num_args))
+         || !(p = take(&in, sizeof(uint32_t))))
+            return -1;
+        num_results = get_be32(p);
+        if (num_results > sizeof(((struct evt_sd_cmd *)0)->result))
+            return -1;
+
+        o = sizeof(sd);
+        memcpy(out + o, args, num_args);
+        memset(out + o + num_args, 0, TBE2_ALIGN(num_args) - num_args);
+        o += TBE2_ALIGN(num_args);
+        if (payload_to_v2(&in, ref, num_results, out, &o)
+         || !(p = take(&in, 1)))
+            return -1;
+        sd.reserved = p[0];
+        sd.num_args = htole32(num_args);
+        sd.num_results = htole32(num_results);
+        memcpy(out, &sd, sizeof(sd));
+        break;
+    }
+
+    case EVT_SD_MULTI: {
+        struct tbe2_sd_multi multi;
+        uint32_t num_blocks;
+
+        memset(&multi, 0, sizeof(multi));
+        if (!(p = take(&in, 2 + sizeof(uint32_t) + 1 + sizeof(multi.result)
+                            + sizeof(uint32_t))))
+            return -1;
+        multi.cmd = p[0];
+        multi.flags = p[1];
+        multi.sector = htole32(get_be32(p + 2));
+        multi.num_results = p[6];
+        memcpy(multi.result, p + 7, sizeof(multi.result));
+        num_blocks = get_be32(p + 7 + sizeof(multi.result));
+        if (num_blocks > sizeof(((struct evt_sd_multi *)0)->blocks)
+                       / sizeof(struct evt_sd_block))
+            return -1;
+        multi.num_blocks = htole32(num_blocks);
+        memcpy(out, &multi, sizeof(multi));
+
+        o = sizeof(multi);
+        for (i=0; i<num_blocks; i++) {
+            struct tbe2_sd_block blk;
+
+            if (!(p = take(&in, sizeof(struct evt_sd_block))))
+                return -1;
+            blk.sec = htole32(get_be32(p));
+            blk.nsec = htole32(get_be32(p + sizeof(uint32_t)));
+            memcpy(out + o, &blk, sizeof(blk));
+            o += sizeof(blk);
+        }
+        if (payload_to_v2(&in, ref, num_blocks * SD_BLOCK_SIZE, out, &o))
+            return -1;
+        break;
+    }
+
+    case EVT_NAND_READ:
+    case EVT_NAND_CHANGE_READ_COLUMN: {
+        struct tbe2_nand_read rd;
+        uint32_t count;
+
+        memset(&rd, 0, sizeof(rd));
+        if (!(p = take(&in, sizeof(rd.addr) + sizeof(uint32_t))))
+            return -1;
+        memcpy(rd.addr, p, sizeof(rd.addr));
+        count = get_be32(p + sizeof(rd.addr));
+        if (count > sizeof(((struct evt_nand_read *)0)->data))
+            return -1;
+        rd.count = htole32(count);
+
+        o = sizeof(rd);
+        if (payload_to_v2(&in, ref, count, out, &o)
+         || !(p = take(&in, sizeof(rd.unknown))))
+            return -1;
+        memcpy(rd.unknown, p, sizeof(rd.unknown));
+        memcpy(out, &rd, sizeof(rd));
+        break;
+    }
+
+    case EVT_NAND_PARAMETER_READ: {
+        struct tbe2_nand_parameter_read param;
+        uint16_t count;
+
+        memset(&param, 0, sizeof(param));
+        if (!(p = take(&in, 1 + sizeof(uint16_t))))
+            return -1;
+        param.addr = p[0];
+        count = get_be16(p + 1);
+        if (count > sizeof(((struct evt_nand_parameter_read *)0)->data)
+         || !(p = take(&in, count)))
+            return -1;
+        param.count = htole16(count);
+        memcpy(out, &param, sizeof(param));
+        memcpy(out + sizeof(param), p, count);
+        o = sizeof(param) + count;
+        break;
+    }
+
+    case EVT_NAND_STATUS_RUN: {
+        struct tbe2_nand_status_run run;
+        uint16_t num_changes;
+
+        memset(&run, 0, sizeof(run));
+        if (!(p = take(&in, sizeof(uint32_t) + 1 + sizeof(uint16_t))))
+            return -1;
+        run.count = htole32(get_be32(p));
+        run.status = p[4];
+        num_changes = get_be16(p + 5);
+        if (num_changes > sizeof(((struct evt_nand_status_run *)0)->changes)
+                        / sizeof(struct evt_nand_status_change))
+            return -1;
+        run.num_changes = htole16(num_changes);
+        memcpy(out, &run, sizeof(run));
+
+        o = sizeof(run);
+        for (i=0; i<num_changes; i++) {
+            struct tbe2_nand_status_change change;
+
+            if (!(p = take(&in, sizeof(struct evt_nand_status_change))))
+                return -1;
+            memset(&change, 0, sizeof(change));
+            change.index = htole32(get_be32(p));
+            change.sec = htole32(get_be32(p + 4));
+            change.nsec = htole32(get_be32(p + 8));
+            change.status = p[12];
+            memcpy(out + o, &change, sizeof(change));
+            o += sizeof(change);
+        }
+        break;
+    }
+
+    case EVT_NAND_SANDISK_MACRO: {
+        struct tbe2_nand_sandisk_macro macro;
+        size_t steps;
+
+        memset(&macro, 0, sizeof(macro));
+        if (!(p = take(&in, sizeof(uint32_t) + 1)))
+            return -1;
+        macro.repeats = htole32(get_be32(p));
+        macro.num_steps = p[4];
+        steps = macro.num_steps * sizeof(struct evt_nand_macro_step);
+        if (macro.num_steps > sizeof(((struct evt_nand_sandisk_macro *)0)->steps)
+                            / sizeof(struct evt_nand_macro_step)
+         || !(p = take(&in, steps)))
+            return -1;
+        memcpy(out, &macro, sizeof(macro));
+        memcpy(out + sizeof(macro), p, steps);
+        o = sizeof(macro) + steps;
+        break;
+    }
+
+    case EVT_HELLO: {
+        struct tbe2_hello hello;
+
+        memset(&hello, 0, sizeof(hello));
+        if (!(p = take(&in, sizeof(uint32_t) + 1 + sizeof(uint32_t))))
+            return -1;
+        hello.magic1 = htole32(get_be32(p));
+        hello.version = p[4];
+        hello.magic2 = htole32(get_be32(p + 5));
+        memcpy(out, &hello, sizeof(hello));
+        o = sizeof(hello);
+        break;
+    }
+
+    case EVT_NET_CMD: {
+        struct tbe2_net_cmd net;
+
+        memset(&net, 0, sizeof(net));
+        if (!(p = take(&in, sizeof(net.cmd) + sizeof(uint32_t))))
+            return -1;
+        memcpy(net.cmd, p, sizeof(net.cmd));
+        net.arg = htole32(get_be32(p + sizeof(net.cmd)));
+        memcpy(out, &net, sizeof(net));
+        o = sizeof(net);
+        break;
+    }
+
+    case EVT_NAND_UNKNOWN: {
+        struct tbe2_nand_unk unk;
+
+        if (!(p = take(&in, 2 + sizeof(uint16_t))))
+            return -1;
+        unk.data = p[0];
+        unk.ctrl = p[1];
+        unk.unknown = htole16(get_be16(p + 2));
+        memcpy(out, &unk, sizeof(unk));
+        o = sizeof(unk);
+        break;
+    }
+
+    default:
+        // Only bytes, which need no converting
+        memcpy(out, body, len);
+        return len;
+    }
+
+    // Anything left over means the body wasn't what its type says
+    return in.p == in.end ? o : -1;
+}
+
+/* Turn a version 2 body back into a compact version 1 one at out,
+ * returning its length, or -1 if the body doesn't hold together
+ */
+static int body_to_v1(uint8_t type, const uint8_t *body, uint32_t len,
+                      uint8_t *out) {
+    struct body_in in = { body, body + len };
+    int ref = !!(type & EVT_FLAG_REF);
+    const uint8_t *p;
+    uint32_t o;
+    uint32_t i;
+
+    switch (type & ~EVT_FLAG_REF) {
+    case EVT_SD_CMD: {
+        struct tbe2_sd_cmd sd;
+        uint32_t num_args, num_results;
+
+        if (!(p = take(&in, sizeof(sd))))
+            return -1;
+        memcpy(&sd, p, sizeof(sd));
+        num_args = le32toh(sd.num_args);
+        num_results = le32toh(sd.num_results);
+        if (num_args > sizeof(((struct evt_sd_cmd *)0)->args)
+         || num_results > sizeof(((struct evt_sd_cmd *)0)->result)
+         || !(p = take(&in, TBE2_ALIGN(num_args))))
+            return -1;
+
+        out[0] = sd.cmd;
+        put_be32(out + 1, num_args);
+        memcpy(out + 1 + sizeof(uint32_t), p, num_args);
+        o = 1 + sizeof(uint32_t) + num_args;
+        put_be32(out + o, num_results);
+        o += sizeof(uint32_t);
+        if (payload_to_v1(&in, ref, num_results, out, &o))
+            return -1;
+        out[o++] = sd.reserved;
+        break;
+    }
+
+    case EVT_SD_MULTI: {
+        struct tbe2_sd_multi multi;
+        uint32_t num_blocks;
+
+        if (!(p = take(&in, sizeof(multi))))
+            return -1;
+        memcpy(&multi, p, sizeof(multi));
+        num_blocks = le32toh(multi.num_blocks);
+        if (num_blocks > sizeof(((struct evt_sd_multi *)0)->blocks)
+                       / sizeof(struct evt_sd_block))
+            return -1;
+
+        out[0] = multi.cmd;
+        out[1] = multi.flags;
+        put_be32(out + 2, le32toh(multi.sector));
+        out[6] = multi.num_results;
+        memcpy(out + 7, multi.result, sizeof(multi.result));
+        put_be32(out + 7 + sizeof(multi.result), num_blocks);
+        o = 7 + sizeof(multi.result) + sizeof(uint32_t);
+        for (i=0; i<num_blocks; i++) {
+            struct tbe2_sd_block blk;
+
+            if (!(p = take(&in, sizeof(blk))))
+                return -1;
+            memcpy(&blk, p, sizeof(blk));
+            put_be32(out + o, le32toh(blk.sec));
+            put_be32(out + o + sizeof(uint32_t), le32toh(blk.nsec));
+            o += sizeof(struct evt_sd_block);
+        }
+        if (payload_to_v1(&in, ref, num_blocks * SD_BLOCK_SIZE, out, &o))
+            return -1;
+        break;
+    }
+
+    case EVT_NAND_READ:
+    case EVT_NAND_CHANGE_READ_COLUMN: {
+        struct tbe2_nand_read rd;
+        uint32_t count;
+
+        if (!(p = take(&in, sizeof(rd))))
+            return -1;
+        memcpy(&rd, p, sizeof(rd));
+        count = le32toh(rd.count);
+        if (count > sizeof(((struct evt_nand_read *)0)->data))
+            return -1;
+
+        memcpy(out, rd.addr, sizeof(rd.addr));
+        put_be32(out + sizeof(rd.addr), count);
+        o = sizeof(rd.addr) + sizeof(uint32_t);
+        if (payload_to_v1(&in, ref, count, out, &o))
+            return -1;
+        memcpy(out + o, rd.unknown, sizeof(rd.unknown));
+        o += sizeof(rd.unknown);
+        break;
+    }
+
+    case EVT_NAND_PARAMETER_READ: {
+        struct tbe2_nand_parameter_read param;
+        uint16_t count;
+
+        if (!(p = take(&in, sizeof(param))))
+            return -1;
+        memcpy(&param, p, sizeof(param));
+        count = le16toh(param.count);
+        if (count > sizeof(((struct evt_nand_parameter_read *)0)->data)
+         || !(p = take(&in, count)))
+            return -1;
+        out[0] = param.addr;
+        put_be16(out + 1, count);
+        memcpy(out + 1 + sizeof(uint16_t), p, count);
+        o = 1 + sizeof(uint16_t) + count;
+        break;
+    }
+
+    case EVT_NAND_STATUS_RUN: {
+        struct tbe2_nand_status_run run;
+        uint16_t num_changes;
+
+        if (!(p = take(&in, sizeof(run))))
+            return -1;
+        memcpy(&run, p, sizeof(run));
+        num_changes = le16toh(run.num_changes);
+        if (num_changes > sizeof(((struct evt_nand_status_run *)0)->changes)
+                        / sizeof(struct evt_nand_status_change))
+            return -1;
+
+        put_be32(out, le32toh(run.count));
+        out[4] = run.status;
+        put_be16(out + 5, num_changes);
+        o = 5 + sizeof(uint16_t);
+        for (i=0; i<num_changes; i++) {
+            struct tbe2_nand_status_change change;
+
+            if (!(p = take(&in, sizeof(change))))
+                return -1;
+            memcpy(&change, p, sizeof(change));
+            put_be32(out + o, le32toh(change.index));
+            put_be32(out + o + 4, le32toh(change.sec));
+            put_be32(out + o + 8, le32toh(change.nsec));
+            out[o + 12] = change.status;
+            o += sizeof(struct evt_nand_status_change);
+        }
+        break;
+    }
+
+    case EVT_NAND_SANDISK_MACRO: {
+        struct tbe2_nand_sandisk_macro macro;
+        size_t steps;
+
+        if (!(p = take(&in, sizeof(macro))))
+            return -1;
+        memcpy(&macro, p, sizeof(macro));
+        steps = macro.num_steps * sizeof(struct evt_nand_macro_step);
+        if (macro.num_steps > sizeof(((struct evt_nand_sandisk_macro *)0)->steps)
+                            / sizeof(struct evt_nand_macro_step)
+         || !(p = take(&in, steps)))
+            return -1;
+        put_be32(out, le32toh(macro.repeats));
+        out[4] = macro.num_steps;
+        memcpy(out + 5, p, steps);
+        o = 5 + steps;
+        break;
+    }
+
+    case EVT_HELLO: {
+        struct tbe2_hello hello;
+
+        if (!(p = take(&in, sizeof(hello))))
+            return -1;
+        memcpy(&hello, p, sizeof(hello));
+        put_be32(out, le32toh(hello.magic1));
+        out[4] = hello.version;
+        put_be32(out + 5, le32toh(hello.magic2));
+        o = 5 + sizeof(uint32_t);
+        break;
+    }
+
+    case EVT_NET_CMD: {
+        struct tbe2_net_cmd net;
+
+        if (!(p = take(&in, sizeof(net))))
+            return -1;
+        memcpy(&net, p, sizeof(net));
+        memcpy(out, net.cmd, sizeof(net.cmd));
+        put_be32(out + sizeof(net.cmd), le32toh(net.arg));
+        o = sizeof(net.cmd) + sizeof(uint32_t);
+        break;
+    }
+
+    case EVT_NAND_UNKNOWN: {
+        struct tbe2_nand_unk unk;
+
+        if (!(p = take(&in, sizeof(unk))))
+            return -1;
+        memcpy(&unk, p, sizeof(unk));
+        out[0] = unk.data;
+        out[1] = unk.ctrl;
+        put_be16(out + 2, le16toh(unk.unknown));
+        o = 2 + sizeof(uint16_t);
+        break;
+    }
+
+    default:
+        if (len > sizeof(union evt) - sizeof(struct evt_header))
+            return -1;
+        memcpy(out, body, len);
+        return len;
+    }
+
+    return in.p == in.end ? o : -1;
+}
+
+static int tbe2_writer_flush(struct tbe2_writer *w) {
+    size_t index_bytes = w->index_len * sizeof(*w->index);
+
+    if (write_all(w->fd, w->buf, w->buf_len))
+        return -1;
+    w->buf_len = 0;
+
+    if (pwrite(w->index_fd, w->index, index_bytes, w->index_bytes) != index_bytes) {
+        perror("Couldn't write index");
+        return -1;
+    }
+    w->index_bytes += index_bytes;
+    w->index_len = 0;
+    return 0;
+}
+
+// Start writing a version 2 file to fd, which needn't be seekable
+int tbe2_writer_open(struct tbe2_writer *w, int fd) {
+    struct tbe2_file_header hdr;
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->flags = TBE2_SORTED;
+    w->index_fd = -1;
+    w->buf = malloc(TBE2_BUFFER);
+    w->index = malloc(TBE2_INDEX_ENTRIES * sizeof(*w->index));
+    w->rec = malloc(sizeof(*w->rec));
+    if (!w->buf || !w->index || !w->rec) {
+        perror("Couldn't allocate output buffers");
+        tbe2_writer_discard(w);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/tbe2-XXXXXX", dir ? dir : "/tmp");
+    w->index_fd = mkstemp(path);
+    if (w->index_fd == -1) {
+        perror("Couldn't create index file");
+        tbe2_writer_discard(w);
+        return -1;
+    }
+    unlink(path);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TBE2_MAGIC, sizeof(hdr.magic));
+    hdr.version = htole32(TBE2_VERSION);
+    memcpy(w->buf, &hdr, sizeof(hdr));
+    w->buf_len = sizeof(hdr);
+    w->offset = sizeof(hdr);
+    return 0;
+}
+
+// Add a version 1 record (struct evt_header and body) to the file
+int tbe2_write(struct tbe2_writer *w, const void *arg, uint32_t size) {
+    const struct evt_header *v1 = arg;
+    struct tbe2_header hdr;
+    uint64_t padded;
+    uint64_t time;
+    int body;
+
+    if (size < sizeof(*v1) || size > sizeof(union evt)) {
+        fprintf(stderr, "Bad event size %u\n", size);
+        return -1;
+    }
+    if ((w->buf_len + TBE2_RECORD_MAX > TBE2_BUFFER
+      || w->index_len == TBE2_INDEX_ENTRIES)
+     && tbe2_writer_flush(w))
+        return -1;
+
+    // Older files can have records in the fixed layout
+    if (size == evt_fixed_size(v1->type)) {
+        memcpy(w->rec, arg, size);
+        size = evt_compact(w->rec, size);
+        v1 = &w->rec->header;
+    }
+
+    body = body_to_v2(v1->type, (const uint8_t *)(v1 + 1), size - sizeof(*v1),
+                      w->buf + w->buf_len + sizeof(hdr));
+    if (body < 0) {
+        fprintf(stderr, "Bad event of type %d\n", v1->type);
+        return -1;
+    }
+    padded = TBE2_ALIGN(sizeof(hdr) + body);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.sec_start = htole32(ntohl(v1->sec_start));
+    hdr.nsec_start = htole32(ntohl(v1->nsec_start));
+    hdr.sec_end = htole32(ntohl(v1->sec_end));
+    hdr.nsec_end = htole32(ntohl(v1->nsec_end));
+    hdr.size = htole32(sizeof(hdr) + body);
+    hdr.type = v1->type;
+
+    // Note whether the records are still in order of start time
+    time = ((uint64_t)ntohl(v1->sec_start) << 32) | ntohl(v1->nsec_start);
+    if (time < w->last_time)
+        w->flags &= ~TBE2_SORTED;
+    w->last_time = time;
+
+    memcpy(w->buf + w->buf_len, &hdr, sizeof(hdr));
+    memset(w->buf + w->buf_len + sizeof(hdr) + body, 0,
+           padded - sizeof(hdr) - body);
+    w->buf_len += padded;
+
+    w->index[w->index_len++] = htole64(w->offset);
+    w->offset += padded;
+    w->count++;
+    return 0;
+}
+
+// Add the index and footer, which finish the file
+int tbe2_writer_close(struct tbe2_writer *w) {
+    struct tbe2_footer footer;
+    uint64_t index_offset = w->offset;
+    uint64_t pos;
+    int ret = -1;
+
+    if (tbe2_writer_flush(w))
+        goto out;
+
+    // The index was gathered in a temporary file, and goes on the end
+    for (pos=0; pos<w->index_bytes; ) {
+        size_t len = w->index_bytes - pos < TBE2_BUFFER
+                   ? w->index_bytes - pos : TBE2_BUFFER;
+        if (pread(w->index_fd, w->buf, len, pos) != len) {
+            perror("Couldn't read index");
+            goto out;
+        }
+        if (write_all(w->fd, w->buf, len))
+            goto out;
+        pos += len;
+    }
+
+    memset(&footer, 0, sizeof(footer));
+    footer.count = htole64(w->count);
+    footer.index_offset = htole64(index_offset);
+    footer.flags = htole32(w->flags);
+    footer.version = htole32(TBE2_VERSION);
+    memcpy(footer.magic, TBE2_MAGIC, sizeof(footer.magic));
+    ret = write_all(w->fd, &footer, sizeof(footer));
+
+out:
+    tbe2_writer_discard(w);
+    return ret;
+}
+
+// Let go of a writer without finishing its file
+void tbe2_writer_discard(struct tbe2_writer *w) {
+    if (w->index_fd != -1)
+        close(w->index_fd);
+    free(w->buf);
+    free(w->index);
+    free(w->rec);
+    w->index_fd = -1;
+    w->buf = NULL;
+    w->index = NULL;
+    w->rec = NULL;
+}
+
+
+int tbe2_open(struct tbe2_file *f, const char *filename) {
+    struct tbe2_file_header hdr;
+    struct tbe2_footer footer;
+    struct stat stat_buf;
+    uint64_t index_offset;
+
+    memset(f, 0, sizeof(*f));
+    f->fd = open(filename, O_RDONLY);
+    if (f->fd == -1) {
+        perror("Unable to open event file");
+        return -1;
+    }
+    if (fstat(f->fd, &stat_buf) == -1) {
+        perror("Couldn't stat event file");
+        goto err;
+    }
+    f->size = stat_buf.st_size;
+    if (f->size < sizeof(hdr) + sizeof(footer)) {
+        fprintf(stderr, "%s is too short to be a version 2 event file\n", filename);
+        goto err;
+    }
+
+    f->map = mmap(NULL, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (f->map == MAP_FAILED) {
+        perror("Couldn't map event file");
+        goto err;
+    }
+
+    memcpy(&hdr, f->map, sizeof(hdr));
+    memcpy(&footer, f->map + f->size - sizeof(footer), sizeof(footer));
+    if (memcmp(hdr.magic, TBE2_MAGIC, sizeof(hdr.magic))
+     || memcmp(footer.magic, TBE2_MAGIC, sizeof(footer.magic))) {
+        fprintf(stderr, "%s isn't a finished version 2 event file\n", filename);
+        goto err_unmap;
+    }
+    if (le32toh(hdr.version) != TBE2_VERSION) {
+        fprintf(stderr, "%s is version %u, which this can't read\n",
+                filename, le32toh(hdr.version));
+        goto err_unmap;
+    }
+
+    f->count = le64toh(footer.count);
+    f->flags = le32toh(footer.flags);
+    index_offset = le64toh(footer.index_offset);
+    if ((index_offset & 7)
+     || index_offset > f->size - sizeof(footer)
+     || f->count != (f->size - sizeof(footer) - index_offset) / sizeof(uint64_t)) {
+        fprintf(stderr, "%s has a damaged index\n", filename);
+        goto err_unmap;
+    }
+    f->index = (const uint64_t *)(f->map + index_offset);
+    return 0;
+
+err_unmap:
+    munmap(f->map, f->size);
+err:
+    close(f->fd);
+    return -1;
+}
+
+void tbe2_close(struct tbe2_file *f) {
+    munmap(f->map, f->size);
+    close(f->fd);
+}
+
+// Record i, in place in the map, or NULL if the index is bad
+const struct tbe2_header *tbe2_event(struct tbe2_file *f, uint64_t i) {
+    uint64_t offset = le64toh(f->index[i]);
+    const struct tbe2_header *hdr;
+
+    if ((offset & 7) || offset > f->size - sizeof(*hdr))
+        return NULL;
+    hdr = (const struct tbe2_header *)(f->map + offset);
+    if (le32toh(hdr->size) < sizeof(*hdr)
+     || le32toh(hdr->size) > f->size - offset)
+        return NULL;
+    return hdr;
+}
+
+/* Turn a record back into a version 1 one at out, which has room for a
+ * union evt.  Returns its size, or -1 if the record is damaged.
+ */
+int tbe2_to_v1(const struct tbe2_header *hdr, void *out) {
+    struct evt_header *v1 = out;
+    int body;
+
+    body = body_to_v1(hdr->type, (const uint8_t *)(hdr + 1),
+                      le32toh(hdr->size) - sizeof(*hdr), (uint8_t *)(v1 + 1));
+    if (body < 0)
+        return -1;
+    v1->type = hdr->type;
+    v1->sec_start = htonl(le32toh(hdr->sec_start));
+    v1->nsec_start = htonl(le32toh(hdr->nsec_start));
+    v1->sec_end = htonl(le32toh(hdr->sec_end));
+    v1->nsec_end = htonl(le32toh(hdr->nsec_end));
+    v1->size = htonl(sizeof(*v1) + body);
+    return sizeof(*v1) + body;
+}